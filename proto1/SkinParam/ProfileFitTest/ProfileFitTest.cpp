@@ -0,0 +1,87 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Regression tests of the profile calculator, the Gaussian fits and the spectrum
+ * expressions
+ *
+ * Runs from the project directory, where the reference file is checked in. Returns
+ * nonzero if any test fails.
+ */
+
+#include "stdafx.h"
+#include "ProfileFitTest.h"
+
+#include <iostream>
+
+using namespace std;
+using namespace Utils;
+
+CWinApp theApp;
+
+namespace {
+
+	const TCHAR* const DEFAULT_REFERENCE_FILE = _T("reference_profiles.txt");
+
+	void printUsage(const TCHAR* program) {
+		cout << "Usage: " << ANSIStringFromTString(program) << " [-ref <file>] [-regenerate]" << endl;
+		cout << "  -ref <file>   Reference profiles, default " << ANSIStringFromTString(DEFAULT_REFERENCE_FILE) << endl;
+		cout << "  -regenerate   Rewrite the reference profiles from the current code" << endl;
+	}
+
+} // namespace
+
+int _tmain(int argc, TCHAR* argv[])
+{
+	if (!AfxWinInit(::GetModuleHandle(NULL), NULL, ::GetCommandLine(), 0)) {
+		cerr << "Failed to initialize MFC" << endl;
+		return 1;
+	}
+
+	TString referenceFilename = DEFAULT_REFERENCE_FILE;
+	bool regenerate = false;
+	for (int i = 1; i < argc; i++) {
+		const TCHAR* arg = argv[i];
+		if (!_tcsicmp(arg, _T("-ref")) && i + 1 < argc) {
+			referenceFilename = argv[++i];
+		} else if (!_tcsicmp(arg, _T("-regenerate"))) {
+			regenerate = true;
+		} else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	bool passed = TestSpectrumExpressions();
+	passed = TestReferenceProfiles(referenceFilename, regenerate) && passed;
+	cout << (passed ? "All tests passed" : "Some tests FAILED") << endl;
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,394 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Diffusion profiles and Gaussian fits checked against reference_profiles.txt
+ *
+ * Each case is computed with both profile engines and fitted the way GaussianFitTask
+ * fits a spectral component. The reference file is written by the same code with
+ * -regenerate, so a change of the results shows up as a failure until it is rewritten.
+ * GF_FitBestWindow is checked to pick the same window and coefficients as fitting every
+ * window with GF_FitSumGaussians.
+ */
+
+#include "stdafx.h"
+#include "ProfileFitTest.h"
+
+#include "ProfileFit/MultipoleProfileCalculator.h"
+#include "ProfileFit/gaussianfit.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace Utils;
+
+namespace {
+
+	struct ProfileCase {
+		const char* name;
+		uint32_t numLayers;
+		MPC_LayerSpec layers[2];
+		float adaptiveTolerance;
+	};
+
+	// Thick enough that the layers below add nothing, see TestAnalyticProfile
+	const MPC_LayerSpec THICK_DERMIS = { 0.f, 1.4f, 0.05f, 2.0f, 20.f };
+
+	const ProfileCase CASES[] = {
+		{ "dermis", 1, { THICK_DERMIS }, 0.f },
+		{ "skin", 2, { { 0.f, 1.4f, 0.3f, 4.0f, 0.25f }, THICK_DERMIS }, 0.f },
+		{ "absorbing", 2, { { 0.f, 1.4f, 2.5f, 5.0f, 0.25f }, { 0.f, 1.4f, 0.5f, 2.5f, 20.f } }, 0.f },
+		{ "clear", 2, { { 0.f, 1.4f, 0.02f, 3.0f, 0.25f }, { 0.f, 1.4f, 0.01f, 1.5f, 20.f } }, 0.f },
+		{ "thinscatter", 2, { { 0.f, 1.4f, 0.3f, 1.0f, 0.25f }, THICK_DERMIS }, 0.f },
+		{ "adaptive", 2, { { 0.f, 1.4f, 0.3f, 4.0f, 0.25f }, THICK_DERMIS }, 0.01f },
+	};
+	const int NUM_CASES = sizeof(CASES) / sizeof(CASES[0]);
+
+	const MPC_Engine ENGINES[] = { MPC_ENGINE_SPATIAL, MPC_ENGINE_FREQUENCY };
+	const char* const ENGINE_NAMES[] = { "spatial", "frequency" };
+	const int NUM_ENGINES = sizeof(ENGINES) / sizeof(ENGINES[0]);
+
+	const uint32_t PROFILE_LENGTH = 256;
+	const float FIT_SIGMAS[] = { 0.04f, 0.08f, 0.16f, 0.32f, 0.64f, 1.28f };
+	const int NUM_FIT_SIGMAS = sizeof(FIT_SIGMAS) / sizeof(FIT_SIGMAS[0]);
+	// Sigmas of the window search, 0.01 * 2^i, in windows of the size GaussianFitTask uses
+	const int NUM_WINDOW_SIGMAS = 12;
+	const int WINDOW_SIGMAS = 6;
+
+	// Tolerances relative to the peak of the reference profile. They allow for the
+	// rounding of another compiler, not for a change of the model.
+	const double PROFILE_TOLERANCE = 1e-4;
+	const double FIT_TOLERANCE = 1e-3;
+	const double FIT_ERROR_TOLERANCE = 1e-4;
+	const double DISTANCE_TOLERANCE = 1e-5;
+	const double ANALYTIC_TOLERANCE = 1e-4;
+
+	const int ANALYTIC_IMAGES = 2;
+	const double PI = 3.14159265358979323846;
+
+	struct ProfileResult {
+		vector<float> distanceSquared;
+		vector<float> reflectance;
+		float fitError;
+		vector<float> fitCoeffs;
+		// Input of the fit, not in the reference file
+		vector<float> fitDistance;
+		vector<float> fitReflectance;
+		vector<float> fitWeights;
+	};
+
+	string resultKey(const char* caseName, const char* engineName) {
+		return string(caseName) + " " + engineName;
+	}
+
+	float meanFreePath(const ProfileCase& pc) {
+		float mfp = 0.f;
+		for (uint32_t i = 0; i < pc.numLayers; i++)
+			mfp += 1.f / (pc.layers[i].mua + pc.layers[i].musp);
+		return mfp / (float)pc.numLayers;
+	}
+
+	// Profile and fit of one case, prepared as GaussianFitTask prepares a component
+	void computeResult(const ProfileCase& pc, MPC_Engine engine, ProfileResult& result) {
+		MPC_Options options;
+		options.desiredLength = PROFILE_LENGTH;
+		options.lerpOnThinSlab = true;
+		options.desiredStepSize = 12.f * meanFreePath(pc) / (float)PROFILE_LENGTH;
+		options.engine = engine;
+		options.adaptiveTolerance = pc.adaptiveTolerance;
+
+		MPC_Output* pOutput;
+		MPC_ComputeDiffusionProfile(pc.numLayers, pc.layers, &options, &pOutput);
+		result.distanceSquared.assign(pOutput->pDistanceSquared, pOutput->pDistanceSquared + pOutput->length);
+		result.reflectance.assign(pOutput->pReflectance, pOutput->pReflectance + pOutput->length);
+
+		if (pc.adaptiveTolerance <= 0.f)
+			MPC_ResampleForUniformDistanceSquaredDistribution(pOutput, pOutput->length);
+		uint32_t length = pOutput->length;
+		vector<float>& distance = result.fitDistance;
+		distance.resize(length);
+		for (uint32_t i = 0; i < length; i++)
+			distance[i] = sqrt(pOutput->pDistanceSquared[i]);
+		result.fitReflectance.assign(pOutput->pReflectance, pOutput->pReflectance + length);
+		// Ring areas as in GaussianFitTask
+		vector<float>& weights = result.fitWeights;
+		if (pc.adaptiveTolerance > 0.f) {
+			weights.resize(length);
+			for (uint32_t i = 0; i < length; i++) {
+				float inner = i > 0 ? 0.5f * (distance[i - 1] + distance[i]) : 0.f;
+				float outer = i + 1 < length ? 0.5f * (distance[i] + distance[i + 1]) : distance[i];
+				weights[i] = outer * outer - inner * inner;
+			}
+		}
+
+		GF_Output* pFit;
+		GF_FitSumGaussians(length, &distance[0], pOutput->pReflectance, NUM_FIT_SIGMAS, FIT_SIGMAS,
+			&pFit, weights.empty() ? NULL : &weights[0]);
+		result.fitError = pFit->overallError;
+		result.fitCoeffs.assign(pFit->pNormalizedCoeffs, pFit->pNormalizedCoeffs + NUM_FIT_SIGMAS);
+		GF_FreeOutput(pFit);
+		MPC_FreeOutput(pOutput);
+	}
+
+	// File layout, one record per case and engine:
+	//   <case> <engine> <length> <fit error> <fit coefficients>
+	//   <distance squared of each sample>
+	//   <reflectance of each sample>
+	void writeResult(ostream& out, const string& key, const ProfileResult& result) {
+		out << key << " " << result.distanceSquared.size() << " " << result.fitError;
+		for (float c : result.fitCoeffs)
+			out << " " << c;
+		out << "\n";
+		for (size_t i = 0; i < result.distanceSquared.size(); i++)
+			out << (i ? " " : "") << result.distanceSquared[i];
+		out << "\n";
+		for (size_t i = 0; i < result.reflectance.size(); i++)
+			out << (i ? " " : "") << result.reflectance[i];
+		out << "\n";
+	}
+
+	bool readResults(const TString& filename, map<string, ProfileResult>& results) {
+		ifstream in(filename);
+		if (!in)
+			return false;
+		string caseName, engineName;
+		size_t length;
+		while (in >> caseName >> engineName >> length) {
+			ProfileResult& result = results[resultKey(caseName.c_str(), engineName.c_str())];
+			result.fitCoeffs.resize(NUM_FIT_SIGMAS);
+			result.distanceSquared.resize(length);
+			result.reflectance.resize(length);
+			in >> result.fitError;
+			for (float& c : result.fitCoeffs)
+				in >> c;
+			for (float& d2 : result.distanceSquared)
+				in >> d2;
+			for (float& r : result.reflectance)
+				in >> r;
+			if (!in || length == 0)
+				return false;
+		}
+		return in.eof();
+	}
+
+	// Reference reflectance at distanceSquared, linear between its samples
+	double interpolate(const ProfileResult& ref, float distanceSquared) {
+		const vector<float>& d2 = ref.distanceSquared;
+		size_t hi = lower_bound(d2.begin(), d2.end(), distanceSquared) - d2.begin();
+		if (hi == 0)
+			return ref.reflectance[0];
+		if (hi == d2.size())
+			return ref.reflectance.back();
+		double t = (distanceSquared - d2[hi - 1]) / (d2[hi] - d2[hi - 1]);
+		return ref.reflectance[hi - 1] + t * (ref.reflectance[hi] - ref.reflectance[hi - 1]);
+	}
+
+	double sumGaussians(const vector<float>& coeffs, double distanceSquared) {
+		double sum = 0.;
+		for (int i = 0; i < NUM_FIT_SIGMAS; i++) {
+			double variance = (double)FIT_SIGMAS[i] * FIT_SIGMAS[i];
+			sum += coeffs[i] * exp(-distanceSquared / (2. * variance)) / (2. * PI * variance);
+		}
+		return sum;
+	}
+
+	bool report(bool passed, const string& name, double deviation) {
+		cout << (passed ? "ok   " : "FAIL ") << name << ", deviation " << deviation << endl;
+		return passed;
+	}
+
+	bool compareResult(const string& key, const ProfileResult& result, const ProfileResult& ref) {
+		double peak = 0.;
+		for (float r : ref.reflectance)
+			peak = max(peak, (double)r);
+
+		// Adaptive sampling may pick other distances, the reference is interpolated at ours
+		double lastRef = ref.distanceSquared.back(), last = result.distanceSquared.back();
+		double rangeDeviation = fabs(last - lastRef) / lastRef;
+		bool passed = report(rangeDeviation <= DISTANCE_TOLERANCE, key + " range", rangeDeviation);
+
+		double profileDeviation = 0.;
+		for (size_t i = 0; i < result.distanceSquared.size(); i++) {
+			double expected = interpolate(ref, result.distanceSquared[i]);
+			profileDeviation = max(profileDeviation, fabs(result.reflectance[i] - expected) / peak);
+		}
+		passed = report(profileDeviation <= PROFILE_TOLERANCE, key + " profile", profileDeviation) && passed;
+
+		// Sums of Gaussians are nearly degenerate in their weights, compare the fitted curves
+		double fitDeviation = 0.;
+		for (float d2 : ref.distanceSquared) {
+			fitDeviation = max(fitDeviation,
+				fabs(sumGaussians(result.fitCoeffs, d2) - sumGaussians(ref.fitCoeffs, d2)) / peak);
+		}
+		passed = report(fitDeviation <= FIT_TOLERANCE, key + " fit", fitDeviation) && passed;
+
+		double errorDeviation = fabs(result.fitError - ref.fitError);
+		passed = report(errorDeviation <= FIT_ERROR_TOLERANCE, key + " fit error", errorDeviation) && passed;
+		return passed;
+	}
+
+	// GF_FitBestWindow against every window fitted in full, with and without a seed. Only
+	// the cost may differ, the window, coefficients and error have to be the same bits.
+	bool testBestWindow(const string& key, const ProfileResult& result) {
+		uint32_t length = (uint32_t)result.fitDistance.size();
+		const float* pWeights = result.fitWeights.empty() ? NULL : &result.fitWeights[0];
+		float sigmas[NUM_WINDOW_SIGMAS];
+		for (int i = 0; i < NUM_WINDOW_SIGMAS; i++)
+			sigmas[i] = 0.01f * (float)(1 << i);
+		const uint32_t numWindows = NUM_WINDOW_SIGMAS - WINDOW_SIGMAS + 1;
+
+		GF_Output* pBest = NULL;
+		uint32_t bestWindow = 0;
+		for (uint32_t window = 0; window < numWindows; window++) {
+			GF_Output* pFit;
+			GF_FitSumGaussians(length, &result.fitDistance[0], &result.fitReflectance[0], WINDOW_SIGMAS,
+				sigmas + window, &pFit, pWeights);
+			if (!pBest || pFit->overallError < pBest->overallError) {
+				swap(pBest, pFit);
+				bestWindow = window;
+			}
+			if (pFit)
+				GF_FreeOutput(pFit);
+		}
+		// The seed of a neighbouring fit, off by a window
+		vector<float> seed(NUM_WINDOW_SIGMAS, 0.f);
+		uint32_t seedWindow = bestWindow + 1 < numWindows ? bestWindow + 1 : bestWindow - 1;
+		for (int k = 0; k < WINDOW_SIGMAS; k++)
+			seed[seedWindow + k] = pBest->pNormalizedCoeffs[k];
+
+		bool passed = true;
+		const float* seeds[] = { NULL, &seed[0] };
+		for (const float* pSeed : seeds) {
+			uint32_t window;
+			GF_Output* pFit;
+			GF_FitBestWindow(length, &result.fitDistance[0], &result.fitReflectance[0], NUM_WINDOW_SIGMAS,
+				sigmas, WINDOW_SIGMAS, 0, numWindows, pSeed, &window, &pFit, pWeights);
+			bool same = window == bestWindow && pFit->overallError == pBest->overallError
+				&& equal(pFit->pNormalizedCoeffs, pFit->pNormalizedCoeffs + WINDOW_SIGMAS, pBest->pNormalizedCoeffs);
+			passed = report(same, key + (pSeed ? " seeded" : "") + " best window",
+				fabs(pFit->overallError - pBest->overallError)) && passed;
+			GF_FreeOutput(pFit);
+		}
+		GF_FreeOutput(pBest);
+		return passed;
+	}
+
+	double dipoleTerm(double z, double sigmaTr, double r) {
+		double d = sqrt(r * r + z * z);
+		return z * (1. + sigmaTr * d) * exp(-sigmaTr * d) / (d * d * d);
+	}
+
+	// Reflectance of a single slab by the multipole sum, evaluated directly in double
+	double multipoleReflectance(const MPC_LayerSpec& ls, double r) {
+		double sigmaT = ls.mua + ls.musp;
+		double alphaPrime = ls.musp / sigmaT;
+		double sigmaTr = sqrt(3. * ls.mua * sigmaT);
+		double zr = 1. / sigmaT;
+		double eta = ls.ior;
+		double fdr = -1.44 / (eta * eta) + 0.71 / eta + 0.668 + 0.0636 * eta;
+		double zb = 2. * (1. + fdr) / (1. - fdr) / (3. * sigmaT);
+		double period = 2. * (ls.thickness + 2. * zb);
+		double sum = 0.;
+		for (int i = -ANALYTIC_IMAGES; i <= ANALYTIC_IMAGES; i++)
+			sum += dipoleTerm(i * period + zr, sigmaTr, r) - dipoleTerm(i * period - zr - 2. * zb, sigmaTr, r);
+		return alphaPrime / (4. * PI) * sum;
+	}
+
+	// The single layer profile of both engines against the multipole model itself
+	bool testAnalyticProfile(const ProfileCase& pc, const string& key, const ProfileResult& result) {
+		double peak = multipoleReflectance(pc.layers[0], 0.);
+		double deviation = 0.;
+		for (size_t i = 0; i < result.distanceSquared.size(); i++) {
+			double expected = multipoleReflectance(pc.layers[0], sqrt((double)result.distanceSquared[i]));
+			deviation = max(deviation, fabs(result.reflectance[i] - expected) / peak);
+		}
+		return report(deviation <= ANALYTIC_TOLERANCE, key + " analytic", deviation);
+	}
+
+} // namespace
+
+bool TestReferenceProfiles(const TString& filename, bool regenerate) {
+	map<string, ProfileResult> refs;
+	if (!regenerate && !readResults(filename, refs)) {
+		cerr << "Failed to read reference profiles: " << ANSIStringFromTString(filename) << endl;
+		return false;
+	}
+
+	ofstream out;
+	if (regenerate) {
+		out.open(filename, ios::out | ios::trunc);
+		if (!out) {
+			cerr << "Failed to write: " << ANSIStringFromTString(filename) << endl;
+			return false;
+		}
+		out.precision(9);
+	}
+
+	bool passed = true;
+	for (int c = 0; c < NUM_CASES; c++) {
+		const ProfileCase& pc = CASES[c];
+		for (int e = 0; e < NUM_ENGINES; e++) {
+			string key = resultKey(pc.name, ENGINE_NAMES[e]);
+			ProfileResult result;
+			computeResult(pc, ENGINES[e], result);
+			if (pc.numLayers == 1)
+				passed = testAnalyticProfile(pc, key, result) && passed;
+			passed = testBestWindow(key, result) && passed;
+
+			if (regenerate) {
+				writeResult(out, key, result);
+				continue;
+			}
+			map<string, ProfileResult>::const_iterator ref = refs.find(key);
+			if (ref == refs.end()) {
+				cout << "FAIL " << key << ", not in the reference file" << endl;
+				passed = false;
+			} else {
+				passed = compareResult(key, result, ref->second) && passed;
+			}
+		}
+	}
+	MPC_ClearCache();
+
+	if (regenerate) {
+		out.close();
+		if (out.fail()) {
+			cerr << "Failed to write: " << ANSIStringFromTString(filename) << endl;
+			return false;
+		}
+	}
+	return passed;
+}
@@ -0,0 +1,203 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Spectrum expressions checked bit for bit against eager evaluation
+ *
+ * Each operator of spectrumexpr.h and the absorption mixes of SkinCoefficients are
+ * evaluated as expressions and with scalar loops over the samples. The sample counts
+ * include ones that are not a multiple of four, so the tail after the SSE loop is
+ * covered as well.
+ */
+
+#include "stdafx.h"
+#include "ProfileFitTest.h"
+
+#include "ProfileFit/skincoeffs.h"
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace ProfileFit;
+
+namespace {
+
+	const int NUM_SKIN_SETS = 20;
+
+	// Deterministic values in [0.5, 2), so that divisions stay finite
+	class TestValues {
+	public:
+		TestValues() : state(12345u) { }
+		float next() {
+			state = state * 1664525u + 1013904223u;
+			return 0.5f + 1.5f * (float)(state >> 8) / (float)(1u << 24);
+		}
+	private:
+		uint32_t state;
+	};
+
+	template <int nSamples>
+	bool sameBits(const CoefficientSpectrum<nSamples>& actual, const float* expected, const string& name) {
+		float samples[nSamples];
+		for (int i = 0; i < nSamples; i++)
+			samples[i] = actual[i];
+		if (memcmp(samples, expected, sizeof(samples)) == 0)
+			return true;
+		cout << "FAIL " << name << endl;
+		return false;
+	}
+
+// Evaluates expr as a spectrum and scalar for each sample i
+#define CHECK_SPECTRUM_EXPR(expr, scalar) \
+	do { \
+		CoefficientSpectrum<nSamples> actual = (expr); \
+		for (int i = 0; i < nSamples; i++) \
+			expected[i] = (scalar); \
+		passed = sameBits(actual, expected, prefix + #expr) && passed; \
+	} while (0)
+
+	template <int nSamples>
+	bool testOperators(TestValues& values) {
+		CoefficientSpectrum<nSamples> a, b;
+		for (int i = 0; i < nSamples; i++) {
+			a[i] = values.next();
+			b[i] = values.next();
+		}
+		float s = values.next(), t = values.next();
+		float expected[nSamples];
+		string prefix = to_string((long long)nSamples) + " samples: ";
+		bool passed = true;
+
+		CHECK_SPECTRUM_EXPR(a + b, a[i] + b[i]);
+		CHECK_SPECTRUM_EXPR(a - b, a[i] - b[i]);
+		CHECK_SPECTRUM_EXPR(a * b, a[i] * b[i]);
+		CHECK_SPECTRUM_EXPR(a / b, a[i] / b[i]);
+		CHECK_SPECTRUM_EXPR(a + s, a[i] + s);
+		CHECK_SPECTRUM_EXPR(s + a, s + a[i]);
+		CHECK_SPECTRUM_EXPR(a - s, a[i] - s);
+		CHECK_SPECTRUM_EXPR(s - a, s - a[i]);
+		CHECK_SPECTRUM_EXPR(a * s, a[i] * s);
+		CHECK_SPECTRUM_EXPR(s * a, s * a[i]);
+		CHECK_SPECTRUM_EXPR(a / s, a[i] / s);
+		CHECK_SPECTRUM_EXPR(s / a, s / a[i]);
+		CHECK_SPECTRUM_EXPR(-a, -a[i]);
+		CHECK_SPECTRUM_EXPR(s * a + t * b, s * a[i] + t * b[i]);
+		CHECK_SPECTRUM_EXPR(-(a - b) * s / (b + t), -(a[i] - b[i]) * s / (b[i] + t));
+
+		CoefficientSpectrum<nSamples> x = a;
+		for (int i = 0; i < nSamples; i++)
+			expected[i] = a[i];
+		x += b;
+		for (int i = 0; i < nSamples; i++)
+			expected[i] += b[i];
+		passed = sameBits(x, expected, prefix + "x += b") && passed;
+		x -= b * s;
+		for (int i = 0; i < nSamples; i++)
+			expected[i] -= b[i] * s;
+		passed = sameBits(x, expected, prefix + "x -= b * s") && passed;
+		x *= b;
+		for (int i = 0; i < nSamples; i++)
+			expected[i] *= b[i];
+		passed = sameBits(x, expected, prefix + "x *= b") && passed;
+		x *= t;
+		for (int i = 0; i < nSamples; i++)
+			expected[i] *= t;
+		passed = sameBits(x, expected, prefix + "x *= t") && passed;
+		x /= s;
+		for (int i = 0; i < nSamples; i++)
+			expected[i] /= s;
+		passed = sameBits(x, expected, prefix + "x /= s") && passed;
+		return passed;
+	}
+
+#undef CHECK_SPECTRUM_EXPR
+
+	// The mixes of SkinCoefficients against the formulas evaluated sample by sample
+	bool testSkinMixes(TestValues& values) {
+		const WLDValue& eumel = SkinCoefficients::mua_eumel();
+		const WLDValue& pheomel = SkinCoefficients::mua_pheomel();
+		const WLDValue& baseline = SkinCoefficients::mua_skinbaseline();
+		// Each hemoglobin spectrum alone, 1 * x + 0 * y is exactly x
+		const WLDValue ohg = SkinCoefficients(0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f).mua_blood();
+		const WLDValue dhg = SkinCoefficients(0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f).mua_blood();
+
+		vector<SkinCoefficients> sets;
+		for (int set = 0; set < NUM_SKIN_SETS; set++) {
+			float f_mel = values.next() / 4.f, f_eu = values.next() / 2.f;
+			float f_blood = values.next() / 10.f, f_ohg = values.next() / 2.f;
+			sets.push_back(SkinCoefficients(f_mel, f_eu, f_blood, f_ohg, 0.f, 0.f, 0.f));
+		}
+		// More sets than a tile of layerCoeffsBatch
+		vector<SkinLayerCoeffs> batch(sets.size());
+		SkinCoefficients::layerCoeffsBatch(&sets[0], sets.size(), &batch[0]);
+
+		bool passed = true;
+		float expected[WLD_nSamples];
+		for (size_t set = 0; set < sets.size(); set++) {
+			const SkinCoefficients& sc = sets[set];
+			string prefix = "skin set " + to_string((long long)set) + ": ";
+
+			for (int i = 0; i < WLD_nSamples; i++) {
+				expected[i] = sc.f_mel * sc.f_eu * eumel[i] + sc.f_mel * (1 - sc.f_eu) * pheomel[i] +
+					(1 - sc.f_mel) * baseline[i];
+			}
+			passed = sameBits(sc.mua_epi(), expected, prefix + "mua_epi") && passed;
+			passed = sameBits(batch[set].mua_epi, expected, prefix + "batched mua_epi") && passed;
+
+			for (int i = 0; i < WLD_nSamples; i++)
+				expected[i] = sc.f_ohg * ohg[i] + (1.f - sc.f_ohg) * dhg[i];
+			passed = sameBits(sc.mua_blood(), expected, prefix + "mua_blood") && passed;
+
+			for (int i = 0; i < WLD_nSamples; i++) {
+				expected[i] = sc.f_blood * sc.f_ohg * ohg[i] + sc.f_blood * (1.f - sc.f_ohg) * dhg[i] +
+					(1 - sc.f_blood) * baseline[i];
+			}
+			passed = sameBits(sc.mua_derm(), expected, prefix + "mua_derm") && passed;
+			passed = sameBits(batch[set].mua_derm, expected, prefix + "batched mua_derm") && passed;
+		}
+		return passed;
+	}
+
+} // namespace
+
+bool TestSpectrumExpressions() {
+	TestValues values;
+	// WLD_nSamples and nSpectralSamples leave a tail after the groups of four
+	bool passed = testOperators<WLD_nSamples>(values);
+	passed = testOperators<nSpectralSamples>(values) && passed;
+	passed = testOperators<3>(values) && passed;
+	passed = testOperators<8>(values) && passed;
+	passed = testSkinMixes(values) && passed;
+	cout << (passed ? "ok   " : "FAIL ") << "spectrum expressions" << endl;
+	return passed;
+}
@@ -0,0 +1,532 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Offline generator for the profile tables read by GaussianParamsCalculator
+ *
+ * Fits every point of a 4-D (mel, eum, bld, ohg) grid with the same fitting
+ * tasks the renderer uses for live fits. Finished points are appended to a
+ * checkpoint file, so an interrupted run resumes where it stopped. With
+ * -benchtasks it measures the throughput of the task queue instead.
+ */
+
+#include "stdafx.h"
+
+#include "ProfileSpace.h"
+#include "GaussianParams.h"
+#include "ProfileFit/GaussianFitTask.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <chrono>
+
+using namespace std;
+using namespace Skin;
+using namespace Utils;
+using namespace ProfileFit;
+using namespace Parallel;
+
+CWinApp theApp;
+
+namespace {
+
+	const int NUM_PARAMS = 4;
+	const char* const PARAM_NAMES[NUM_PARAMS] = { "mel", "eum", "bld", "ohg" };
+	const TCHAR* const PARAM_FLAGS[NUM_PARAMS] = { _T("-mel"), _T("-eum"), _T("-bld"), _T("-ohg") };
+
+	// Grid points fitted between two checkpoints
+	const int DEFAULT_BATCH_SIZE = 16;
+	const TCHAR* const CHECKPOINT_EXTENSION = _T(".ckpt");
+
+	// Sigmas of the tables shipped with the renderer
+	const int NUM_DEFAULT_SIGMAS = 12;
+	const float FIRST_DEFAULT_SIGMA = 0.01f;
+
+	struct GridSpec {
+		vector<float> sigmas;
+		vector<SamplePoints> sps;
+		int numProfiles;
+
+		int profileStride() const {
+			return ProfileSpace::NUM_CHANNELS * (int)sigmas.size();
+		}
+		float param(int gridId, int dim) const {
+			const SamplePoints& sp = sps[dim];
+			return sp.points[(gridId / sp.idMultiplier) % sp.points.size()];
+		}
+	};
+
+	// Parses "a,b,c" as a list of values or "min:max:count" as a uniform range
+	bool parseValues(const TString& arg, vector<float>& values) {
+		string text = ANSIStringFromTString(arg);
+		values.clear();
+		if (text.find(':') != string::npos) {
+			float lo, hi;
+			int count;
+			char sep0, sep1;
+			istringstream iss(text);
+			if (!(iss >> lo >> sep0 >> hi >> sep1 >> count) || count < 1 || (count > 1 && !(hi > lo)))
+				return false;
+			for (int i = 0; i < count; i++)
+				values.push_back(count > 1 ? lo + (hi - lo) * (float)i / (float)(count - 1) : lo);
+			return true;
+		}
+		istringstream iss(text);
+		string token;
+		while (getline(iss, token, ',')) {
+			istringstream value(token);
+			float v;
+			if (!(value >> v))
+				return false;
+			values.push_back(v);
+		}
+		for (size_t i = 1; i < values.size(); i++) {
+			if (!(values[i] > values[i - 1]))
+				return false;
+		}
+		return !values.empty();
+	}
+
+	// The fit tasks slide a window of GAUSSIAN_FIT_WINDOW_SIGMAS over ascending sigmas, and
+	// the renderer refuses tables with more than MAX_SIGMAS. parseValues already keeps the
+	// values ascending.
+	bool validSigmas(const vector<float>& sigmas) {
+		return sigmas.size() >= (size_t)GAUSSIAN_FIT_WINDOW_SIGMAS
+			&& sigmas.size() <= (size_t)GaussianParamsCalculator::MAX_SIGMAS
+			&& sigmas[0] > 0.f;
+	}
+
+	// Fitted profile of one grid point, as stored in the checkpoint file
+	struct FittedProfile {
+		int gridId;
+		vector<float> profile;
+		float error;
+	};
+
+	// Checkpoint file layout:
+	//   char magic[4], uint32_t version, uint32_t fitRevision
+	//   uint32_t numSigmas, float sigmas[numSigmas]
+	//   for each dimension: uint32_t numPoints, float points[numPoints]
+	//   records until the end of the file:
+	//     uint32_t gridId, float profile[NUM_CHANNELS][numSigmas], float error
+	// A truncated last record is the sign of an interrupted write and is dropped.
+	class Checkpoint {
+	public:
+		static const uint32_t CURRENT_VERSION = 2;
+
+		Checkpoint(const TString& filename, const GridSpec& grid)
+			: filename(filename), grid(grid) { }
+
+		// Reads the finished points, false if the file describes another grid, was
+		// fitted by another revision of the fitting code or cannot be written
+		bool load(vector<FittedProfile>& done) {
+			ifstream in(filename, ios::in | ios::binary);
+			if (in) {
+				string expected = header();
+				string actual(expected.size(), '\0');
+				if (!in.read(&actual[0], actual.size()) || actual != expected)
+					return false;
+
+				int stride = grid.profileStride();
+				FittedProfile fp;
+				fp.profile.resize(stride);
+				uint32_t gridId;
+				while (in.read((char*)&gridId, sizeof(gridId))
+					&& in.read((char*)&fp.profile[0], stride * sizeof(float))
+					&& in.read((char*)&fp.error, sizeof(fp.error)))
+				{
+					if (gridId >= (uint32_t)grid.numProfiles)
+						return false;
+					fp.gridId = (int)gridId;
+					done.push_back(fp);
+				}
+				in.close();
+			}
+			// Starts a new file, or drops a truncated record before appending to it
+			return rewrite(done);
+		}
+
+		bool append(const vector<FittedProfile>& fitted) {
+			ofstream out(filename, ios::out | ios::binary | ios::app);
+			if (!out)
+				return false;
+			writeRecords(out, fitted);
+			out.close();
+			return !out.fail();
+		}
+
+	private:
+		TString filename;
+		const GridSpec& grid;
+
+		string header() const {
+			ostringstream oss(ios::out | ios::binary);
+			uint32_t version = CURRENT_VERSION;
+			uint32_t numSigmas = (uint32_t)grid.sigmas.size();
+			oss.write("SoGC", 4);
+			oss.write((const char*)&version, sizeof(version));
+			oss.write((const char*)&GAUSSIAN_FIT_REVISION, sizeof(GAUSSIAN_FIT_REVISION));
+			oss.write((const char*)&numSigmas, sizeof(numSigmas));
+			oss.write((const char*)&grid.sigmas[0], numSigmas * sizeof(float));
+			for (const SamplePoints& sp : grid.sps) {
+				uint32_t numPoints = (uint32_t)sp.points.size();
+				oss.write((const char*)&numPoints, sizeof(numPoints));
+				oss.write((const char*)&sp.points[0], numPoints * sizeof(float));
+			}
+			return oss.str();
+		}
+
+		void writeRecords(ostream& out, const vector<FittedProfile>& fitted) const {
+			for (const FittedProfile& fp : fitted) {
+				uint32_t gridId = (uint32_t)fp.gridId;
+				out.write((const char*)&gridId, sizeof(gridId));
+				out.write((const char*)&fp.profile[0], fp.profile.size() * sizeof(float));
+				out.write((const char*)&fp.error, sizeof(fp.error));
+			}
+		}
+
+		bool rewrite(const vector<FittedProfile>& done) const {
+			ofstream out(filename, ios::out | ios::binary | ios::trunc);
+			if (!out)
+				return false;
+			string h = header();
+			out.write(h.c_str(), h.size());
+			writeRecords(out, done);
+			out.close();
+			return !out.fail();
+		}
+
+		Checkpoint(const Checkpoint&);
+		Checkpoint& operator=(const Checkpoint&);
+	};
+
+	// Converted as the live fits convert theirs
+	void spectralToProfile(const SpectralGaussianCoeffs& coeffs, FittedProfile& fp) {
+		fp.profile.resize(ProfileSpace::NUM_CHANNELS * coeffs.sigmas.size());
+		SpectralToRGBProfile(coeffs, &fp.profile[0]);
+		fp.error = coeffs.error.Max();
+	}
+
+	// Fits the given grid points, spreading their spectral components over the task queue
+	void fitBatch(const GridSpec& grid, const vector<int>& gridIds, vector<FittedProfile>& fitted) {
+		vector<SkinCoefficients> skinCoeffs;
+		for (int gridId : gridIds) {
+			skinCoeffs.push_back(SkinCoefficients(grid.param(gridId, 0), grid.param(gridId, 1),
+				grid.param(gridId, 2), grid.param(gridId, 3), 0, 0, 0));
+		}
+		vector<SkinLayerCoeffs> layers(gridIds.size());
+		SkinCoefficients::layerCoeffsBatch(&skinCoeffs[0], skinCoeffs.size(), &layers[0]);
+
+		vector<SpectralGaussianCoeffs> coeffs(gridIds.size());
+		vector<Task*> tasks;
+		for (size_t i = 0; i < gridIds.size(); i++) {
+			vector<Task*> pointTasks = CreateGaussianFitTasks(layers[i], grid.sigmas, coeffs[i]);
+			tasks.insert(tasks.end(), pointTasks.begin(), pointTasks.end());
+		}
+
+		TaskQueue queue;
+		queue.EnqueueTasks(tasks);
+		queue.WaitForAllTasks();
+		DestroyGaussianTasks(tasks);
+
+		fitted.resize(gridIds.size());
+		for (size_t i = 0; i < gridIds.size(); i++) {
+			fitted[i].gridId = gridIds[i];
+			spectralToProfile(coeffs[i], fitted[i]);
+		}
+	}
+
+	bool writeText(const TString& filename, const GridSpec& grid, const ProfileSpace& psp,
+		const vector<float>& errors)
+	{
+		ofstream out(filename, ios::out | ios::trunc);
+		if (!out)
+			return false;
+
+		static const char CHANNEL_NAMES[ProfileSpace::NUM_CHANNELS] = { 'R', 'G', 'B' };
+		int nSigmas = (int)grid.sigmas.size();
+		out << "Param NumPoints Points" << endl;
+		for (int dim = 0; dim < NUM_PARAMS; dim++) {
+			const vector<float>& points = grid.sps[dim].points;
+			out << PARAM_NAMES[dim] << " " << points.size();
+			for (float point : points)
+				out << " " << point;
+			out << endl;
+		}
+		out << "ID";
+		for (int dim = 0; dim < NUM_PARAMS; dim++)
+			out << " " << PARAM_NAMES[dim];
+		out << " RGB";
+		for (float sigma : grid.sigmas)
+			out << " " << sigma;
+		out << " Error" << endl;
+
+		for (int gridId = 0; gridId < grid.numProfiles; gridId++) {
+			const float* profile = psp.profile(gridId);
+			for (int channel = 0; channel < ProfileSpace::NUM_CHANNELS; channel++) {
+				out << gridId;
+				for (int dim = 0; dim < NUM_PARAMS; dim++)
+					out << " " << grid.param(gridId, dim);
+				out << " " << CHANNEL_NAMES[channel];
+				for (int sid = 0; sid < nSigmas; sid++)
+					out << " " << profile[channel * nSigmas + sid];
+				out << " " << errors[gridId] << "\n";
+			}
+		}
+		out.close();
+		return !out.fail();
+	}
+
+	bool hasBinaryExtension(const TString& filename) {
+		size_t length = _tcslen(ProfileFile::BINARY_EXTENSION);
+		return filename.size() >= length
+			&& !_tcsicmp(filename.c_str() + filename.size() - length, ProfileFile::BINARY_EXTENSION);
+	}
+
+	int generate(const TString& outputFilename, const TString& checkpointFilename,
+		GridSpec& grid, int batchSize)
+	{
+		prepareSamplePoints(grid.sps);
+		grid.numProfiles = 1;
+		for (const SamplePoints& sp : grid.sps)
+			grid.numProfiles *= (int)sp.points.size();
+
+		ProfileSpace psp;
+		psp.sigmas = grid.sigmas;
+		psp.paramSamplePoints = grid.sps;
+		psp.numProfiles = grid.numProfiles;
+		psp.ownedProfiles.assign((size_t)grid.numProfiles * grid.profileStride(), 0.f);
+		vector<float> errors(grid.numProfiles, 0.f);
+		vector<bool> filled(grid.numProfiles, false);
+
+		auto store = [&] (const vector<FittedProfile>& fitted) {
+			for (const FittedProfile& fp : fitted) {
+				copy(fp.profile.begin(), fp.profile.end(),
+					psp.ownedProfiles.begin() + (size_t)fp.gridId * grid.profileStride());
+				errors[fp.gridId] = fp.error;
+				filled[fp.gridId] = true;
+			}
+		};
+
+		Checkpoint checkpoint(checkpointFilename, grid);
+		vector<FittedProfile> done;
+		if (!checkpoint.load(done)) {
+			cerr << "Checkpoint " << ANSIStringFromTString(checkpointFilename)
+				<< " is unwritable or belongs to a different grid or fit revision, remove it to start over" << endl;
+			return 1;
+		}
+		store(done);
+
+		vector<int> pending;
+		for (int gridId = 0; gridId < grid.numProfiles; gridId++) {
+			if (!filled[gridId])
+				pending.push_back(gridId);
+		}
+		cout << grid.numProfiles << " grid points, " << grid.numProfiles - pending.size()
+			<< " restored from checkpoint, " << TaskQueue::NumWorkers() << " worker threads" << endl;
+
+		SampledSpectrum::Init();
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (size_t first = 0; first < pending.size(); first += batchSize) {
+			size_t last = min(pending.size(), first + batchSize);
+			vector<int> gridIds(pending.begin() + first, pending.begin() + last);
+			vector<FittedProfile> fitted;
+			fitBatch(grid, gridIds, fitted);
+			store(fitted);
+			if (!checkpoint.append(fitted)) {
+				cerr << "Failed to write checkpoint: " << ANSIStringFromTString(checkpointFilename) << endl;
+				return 1;
+			}
+
+			double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			double remaining = elapsed / (double)last * (double)(pending.size() - last);
+			cout << last << "/" << pending.size() << " fitted, "
+				<< (int)remaining << "s remaining" << endl;
+		}
+		TaskQueue::Cleanup();
+
+		bool written = hasBinaryExtension(outputFilename)
+			? ProfileFile::writeBinary(outputFilename, psp)
+			: writeText(outputFilename, grid, psp, errors);
+		if (!written) {
+			cerr << "Failed to write: " << ANSIStringFromTString(outputFilename) << endl;
+			return 1;
+		}
+		// The table is complete, the checkpoint is no longer needed
+		_tremove(checkpointFilename.c_str());
+		return 0;
+	}
+
+	// Iterations of the arithmetic loop of each benchmark task, a few microseconds
+	const int BENCH_TASK_WORK = 2000;
+	const int BENCH_REPEATS = 5;
+
+	class BenchTask : public Task {
+	public:
+		BenchTask() : result(0.f) { }
+		void Run() {
+			float x = 0.f;
+			for (int i = 0; i < BENCH_TASK_WORK; i++)
+				x = x * 0.999f + 1.f;
+			result = x;
+		}
+		float result;
+	};
+
+	// Times numTasks small tasks with 1, 2, 4, ... workers up to the configured pool
+	// size. The best of a few runs is reported, after a run that starts the pool.
+	int benchmarkTasks(int numTasks) {
+		int maxWorkers = TaskQueue::NumWorkers();
+		vector<BenchTask> benchTasks(numTasks);
+		vector<Task*> tasks;
+		for (BenchTask& task : benchTasks)
+			tasks.push_back(&task);
+
+		cout << numTasks << " tasks of " << BENCH_TASK_WORK << " iterations" << endl;
+		double singleTime = 0.;
+		for (int numWorkers = 1; ; numWorkers = min(numWorkers * 2, maxWorkers)) {
+			TaskQueue::SetNumWorkers(numWorkers);
+			double bestTime = 0.;
+			for (int rep = 0; rep <= BENCH_REPEATS; rep++) {
+				chrono::steady_clock::time_point start = chrono::steady_clock::now();
+				TaskQueue queue;
+				queue.EnqueueTasks(tasks);
+				queue.WaitForAllTasks();
+				double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+				if (rep == 1 || (rep > 1 && elapsed < bestTime))
+					bestTime = elapsed;
+			}
+			if (numWorkers == 1)
+				singleTime = bestTime;
+			cout << numWorkers << " workers: " << bestTime * 1e9 / numTasks << " ns/task, "
+				<< (int)(numTasks / bestTime) << " tasks/s, speedup " << singleTime / bestTime << endl;
+			if (numWorkers == maxWorkers)
+				break;
+		}
+		TaskQueue::Cleanup();
+		return 0;
+	}
+
+	void printUsage(const TCHAR* program) {
+		cout << "Usage: " << ANSIStringFromTString(program)
+			<< " -mel <values> -eum <values> -bld <values> -ohg <values> [options] -o <table>" << endl;
+		cout << "  <values> is a list \"v0,v1,...\" or a uniform range \"min:max:count\"." << endl;
+		cout << "  Tables named *.sogp are written in binary, anything else as text." << endl;
+		cout << "Options:" << endl;
+		cout << "  -sigmas <values>   " << GAUSSIAN_FIT_WINDOW_SIGMAS << " to " << GaussianParamsCalculator::MAX_SIGMAS
+			<< " ascending Gaussian sigmas, default 0.01 doubling to 20.48" << endl;
+		cout << "  -batch <n>         Grid points fitted between checkpoints, default "
+			<< DEFAULT_BATCH_SIZE << endl;
+		cout << "  -checkpoint <file> Checkpoint file, default <table>.ckpt" << endl;
+		cout << "  -threads <n>       Worker threads, default SKINPARAM_NUM_THREADS or one per core" << endl;
+		cout << "  -pin               Pin each worker thread to a logical processor" << endl;
+		cout << "Usage: " << ANSIStringFromTString(program) << " -benchtasks <n> [-threads <n>]" << endl;
+		cout << "  Times n small tasks with 1, 2, 4, ... worker threads up to -threads" << endl;
+	}
+
+} // namespace
+
+int _tmain(int argc, TCHAR* argv[])
+{
+	if (!AfxWinInit(::GetModuleHandle(NULL), NULL, ::GetCommandLine(), 0)) {
+		cerr << "Failed to initialize MFC" << endl;
+		return 1;
+	}
+
+	TString outputFilename;
+	TString checkpointFilename;
+	int batchSize = DEFAULT_BATCH_SIZE;
+	int benchTasks = 0;
+	GridSpec grid;
+	grid.sps.resize(NUM_PARAMS);
+	for (int i = 0; i < NUM_DEFAULT_SIGMAS; i++)
+		grid.sigmas.push_back(FIRST_DEFAULT_SIGMA * (float)(1 << i));
+
+	for (int i = 1; i < argc; i++) {
+		const TCHAR* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		bool parsed = false;
+		for (int dim = 0; dim < NUM_PARAMS; dim++) {
+			if (!_tcsicmp(arg, PARAM_FLAGS[dim]) && hasValue) {
+				if (!parseValues(argv[++i], grid.sps[dim].points)) {
+					cerr << "Invalid values for " << PARAM_NAMES[dim] << endl;
+					return 1;
+				}
+				parsed = true;
+			}
+		}
+		if (parsed)
+			continue;
+
+		if (!_tcsicmp(arg, _T("-sigmas")) && hasValue) {
+			if (!parseValues(argv[++i], grid.sigmas)) {
+				cerr << "Invalid sigmas" << endl;
+				return 1;
+			}
+			if (!validSigmas(grid.sigmas)) {
+				cerr << "Sigmas must be " << GAUSSIAN_FIT_WINDOW_SIGMAS << " to "
+					<< GaussianParamsCalculator::MAX_SIGMAS << " positive ascending values" << endl;
+				return 1;
+			}
+		} else if (!_tcsicmp(arg, _T("-batch")) && hasValue) {
+			batchSize = max(1, _ttoi(argv[++i]));
+		} else if (!_tcsicmp(arg, _T("-checkpoint")) && hasValue) {
+			checkpointFilename = argv[++i];
+		} else if (!_tcsicmp(arg, _T("-threads")) && hasValue) {
+			TaskQueue::SetNumWorkers(max(1, _ttoi(argv[++i])));
+		} else if (!_tcsicmp(arg, _T("-pin"))) {
+			TaskQueue::SetPinWorkers(true);
+		} else if (!_tcsicmp(arg, _T("-benchtasks")) && hasValue) {
+			benchTasks = max(1, _ttoi(argv[++i]));
+		} else if (!_tcsicmp(arg, _T("-o")) && hasValue) {
+			outputFilename = argv[++i];
+		} else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (benchTasks > 0)
+		return benchmarkTasks(benchTasks);
+
+	bool complete = !outputFilename.empty();
+	for (const SamplePoints& sp : grid.sps)
+		complete = complete && !sp.points.empty();
+	if (!complete) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (checkpointFilename.empty())
+		checkpointFilename = outputFilename + CHECKPOINT_EXTENSION;
+
+	return generate(outputFilename, checkpointFilename, grid, batchSize);
+}
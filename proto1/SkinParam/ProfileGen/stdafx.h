@@ -0,0 +1,29 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#pragma warning( disable : 4005 ) // disable duplicate macro definition warnings for vs2012
+
+#define NOMINMAX
+
+#include "targetver.h"
+
+#include <stdio.h>
+#include <tchar.h>
+#define _AFX_NO_MFC_CONTROLS_IN_DIALOGS
+#ifndef VC_EXTRALEAN
+#define VC_EXTRALEAN
+#endif
+
+// The task queue runs its workers on MFC threads
+#include <afx.h>
+#include <afxwin.h>
+
+#include <algorithm>
+using std::min;
+using std::max;
+
+#include "TString.h"
@@ -0,0 +1,162 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Sparse refinement of the profile table from live fits
+ */
+
+#include "StdAfx.h"
+
+#include "AdaptiveProfileSpace.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace Skin;
+using namespace Parallel;
+
+AdaptiveProfileSpace::AdaptiveProfileSpace(const ProfileSpace& psp)
+	: psp(psp), mutex(RWMutex::Create()), nextSampleId(0)
+{
+}
+
+AdaptiveProfileSpace::~AdaptiveProfileSpace() {
+	RWMutex::Destroy(mutex);
+}
+
+float AdaptiveProfileSpace::distanceSquared(const float* a, const float* b, int dims) {
+	float dsq = 0.f;
+	for (int d = 0; d < dims; d++) {
+		float diff = a[d] - b[d];
+		dsq += diff * diff;
+	}
+	return dsq;
+}
+
+void AdaptiveProfileSpace::insert(const float* position, const float* residual) {
+	int dims = (int)psp.paramSamplePoints.size();
+	Sample sample;
+	std::copy(position, position + dims, sample.position);
+	sample.residual.assign(residual, residual + psp.profileStride());
+
+	// The kernel reaches one grid step, so it touches at most 3 cells per dimension
+	int lowCell[GaussianParamsCalculator::MAX_DIMS], highCell[GaussianParamsCalculator::MAX_DIMS];
+	for (int d = 0; d < dims; d++) {
+		int lastCell = max((int)psp.paramSamplePoints[d].points.size() - 2, 0);
+		lowCell[d] = min(max((int)floor(position[d] - 1.f), 0), lastCell);
+		highCell[d] = min(max((int)floor(position[d] + 1.f), 0), lastCell);
+	}
+
+	RWMutexLock lock(*mutex, WRITE);
+	sample.id = nextSampleId++;
+	int cell[GaussianParamsCalculator::MAX_DIMS];
+	std::copy(lowCell, lowCell + dims, cell);
+	for (;;) {
+		int cellGridId = 0;
+		for (int d = 0; d < dims; d++)
+			cellGridId += cell[d] * psp.paramSamplePoints[d].idMultiplier;
+		insertIntoCell(cellGridId, sample);
+
+		// Advance to the next cell in the box
+		int d = 0;
+		for (; d < dims; d++) {
+			if (++cell[d] <= highCell[d])
+				break;
+			cell[d] = lowCell[d];
+		}
+		if (d == dims)
+			break;
+	}
+}
+
+void AdaptiveProfileSpace::insertIntoCell(int cellGridId, const Sample& sample) {
+	vector<Sample>& samples = cells[cellGridId];
+	++cellsPerSample[sample.id];
+	if ((int)samples.size() < MAX_SAMPLES_PER_CELL) {
+		samples.push_back(sample);
+		return;
+	}
+	// A full cell keeps its spread: the new fit supersedes the closest old one
+	int dims = (int)psp.paramSamplePoints.size();
+	size_t nearest = 0;
+	float nearestDsq = distanceSquared(samples[0].position, sample.position, dims);
+	for (size_t i = 1; i < samples.size(); i++) {
+		float dsq = distanceSquared(samples[i].position, sample.position, dims);
+		if (dsq < nearestDsq) {
+			nearestDsq = dsq;
+			nearest = i;
+		}
+	}
+	// Gone once no cell holds it any more
+	auto count = cellsPerSample.find(samples[nearest].id);
+	if (--count->second == 0)
+		cellsPerSample.erase(count);
+	samples[nearest] = sample;
+}
+
+bool AdaptiveProfileSpace::correct(int cellGridId, const float* position, float* profile) const {
+	RWMutexLock lock(*mutex, READ);
+	auto iter = cells.find(cellGridId);
+	if (iter == cells.end())
+		return false;
+
+	int dims = (int)psp.paramSamplePoints.size();
+	int stride = psp.profileStride();
+	float totalWeight = 0.f;
+	float weights[MAX_SAMPLES_PER_CELL];
+	const vector<Sample>& samples = iter->second;
+	for (size_t i = 0; i < samples.size(); i++) {
+		// Compactly supported (1 - d^2)^2 kernel
+		float dsq = distanceSquared(samples[i].position, position, dims);
+		float w = max(1.f - dsq, 0.f);
+		weights[i] = w * w;
+		totalWeight += weights[i];
+	}
+	if (totalWeight == 0.f)
+		return false;
+
+	// Overlapping samples are averaged, a lone sample fades out with distance
+	float norm = 1.f / max(totalWeight, 1.f);
+	for (size_t i = 0; i < samples.size(); i++) {
+		if (weights[i] == 0.f)
+			continue;
+		float w = weights[i] * norm;
+		const float* residual = &samples[i].residual[0];
+		for (int j = 0; j < stride; j++)
+			profile[j] += w * residual[j];
+	}
+	return true;
+}
+
+size_t AdaptiveProfileSpace::size() const {
+	RWMutexLock lock(*mutex, READ);
+	return cellsPerSample.size();
+}
@@ -0,0 +1,84 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Sparse refinement of the profile table from live fits
+ */
+
+#pragma once
+
+#include "GaussianParams.h"
+#include "Parallel/parallel.h"
+#include <unordered_map>
+
+namespace Skin {
+	// Corrections to the interpolated table, learned from live fits.
+	// Each live fit stores its residual against the table. A lookup adds the
+	// residuals of nearby fits, weighted by a kernel that vanishes one grid
+	// step away, so fitted points are reproduced and the table is unchanged
+	// elsewhere. Samples are filed under every cell their kernel reaches, and
+	// each cell keeps a bounded number, which bounds the lookup cost.
+	class AdaptiveProfileSpace {
+	public:
+		static const int MAX_SAMPLES_PER_CELL = 8;
+
+		AdaptiveProfileSpace(const ProfileSpace& psp);
+		~AdaptiveProfileSpace();
+
+		// position is the sample location in continuous grid indices,
+		// residual is indexed [channel][sigma] like the table profiles
+		void insert(const float* position, const float* residual);
+		// Adds the correction at position to profile, cellGridId names the enclosing cell.
+		// Returns false if no sample reaches position.
+		bool correct(int cellGridId, const float* position, float* profile) const;
+		// Samples still held by a cell, not superseded in all of them
+		size_t size() const;
+	private:
+		AdaptiveProfileSpace(const AdaptiveProfileSpace&);
+		AdaptiveProfileSpace& operator=(const AdaptiveProfileSpace&);
+
+		struct Sample {
+			float position[GaussianParamsCalculator::MAX_DIMS];
+			std::vector<float> residual;
+			uint32_t id;
+		};
+
+		const ProfileSpace& psp;
+		Parallel::RWMutex* mutex;
+		std::unordered_map<int, std::vector<Sample> > cells;
+		// Number of cells holding each sample, by id
+		std::unordered_map<uint32_t, int> cellsPerSample;
+		uint32_t nextSampleId;
+
+		void insertIntoCell(int cellGridId, const Sample& sample);
+		static float distanceSquared(const float* a, const float* b, int dims);
+	};
+} // namespace Skin
@@ -36,14 +36,16 @@
 #include "StdAfx.h"
 
 #include "GaussianParams.h"
+#include "LiveFitCache.h"
+#include "AdaptiveProfileSpace.h"
+#include "LiveFitReport.h"
 #include <algorithm>
-#include <fstream>
-#include <string>
-#include <sstream>
 #include "D3DHelper.h"
 #include "ProfileFit/GaussianFitTask.h"
 #include "PbrtUtils/rng.h"
-#include <condition_variable>
+#include <mutex>
+#include <map>
+#include <emmintrin.h>
 
 using namespace std;
 using namespace Skin;
@@ -53,146 +55,84 @@ using namespace ProfileFit;
 
 namespace Skin {
 
-	static istream& getLine(istream& is, string& out) {
-		out.clear();
-
-		// The characters in the stream are read one-by-one using a std::streambuf.
-		// That is faster than reading them one-by-one using the std::istream.
-		// Code that uses streambuf this way must be guarded by a sentry object.
-		// The sentry object performs various tasks,
-		// such as thread synchronization and updating the stream state.
-
-		std::istream::sentry se(is, true);
-		std::streambuf* sb = is.rdbuf();
-
-		for(;;) {
-			int c = sb->sbumpc();
-			switch (c) {
-			case '\n':
-				return is;
-			case '\r':
-				if(sb->sgetc() == '\n')
-					sb->sbumpc();
-				return is;
-			case EOF:
-				// Also handle the case when the last line has no line ending
-				if(out.empty())
-					is.setstate(std::ios::eofbit);
-				return is;
-			default:
-				out.push_back((char)c);
-			}
+	// Cost of the coarse live fit pass
+	static const uint32_t COARSE_DESIRED_LENGTH = 128;
+	static const int COARSE_FITTED_COMPONENTS = 8;
+
+	// Shared between a live fit and its future
+	struct LiveFitState {
+		LiveFitState() : cancelled(false), hasIntermediate(false), progressScale(1.) { }
+
+		bool isCancelled() {
+			lock_guard<std::mutex> lock(mutex);
+			return cancelled;
 		}
+
+		std::mutex mutex;
+		bool cancelled;
+		bool hasIntermediate;
+		GaussianParams intermediate;
+		double progressScale;
+	};
+
+	// Runs and destroys the tasks, an aborted queue skips them
+	static void runFitTasks(TaskQueue& tq, vector<Task*>& tasks) {
+		tq.EnqueueTasks(tasks);
+		tq.WaitForAllTasks();
+		DestroyGaussianTasks(tasks);
 	}
-}
 
-GaussianParamsCalculator::GaussianParamsCalculator(const TString& filename) {
-	parseFile(filename);
+	static void rgbToProfile(const RGBGaussianCoeffs& coeffs, float* profile) {
+		int nSigmas = (int)coeffs.sigmas.size();
+		for (int sid = 0; sid < nSigmas; sid++) {
+			for (int ch = 0; ch < ProfileSpace::NUM_CHANNELS; ch++)
+				profile[ch * nSigmas + sid] = coeffs.coeffs[sid][ch];
+		}
+	}
 }
 
-void GaussianParamsCalculator::parseFile(const TString& filename) {
-	// Load from filename and store profiles into psp
-	ifstream in(filename, ios::in);
-	if (!in) {
-		D3DHelper::checkFailure(E_FAIL, _T("Failed to open: ") + filename);
-	}
-
-	vector<SamplePoints>& sps = psp.paramSamplePoints;
-	vector<RGBProfile>& profiles = psp.profiles;
-	vector<float>& sigmas = psp.sigmas;
-	sps.clear();
-	string line;
-	// The parser state
-	struct {
-		bool wantSamplePoints;
-		int rgbColumnIndex;
-		int minColumns;
-		int totalProfiles;
-	} state = {
-		true, 0, 0, 0
-	};
+GaussianParamsCalculator::GaussianParamsCalculator(const TString& filename)
+	: adaptiveRefinement(false), liveFitComponents(MAX_LIVE_FIT_COMPONENTS),
+	liveFitMode(LIVE_FIT_SPECTRAL)
+{
+	static_assert(MAX_LIVE_FIT_COMPONENTS == SampledSpectrum::nComponents,
+		"A full live fit covers every spectral component");
+	loadFile(filename);
+	checkLimits(filename);
+	buildReductionPlans();
+	// Full live fits use the default options
+	liveFitCache.reset(new LiveFitCache(ProfileFile::replaceExtension(filename, LiveFitCache::EXTENSION),
+		GaussianFitOptions()));
+	adaptiveSpace.reset(new AdaptiveProfileSpace(psp));
+	seedAdaptiveSpace();
+}
 
-	while (getLine(in, line)) {
-		istringstream iss(line);
-		// most vexing parse?
-		vector<string> tokens((istream_iterator<string>(iss)),
-			istream_iterator<string>());
-		if (state.wantSamplePoints) {
-			if (!tokens.size() || tokens[0] == "Param")
-				continue;
-			if (tokens[0] == "ID") {
-				state.wantSamplePoints = false;
-				// parse sigmas
-				int nParams = (int)sps.size();
-				state.rgbColumnIndex = nParams + 1;
-				if (tokens.size() < (size_t)state.rgbColumnIndex + 2) {
-					D3DHelper::checkFailure(E_FAIL, _T("Ill-formed coeffs file: ") + filename);
-				}
-				sigmas.clear();
-				for (size_t sigmaId = state.rgbColumnIndex + 1;
-					sigmaId < tokens.size(); sigmaId++)
-				{
-					const string& token = tokens[sigmaId];
-					if (token == "Error") break;
-					sigmas.push_back((float)atof(token.c_str()));
-				}
-				state.minColumns = (int)(state.rgbColumnIndex + 1 + psp.sigmas.size());
-				// prepare the sample points array
-				int multiplier = 1;
-				for (auto& riter = sps.rbegin(); riter != sps.rend(); ++riter) {
-					riter->idMultiplier = multiplier;
-					multiplier *= (int)riter->points.size();
-				}
-				// prepare profile storage
-				profiles.resize(multiplier);
-				state.totalProfiles = multiplier;
-			} else {
-				if (tokens.size() < 2)
-					continue;
-				// parse sample points
-				int nPoints = atoi(tokens[1].c_str());
-				if (tokens.size() - 2 < (size_t)nPoints)
-					continue;
-				SamplePoints points;
-				for (int ptId = 0; ptId < nPoints; ptId++) {
-					points.points.push_back(
-						(float)atof(tokens[ptId + 2].c_str()));
-				}
-				sps.push_back(points);
-			}
-		} else {
-			// parse individual profiles
-			if (tokens.size() < (size_t)state.minColumns)
-				continue;
-			string rgb = tokens[state.rgbColumnIndex];
-			if (rgb != "R" && rgb != "G" && rgb != "B")
-				continue;
-			int id = atoi(tokens[0].c_str());
-			if (id < state.totalProfiles && id >= 0) {
-				RGBProfile& p = profiles[id];
-				SingleProfile& sp = rgb == "R" ? p.red 
-					: (rgb == "G" ? p.green : p.blue);
-				sp.clear();
-				for (int i = state.rgbColumnIndex + 1;
-					i < state.minColumns; i++)
-				{
-					sp.push_back((float)atof(tokens[i].c_str()));
-				}
-			}
-		}
+void GaussianParamsCalculator::loadFile(const TString& filename) {
+	TString error;
+	if (ProfileFile::isBinary(filename)) {
+		if (!ProfileFile::mapBinary(filename, psp, error))
+			D3DHelper::checkFailure(E_FAIL, error);
+		return;
 	}
 
-	// Check if all profiles have been filled
-	for (RGBProfile& profile : profiles) {
-		if (!profile.red.size() || !profile.green.size()
-			|| !profile.blue.size())
-		{
-			D3DHelper::checkFailure(E_FAIL,
-				_T("Insufficient data: ") + filename);
-		}
+	// Text tables are converted once and the binary form is mapped afterwards
+	TString binaryFilename = ProfileFile::binaryFileNameFor(filename);
+	if (ProfileFile::isUpToDate(binaryFilename, filename)
+		&& ProfileFile::mapBinary(binaryFilename, psp, error))
+	{
+		return;
 	}
+	if (!ProfileFile::parseText(filename, psp, error))
+		D3DHelper::checkFailure(E_FAIL, error);
+	// Failing to write the cache is not fatal, the parsed profiles are used directly
+	ProfileFile::writeBinary(binaryFilename, psp);
+}
 
-	in.close();
+void GaussianParamsCalculator::checkLimits(const TString& filename) const {
+	// Lookups run on fixed size stack buffers
+	if (psp.paramSamplePoints.size() > MAX_DIMS || psp.sigmas.size() > MAX_SIGMAS) {
+		D3DHelper::checkFailure(E_FAIL, _T("Profile table exceeds supported dimensions: ") + filename);
+	}
 }
 
 namespace Skin {
@@ -202,21 +142,41 @@ namespace Skin {
 		float lerpAmount;
 	};
 
+	// Moves a direct index guess onto the bracket, points[id - 1] < sample <= points[id].
+	// The guess from the mean spacing is off by at most one on a uniform axis.
+	static int fixUniformGuess(const vector<float>& points, float sample, int id) {
+		id = min(max(id, 1), (int)points.size() - 1);
+		id += points[id] < sample;
+		id -= points[id - 1] >= sample;
+		return id;
+	}
+
+	// Returns id with points[id - 1] < sample <= points[id], for points[0] < sample < points.back()
+	static int searchUpperId(const SamplePoints& sps, float sample) {
+		const vector<float>& points = sps.points;
+		if (sps.uniform) {
+			int guess = (int)((sample - points[0]) * sps.invSpacing) + 1;
+			return fixUniformGuess(points, sample, guess);
+		}
+		// Branchless binary search for the first point not below sample
+		const float* base = &points[0];
+		int n = (int)points.size();
+		while (n > 1) {
+			int half = n / 2;
+			base = base[half] < sample ? base + half : base;
+			n -= half;
+		}
+		return (int)(base - &points[0]) + (*base < sample);
+	}
+
 	static LerpStruct searchLerp(const SamplePoints& sps, float sample) {
 		LerpStruct out;
 		const vector<float>& points = sps.points;
 		if (sample <= points[0]) {
 			out.minId = out.maxId = 0;
 			out.lerpAmount = 0.f;
-		} else if (sample >= points.back()) {
-			out.minId = out.maxId = points.size() - 1;
-			out.lerpAmount = 0.f;
-		} else {
-			// sample amount is small -- using linear search suffices
-			int id = 1;
-			while (points[id] < sample) {
-				id++;
-			}
+		} else if (sample < points.back()) {
+			int id = searchUpperId(sps, sample);
 			out.maxId = id;
 			if (points[id] > sample) {
 				out.minId = id - 1;
@@ -225,58 +185,112 @@ namespace Skin {
 				out.minId = id;
 				out.lerpAmount = 0.f;
 			}
+		} else {
+			// NaN samples clamp to the last point as well
+			out.minId = out.maxId = points.size() - 1;
+			out.lerpAmount = 0.f;
 		}
 		return out;
 	}
 
-	static SingleProfile lerp(float amount, const SingleProfile& p1, const SingleProfile& p2) {
-		ASSERT(p1.size() == p2.size());
-		SingleProfile ret(p1.size());
-		for (size_t i = 0; i < p1.size(); i++) {
-			ret[i] = (1.f - amount) * p1[i] + amount * p2[i];
+	// searchLerp for four samples at once, giving the same result per lane
+	static void searchLerp4(const SamplePoints& sps, const float* samples, LerpStruct* out) {
+		const vector<float>& points = sps.points;
+		int last = (int)points.size() - 1;
+		__m128 sample = _mm_loadu_ps(samples);
+		int guesses[4];
+		if (sps.uniform) {
+			__m128 offset = _mm_sub_ps(sample, _mm_set1_ps(points[0]));
+			__m128i guess = _mm_cvttps_epi32(_mm_mul_ps(offset, _mm_set1_ps(sps.invSpacing)));
+			guess = _mm_add_epi32(guess, _mm_set1_epi32(1));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(guesses), guess);
 		}
-		return ret;
-	}
 
-	static RGBProfile lerp(float amount, const RGBProfile& p1, const RGBProfile& p2) {
-		RGBProfile ret;
-		ret.red = lerp(amount, p1.red, p2.red);
-		ret.green = lerp(amount, p1.green, p2.green);
-		ret.blue = lerp(amount, p1.blue, p2.blue);
-		return ret;
+		float lower[4], upper[4];
+		for (int lane = 0; lane < 4; lane++) {
+			LerpStruct& lerp = out[lane];
+			float s = samples[lane];
+			lower[lane] = 0.f;
+			upper[lane] = 1.f;
+			if (s <= points[0]) {
+				lerp.minId = lerp.maxId = 0;
+			} else if (s < points[last]) {
+				int id = sps.uniform ? fixUniformGuess(points, s, guesses[lane]) : searchUpperId(sps, s);
+				lerp.maxId = id;
+				if (points[id] > s) {
+					lerp.minId = id - 1;
+					lower[lane] = points[id - 1];
+					upper[lane] = points[id];
+				} else {
+					lerp.minId = id;
+				}
+			} else {
+				lerp.minId = lerp.maxId = last;
+			}
+		}
+		__m128 lo = _mm_loadu_ps(lower);
+		__m128 amount = _mm_div_ps(_mm_sub_ps(sample, lo), _mm_sub_ps(_mm_loadu_ps(upper), lo));
+		float amounts[4];
+		_mm_storeu_ps(amounts, amount);
+		for (int lane = 0; lane < 4; lane++) {
+			LerpStruct& lerp = out[lane];
+			lerp.lerpAmount = lerp.minId == lerp.maxId ? 0.f : amounts[lane];
+		}
 	}
-
-	struct SigmaWeight {
-		int id;
-		float weight;
-	};
 }
 
-RGBProfile GaussianParamsCalculator::nsample(int baseId, int nDims, int dim, const LerpStruct* lerps) const {
-	const LerpStruct& nextLerp = lerps[dim];
-	int multiplier = psp.paramSamplePoints[dim].idMultiplier;
-	int minId = baseId + nextLerp.minId * multiplier;
-	bool leaf = (dim == nDims - 1);
-	RGBProfile p1 = leaf ? psp.profiles[minId] : nsample(minId, nDims, dim + 1, lerps);
-	if (nextLerp.maxId != nextLerp.minId) {
-		int maxId = baseId + nextLerp.maxId * multiplier;
-		RGBProfile p2 = leaf ? psp.profiles[maxId] : nsample(maxId, nDims, dim + 1, lerps);
-		return lerp(nextLerp.lerpAmount, p1, p2);
-	} else {
-		return p1;
+void GaussianParamsCalculator::sample(const LerpStruct* lerps, float* profile) const {
+	int dims = (int)psp.paramSamplePoints.size();
+
+	// Multilinear interpolation over the corners of the enclosing cell. The corner
+	// list doubles for every dimension, except where the sample hits a grid point.
+	int gridIds[1 << MAX_DIMS];
+	float weights[1 << MAX_DIMS];
+	int nCorners = 1;
+	gridIds[0] = 0;
+	weights[0] = 1.f;
+	for (int d = 0; d < dims; d++) {
+		const LerpStruct& lerp = lerps[d];
+		int multiplier = psp.paramSamplePoints[d].idMultiplier;
+		int minGridId = lerp.minId * multiplier;
+		if (lerp.minId == lerp.maxId) {
+			for (int c = 0; c < nCorners; c++)
+				gridIds[c] += minGridId;
+			continue;
+		}
+		int maxGridId = lerp.maxId * multiplier;
+		for (int c = 0; c < nCorners; c++) {
+			gridIds[nCorners + c] = gridIds[c] + maxGridId;
+			weights[nCorners + c] = weights[c] * lerp.lerpAmount;
+			gridIds[c] += minGridId;
+			weights[c] *= 1.f - lerp.lerpAmount;
+		}
+		nCorners *= 2;
 	}
-}
 
+	const float* corners[1 << MAX_DIMS];
+	for (int c = 0; c < nCorners; c++) {
+		corners[c] = psp.profile(gridIds[c]);
+	}
 
-RGBProfile GaussianParamsCalculator::sample(const float* params) const {
-	vector<LerpStruct> lerps;
-	int dims = psp.paramSamplePoints.size();
-	// do n searches to find the param ids to sample
-	for (int d = 0; d < dims; d++) {
-		lerps.push_back(searchLerp(psp.paramSamplePoints[d], params[d]));
+	// Accumulate four floats at a time, the stride is not always a multiple of 4
+	int stride = psp.profileStride();
+	int simdStride = stride & ~3;
+	for (int i = 0; i < simdStride; i += 4) {
+		__m128 sum = _mm_setzero_ps();
+		for (int c = 0; c < nCorners; c++) {
+			__m128 v = _mm_loadu_ps(corners[c] + i);
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[c]), v));
+		}
+		_mm_storeu_ps(profile + i, sum);
+	}
+	for (int i = simdStride; i < stride; i++) {
+		float sum = 0.f;
+		for (int c = 0; c < nCorners; c++) {
+			sum += weights[c] * corners[c][i];
+		}
+		profile[i] = sum;
 	}
-	// call the recursive helper function
-	return nsample(0, dims, 0, &lerps[0]);
 }
 
 GaussianParams GaussianParamsCalculator::getParams(const VariableParams& vps) const {
@@ -303,169 +317,540 @@ GaussianParams GaussianParamsCalculator::getParams(const VariableParams& vps) co
 	//	}
 	//};
 
-	vector<float> params;
-	params.push_back(vps.f_mel);
-	params.push_back(vps.f_eu);
-	params.push_back(vps.f_blood);
-	params.push_back(vps.f_ohg);
-	RGBProfile profile = sample(&params[0]);
+	LerpStruct lerps[MAX_DIMS];
+	searchLerps(vps, lerps);
+
+	float profile[ProfileSpace::NUM_CHANNELS * MAX_SIGMAS];
+	sample(lerps, profile);
+
+	return getParamsFromCell(lerps, profile);
+}
+
+void GaussianParamsCalculator::searchLerps(const VariableParams& vps, LerpStruct* lerps) const {
+	float params[] = { vps.f_mel, vps.f_eu, vps.f_blood, vps.f_ohg };
+	// do n searches to find the param ids to sample
+	int dims = (int)psp.paramSamplePoints.size();
+	for (int d = 0; d < dims; d++) {
+		lerps[d] = searchLerp(psp.paramSamplePoints[d], params[d]);
+	}
+}
+
+void GaussianParamsCalculator::seedAdaptiveSpace() {
+	// Fits from earlier sessions refine the table right away
+	SampledSpectrum::Init();
+	liveFitCache->visit([this] (const VariableParams& vps, const SpectralGaussianCoeffs& coeffs) {
+		if (coeffs.sigmas != psp.sigmas)
+			return;
+		float profile[ProfileSpace::NUM_CHANNELS * MAX_SIGMAS];
+		SpectralToRGBProfile(coeffs, profile);
+		refineWithLiveFit(vps, profile);
+	});
+}
+
+void GaussianParamsCalculator::refineWithLiveFit(const VariableParams& vps, const float* profile) const {
+	LerpStruct lerps[MAX_DIMS];
+	searchLerps(vps, lerps);
+	float tableProfile[ProfileSpace::NUM_CHANNELS * MAX_SIGMAS];
+	sample(lerps, tableProfile);
+
+	int stride = psp.profileStride();
+	float residual[ProfileSpace::NUM_CHANNELS * MAX_SIGMAS];
+	for (int i = 0; i < stride; i++)
+		residual[i] = profile[i] - tableProfile[i];
+	float position[MAX_DIMS];
+	for (size_t d = 0; d < psp.paramSamplePoints.size(); d++)
+		position[d] = lerps[d].minId + lerps[d].lerpAmount;
+	adaptiveSpace->insert(position, residual);
+}
+
+void GaussianParamsCalculator::getParamsBatch(const VariableParams* in, GaussianParams* out, size_t n) const {
+	ParallelForRange(0, (int64_t)n, BATCH_TASK_SIZE, [=] (int64_t first, int64_t last) {
+		getParamsRange(in + first, out + first, (size_t)(last - first));
+	});
+}
+
+void GaussianParamsCalculator::getParamsRange(const VariableParams* in, GaussianParams* out, size_t n) const {
+	const int LANES = 4;
+	int dims = (int)psp.paramSamplePoints.size();
+	float profile[ProfileSpace::NUM_CHANNELS * MAX_SIGMAS];
+
+	for (size_t start = 0; start < n; start += LANES) {
+		int lanes = (int)min(n - start, (size_t)LANES);
+		// Gather each dimension across lanes; unused lanes repeat the last sample
+		float params[MAX_DIMS][LANES];
+		for (int lane = 0; lane < LANES; lane++) {
+			const VariableParams& vps = in[start + min(lane, lanes - 1)];
+			params[0][lane] = vps.f_mel;
+			params[1][lane] = vps.f_eu;
+			params[2][lane] = vps.f_blood;
+			params[3][lane] = vps.f_ohg;
+		}
+
+		LerpStruct laneLerps[MAX_DIMS][LANES];
+		for (int d = 0; d < dims; d++) {
+			searchLerp4(psp.paramSamplePoints[d], params[d], laneLerps[d]);
+		}
+
+		for (int lane = 0; lane < lanes; lane++) {
+			LerpStruct lerps[MAX_DIMS];
+			for (int d = 0; d < dims; d++) {
+				lerps[d] = laneLerps[d][lane];
+			}
+			sample(lerps, profile);
+			out[start + lane] = getParamsFromCell(lerps, profile);
+		}
+	}
+}
+
+namespace Skin {
+
+	// For RGB color spaces that use the ITU-R BT.709 primaries
+	// (or sRGB, which defines the same primaries), relative luminance
+	// can be calculated from linear RGB components:
+	// Y = 0.2126 R + 0.7152 G + 0.0722 B
+	// @ http://www.w3.org/Graphics/Color/sRGB
+	static const float LUMINANCE[ProfileSpace::NUM_CHANNELS] = { 0.2126f, 0.7152f, 0.0722f };
+
+	// Relative rounding allowed for in the blended profile when bounding a cell
+	static const float PLAN_BOUND_EPSILON = 1e-5f;
+
+	// Returns the bit set of the NUM_GAUSSIANS sigmas with the largest weights;
+	// ties go to the larger id. weights must hold MAX_SIGMAS floats.
+	static uint32_t selectLargest(float* weights, int nSigmas) {
+		// Padding weights of -1 never outrank a real sigma
+		int paddedSigmas = (nSigmas + 3) & ~3;
+		for (int sid = nSigmas; sid < paddedSigmas; sid++) {
+			weights[sid] = -1.f;
+		}
+		// A sigma is kept when fewer than 6 others outweigh it.
+		// Counting ranks four at a time beats sorting for this few sigmas.
+		uint32_t selection = 0;
+		for (int sid = 0; sid < nSigmas; sid++) {
+			__m128 weight = _mm_set1_ps(weights[sid]);
+			__m128i id = _mm_set1_epi32(sid);
+			__m128i others = _mm_setr_epi32(0, 1, 2, 3);
+			__m128i rank = _mm_setzero_si128();
+			for (int other = 0; other < paddedSigmas; other += 4) {
+				__m128 w = _mm_loadu_ps(weights + other);
+				__m128 tie = _mm_and_ps(_mm_cmpeq_ps(w, weight),
+					_mm_castsi128_ps(_mm_cmpgt_epi32(others, id)));
+				__m128 outranks = _mm_or_ps(_mm_cmpgt_ps(w, weight), tie);
+				// true lanes are -1
+				rank = _mm_sub_epi32(rank, _mm_castps_si128(outranks));
+				others = _mm_add_epi32(others, _mm_set1_epi32(4));
+			}
+			rank = _mm_add_epi32(rank, _mm_shuffle_epi32(rank, _MM_SHUFFLE(1, 0, 3, 2)));
+			rank = _mm_add_epi32(rank, _mm_shuffle_epi32(rank, _MM_SHUFFLE(2, 3, 0, 1)));
+			if (_mm_cvtsi128_si32(rank) < GaussianParams::NUM_GAUSSIANS)
+				selection |= 1u << sid;
+		}
+		return selection;
+	}
+}
 
-	return getParamsFromRGBProfile(profile, psp.sigmas);
+uint32_t GaussianParamsCalculator::selectSigmas(const float* profile, int nSigmas) {
+	// Take most significant 6 sigmas
+	float weights[MAX_SIGMAS];
+	for (int sid = 0; sid < nSigmas; sid++) {
+		float r = profile[sid] * LUMINANCE[0];
+		float g = profile[nSigmas + sid] * LUMINANCE[1];
+		float b = profile[2 * nSigmas + sid] * LUMINANCE[2];
+		weights[sid] = r * r + g * g + b * b;
+	}
+	return selectLargest(weights, nSigmas);
 }
 
-GaussianParams GaussianParamsCalculator::getParamsFromRGBProfile(const RGBProfile& profile,
-	const std::vector<float>& sigmas)
+void GaussianParamsCalculator::makeReductionPlan(uint32_t selection, const float* sigmas, int nSigmas,
+	ReductionPlan& plan)
 {
+	plan.selection = selection;
+	int swid = 0;
+	for (int sid = 0; sid < nSigmas; sid++) {
+		if (selection & (1u << sid))
+			plan.selected[swid++] = (uint8_t)sid;
+	}
+	// append rest Gaussian weights to the nearest selected sigma
+	for (int sid = 0; sid < nSigmas; sid++) {
+		float sigma = sigmas[sid];
+		int nearestswid = 0;
+		float nearestdiff = abs(sigma - sigmas[plan.selected[0]]);
+		for (int selswid = 1; selswid < GaussianParams::NUM_GAUSSIANS; selswid++) {
+			float diff = abs(sigma - sigmas[plan.selected[selswid]]);
+			// select instead of branching, the winner is hard to predict
+			nearestswid = diff < nearestdiff ? selswid : nearestswid;
+			nearestdiff = diff < nearestdiff ? diff : nearestdiff;
+		}
+		plan.slots[sid] = (uint8_t)nearestswid;
+	}
+}
+
+GaussianParams GaussianParamsCalculator::reduce(const ReductionPlan& plan, const float* profile,
+	const float* sigmas, int nSigmas)
+{
+	const float* red = profile;
+	const float* green = profile + nSigmas;
+	const float* blue = profile + 2 * nSigmas;
+
 	GaussianParams gp;
-	if (sigmas.size() > GaussianParams::NUM_GAUSSIANS) {
-		// Take most significant 6 sigmas
-		vector<SigmaWeight> sws;
-		float rtotal = 0, gtotal = 0, btotal = 0;
-		for (size_t sid = 0; sid < sigmas.size(); sid++) {
-			SigmaWeight sw = { sid, 0.f };
-			// For RGB color spaces that use the ITU-R BT.709 primaries
-			// (or sRGB, which defines the same primaries), relative luminance
-			// can be calculated from linear RGB components:
-			// Y = 0.2126 R + 0.7152 G + 0.0722 B
-			// @ http://www.w3.org/Graphics/Color/sRGB
-			float r = profile.red[sid] * 0.2126f;
-			float g = profile.green[sid] * 0.7152f;
-			float b = profile.blue[sid] * 0.0722f;
-			rtotal += profile.red[sid];
-			gtotal += profile.green[sid];
-			btotal += profile.blue[sid];
-			sw.weight += r * r + g * g + b * b;
-			sws.push_back(sw);
-		}
-		partial_sort(sws.begin(), sws.begin() + GaussianParams::NUM_GAUSSIANS, sws.end(),
-			[] (const SigmaWeight& sw1, const SigmaWeight& sw2) {
-				if (sw1.weight > sw2.weight)
-					return true;
-				if (sw1.weight == sw2.weight)
-					return sw1.id > sw2.id;
-				return false;
-			}
-		);
-		sort(sws.begin(), sws.begin() + GaussianParams::NUM_GAUSSIANS,
-			[] (const SigmaWeight& sw1, const SigmaWeight& sw2) {
-				return sw1.id < sw2.id;
+	// write values into GaussianParams in sigma order
+	for (int swid = 0; swid < GaussianParams::NUM_GAUSSIANS; swid++) {
+		int sid = plan.selected[swid];
+		gp.sigmas[swid] = sigmas[sid];
+		gp.coeffs[swid].x = red[sid];
+		gp.coeffs[swid].y = green[sid];
+		gp.coeffs[swid].z = blue[sid];
+	}
+	for (int sid = 0; sid < nSigmas; sid++) {
+		if (plan.selection & (1u << sid))
+			continue;
+		XMFLOAT3& coeffs = gp.coeffs[plan.slots[sid]];
+		coeffs.x += red[sid];
+		coeffs.y += green[sid];
+		coeffs.z += blue[sid];
+	}
+	return gp;
+}
+
+GaussianParams GaussianParamsCalculator::getParamsFromRGBProfile(const float* profile,
+	const float* sigmas, int nSigmas)
+{
+	if (nSigmas > GaussianParams::NUM_GAUSSIANS) {
+		ReductionPlan plan;
+		makeReductionPlan(selectSigmas(profile, nSigmas), sigmas, nSigmas, plan);
+		return reduce(plan, profile, sigmas, nSigmas);
+	}
+
+	const float* red = profile;
+	const float* green = profile + nSigmas;
+	const float* blue = profile + 2 * nSigmas;
+
+	GaussianParams gp;
+	// pad zeros
+	int numZeros = GaussianParams::NUM_GAUSSIANS - nSigmas;
+	for (int i = 0; i < numZeros; i++) {
+		gp.sigmas[i] = 0.f;
+		gp.coeffs[i] = XMFLOAT3(0, 0, 0);
+	}
+	// write values into GaussianParams
+	for (int sid = 0; sid < nSigmas; sid++) {
+		gp.sigmas[numZeros + sid] = sigmas[sid];
+		gp.coeffs[numZeros + sid].x = red[sid];
+		gp.coeffs[numZeros + sid].y = green[sid];
+		gp.coeffs[numZeros + sid].z = blue[sid];
+	}
+	return gp;
+}
+
+void GaussianParamsCalculator::reductionError(const float* profile, const float* sigmas, int nSigmas,
+	const GaussianParams& gp, float* error)
+{
+	// The 2D Gaussians of variances a and b overlap by 1 / (2 pi (a + b)) over the plane,
+	// so the norms are sums over pairs, and 2 pi cancels out of their ratio. The kept
+	// sigmas are appended with negated coefficients to get the difference.
+	for (int ch = 0; ch < ProfileSpace::NUM_CHANNELS; ch++) {
+		const float* coeffs = profile + ch * nSigmas;
+		double diff[MAX_SIGMAS + GaussianParams::NUM_GAUSSIANS];
+		double variances[MAX_SIGMAS + GaussianParams::NUM_GAUSSIANS];
+		for (int sid = 0; sid < nSigmas; sid++) {
+			diff[sid] = coeffs[sid];
+			variances[sid] = (double)sigmas[sid] * sigmas[sid];
+		}
+		int n = nSigmas;
+		for (int i = 0; i < GaussianParams::NUM_GAUSSIANS; i++) {
+			// Padding
+			if (gp.sigmas[i] <= 0.f)
+				continue;
+			diff[n] = -(&gp.coeffs[i].x)[ch];
+			variances[n] = (double)gp.sigmas[i] * gp.sigmas[i];
+			n++;
+		}
+
+		double fullNorm = 0., diffNorm = 0.;
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				double overlap = 1. / (variances[i] + variances[j]);
+				diffNorm += diff[i] * diff[j] * overlap;
+				if (i < nSigmas && j < nSigmas)
+					fullNorm += diff[i] * diff[j] * overlap;
 			}
-		);
-		// write values into GaussianParams
-		for (size_t swid = 0; swid < GaussianParams::NUM_GAUSSIANS; swid++) {
-			int sid = sws[swid].id;
-			gp.sigmas[swid] = sigmas[sid];
-			gp.coeffs[swid].x = profile.red[sid];
-			gp.coeffs[swid].y = profile.green[sid];
-			gp.coeffs[swid].z = profile.blue[sid];
-		}
-		// append rest Gaussian weights to the nearest selected sigma
-		for (size_t swid = GaussianParams::NUM_GAUSSIANS; swid < sigmas.size(); swid++) {
-			int sid = sws[swid].id;
-			float sigma = sigmas[sid];
-			size_t nearestswid = 0;
-			float nearestdiff = abs(sigma - sigmas[sws[0].id]);
-			for (size_t selswid = 1; selswid < GaussianParams::NUM_GAUSSIANS; selswid++) {
-				float diff = abs(sigma - sigmas[sws[selswid].id]);
-				if (diff < nearestdiff) {
-					nearestdiff = diff;
-					nearestswid = selswid;
+		}
+		error[ch] = fullNorm > 0. ? (float)sqrt(max(diffNorm, 0.) / fullNorm) : 0.f;
+	}
+}
+
+GaussianParams GaussianParamsCalculator::getParamsFromCell(const LerpStruct* lerps, float* profile) const {
+	const float* sigmas = &psp.sigmas[0];
+	int nSigmas = (int)psp.sigmas.size();
+	if (adaptiveRefinement) {
+		float position[MAX_DIMS];
+		for (size_t d = 0; d < psp.paramSamplePoints.size(); d++)
+			position[d] = lerps[d].minId + lerps[d].lerpAmount;
+		// The reduction plans only hold for the table itself
+		if (adaptiveSpace->correct(cellGridId(lerps), position, profile))
+			return getParamsFromRGBProfile(profile, sigmas, nSigmas);
+	}
+	if (!cellPlans.empty()) {
+		uint16_t planId = cellPlans[cellGridId(lerps)];
+		if (planId != NO_PLAN)
+			return reduce(reductionPlans[planId], profile, sigmas, nSigmas);
+	}
+	// The selection may change inside this cell
+	return getParamsFromRGBProfile(profile, sigmas, nSigmas);
+}
+
+int GaussianParamsCalculator::cellGridId(const LerpStruct* lerps) const {
+	// A cell is named after its lowest corner. Samples on the last point of an
+	// axis belong to the cell below it.
+	int gridId = 0;
+	for (size_t d = 0; d < psp.paramSamplePoints.size(); d++) {
+		const SamplePoints& sp = psp.paramSamplePoints[d];
+		int lastCell = max((int)sp.points.size() - 2, 0);
+		gridId += min(lerps[d].minId, lastCell) * sp.idMultiplier;
+	}
+	return gridId;
+}
+
+void GaussianParamsCalculator::buildReductionPlans() {
+	reductionPlans.clear();
+	cellPlans.clear();
+	int nSigmas = (int)psp.sigmas.size();
+	if (nSigmas <= GaussianParams::NUM_GAUSSIANS)
+		return;
+
+	// Offsets from the lowest corner of a cell to all of its corners
+	vector<int> cornerOffsets(1, 0);
+	for (const SamplePoints& sp : psp.paramSamplePoints) {
+		if (sp.points.size() < 2)
+			continue;
+		size_t nCorners = cornerOffsets.size();
+		for (size_t c = 0; c < nCorners; c++)
+			cornerOffsets.push_back(cornerOffsets[c] + sp.idMultiplier);
+	}
+
+	map<uint32_t, uint16_t> planIds;
+	cellPlans.assign(psp.numProfiles, (uint16_t)NO_PLAN);
+	for (int gridId = 0; gridId < psp.numProfiles; gridId++) {
+		bool isCell = true;
+		for (const SamplePoints& sp : psp.paramSamplePoints) {
+			int n = (int)sp.points.size();
+			if (n > 1 && gridId / sp.idMultiplier % n == n - 1)
+				isCell = false;
+		}
+		if (!isCell)
+			continue;
+
+		// Inside the cell every channel is a convex combination of the corners,
+		// which bounds the weight selectSigmas computes for each sigma
+		float minWeights[MAX_SIGMAS], maxWeights[MAX_SIGMAS];
+		for (int sid = 0; sid < nSigmas; sid++) {
+			minWeights[sid] = maxWeights[sid] = 0.f;
+			for (int channel = 0; channel < ProfileSpace::NUM_CHANNELS; channel++) {
+				float lo = FLT_MAX, hi = -FLT_MAX;
+				for (int offset : cornerOffsets) {
+					float v = psp.profile(gridId + offset)[channel * nSigmas + sid] * LUMINANCE[channel];
+					lo = min(lo, v);
+					hi = max(hi, v);
 				}
+				float slack = max(abs(lo), abs(hi)) * PLAN_BOUND_EPSILON;
+				lo -= slack;
+				hi += slack;
+				if (lo > 0.f)
+					minWeights[sid] += lo * lo;
+				else if (hi < 0.f)
+					minWeights[sid] += hi * hi;
+				maxWeights[sid] += max(lo * lo, hi * hi);
 			}
-			gp.coeffs[nearestswid].x += profile.red[sid];
-			gp.coeffs[nearestswid].y += profile.green[sid];
-			gp.coeffs[nearestswid].z += profile.blue[sid];
 		}
-	} else {
-		// pad zeros
-		int numZeros = GaussianParams::NUM_GAUSSIANS - sigmas.size();
-		for (int i = 0; i < numZeros; i++) {
-			gp.sigmas[i] = 0.f;
-			gp.coeffs[i] = XMFLOAT3(0, 0, 0);
+
+		// The cell keeps one selection only if the kept sigmas outweigh the rest everywhere
+		uint32_t selection = selectLargest(minWeights, nSigmas);
+		float minSelected = FLT_MAX;
+		float maxRejected = 0.f;
+		for (int sid = 0; sid < nSigmas; sid++) {
+			if (selection & (1u << sid))
+				minSelected = min(minSelected, minWeights[sid]);
+			else
+				maxRejected = max(maxRejected, maxWeights[sid]);
 		}
-		// write values into GaussianParams
-		for (size_t sid = 0; sid < sigmas.size(); sid++) {
-			gp.sigmas[numZeros + sid] = sigmas[sid];
-			gp.coeffs[numZeros + sid].x = profile.red[sid];
-			gp.coeffs[numZeros + sid].y = profile.green[sid];
-			gp.coeffs[numZeros + sid].z = profile.blue[sid];
+		if (!(minSelected > maxRejected))
+			continue;
+
+		auto iter = planIds.find(selection);
+		if (iter == planIds.end()) {
+			if (reductionPlans.size() >= NO_PLAN)
+				continue;
+			ReductionPlan plan;
+			makeReductionPlan(selection, &psp.sigmas[0], nSigmas, plan);
+			iter = planIds.insert(make_pair(selection, (uint16_t)reductionPlans.size())).first;
+			reductionPlans.push_back(plan);
 		}
+		cellPlans[gridId] = iter->second;
 	}
-
-	return gp;
 }
 
 GaussianParamsCalculator::GaussianFuture
 	GaussianParamsCalculator::getLiveFitParams(const VariableParams& vps) const
 {
-	static bool firstCall = true;
-	if (firstCall) {
-		SampledSpectrum::Init();
-		firstCall = false;
+	typedef chrono::high_resolution_clock Clock;
+	Clock::time_point startTime = Clock::now();
+	SampledSpectrum::Init();
+
+	int numFittedComponents = liveFitComponents;
+	LiveFitMode mode = liveFitMode;
+	shared_ptr<LiveFitReport> report(new LiveFitReport(vps, mode, numFittedComponents));
+
+	// Options of the full pass, a cached fit has to match them
+	GaussianFitOptions options;
+	options.numFittedComponents = numFittedComponents;
+	GaussianParams cached;
+	if (liveFitCache && liveFitCache->find(vps, psp.sigmas, options, cached)) {
+		report->cached = true;
+		report->totalTime = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - startTime);
+		promise<GaussianParams> ready;
+		ready.set_value(cached);
+		return GaussianFuture(ProgressiveGaussianFuture(ready.get_future(), [] { }, [] { return 1.; },
+			[] (GaussianParams&) { return false; }), report);
 	}
 
-	shared_ptr<TaskQueue> tq(new TaskQueue);
-	shared_ptr<mutex> pDelayMutex(new mutex);
-	shared_ptr<condition_variable_any> pDelayCondition(new condition_variable_any);
-	shared_ptr<bool> pCancel(new bool(false));
+	// Ahead of other work on the pool, the user waits for the fit
+	shared_ptr<TaskQueue> tq(new TaskQueue(TASK_PRIORITY_INTERACTIVE));
+	shared_ptr<LiveFitState> state(new LiveFitState);
+
+	future<GaussianParams> future =	std::async([vps, numFittedComponents, options, mode, tq, state, report,
+		startTime, this] () -> GaussianParams
+	{
+		// Fits share the fit caches, which are trimmed between fits, so they run one at a time.
+		// An aborted fit holds the lock only until its running tasks finish.
+		lock_guard<mutex> fitLock(liveFitMutex);
+		// Checks for a cancel, which ends the report
+		auto aborted = [&] {
+			if (!state->isCancelled())
+				return false;
+			report->aborted = true;
+			report->totalTime = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - startTime);
+			return true;
+		};
+		if (aborted())
+			return GaussianParams();
 
-	future<GaussianParams> future =	std::async([vps, tq, pDelayMutex, pDelayCondition, pCancel, this] () {
 		SkinCoefficients skinCoeffs(vps.f_mel, vps.f_eu, vps.f_blood, vps.f_ohg, 0, 0, 0);
-		SpectralGaussianCoeffs spectralGaussianCoeffs;
+		int nSigmas = (int)psp.sigmas.size();
+		float profile[ProfileSpace::NUM_CHANNELS * MAX_SIGMAS];
+
+		// The coarse pass gives a quick preview
+		Clock::time_point coarseStartTime = Clock::now();
+		GaussianFitOptions coarseOptions;
+		coarseOptions.desiredLength = COARSE_DESIRED_LENGTH;
+		coarseOptions.numFittedComponents = COARSE_FITTED_COMPONENTS;
+		SpectralGaussianCoeffs coarseCoeffs;
+		vector<Task*> tasks = CreateGaussianFitTasks(skinCoeffs, psp.sigmas, coarseCoeffs, coarseOptions);
+		{
+			// Scale the progress so it continues smoothly into the full pass
+			lock_guard<mutex> lock(state->mutex);
+			// The RGB mode adds the fits of the channels
+			int fullTasks = numFittedComponents + (mode == LIVE_FIT_RGB ? ProfileSpace::NUM_CHANNELS : 0);
+			state->progressScale = (double)tasks.size() / (double)(tasks.size() + fullTasks);
+		}
+		runFitTasks(*tq, tasks);
+		if (aborted())
+			return GaussianParams();
 
+		FillSkippedComponents(coarseCoeffs, COARSE_FITTED_COMPONENTS);
+		SpectralToRGBProfile(coarseCoeffs, profile);
+		GaussianParams coarse = getParamsFromRGBProfile(profile, &psp.sigmas[0], nSigmas);
 		{
-			chrono::system_clock::time_point targetTime = chrono::system_clock::now() + chrono::seconds(2);
-			lock_guard<mutex> lock(*pDelayMutex);
-			do {
-				pDelayCondition->wait_until(*pDelayMutex, targetTime);
-			}
-			while (!*pCancel && chrono::system_clock::now() < targetTime);
-			if (*pCancel)
-				return GaussianParams();
+			lock_guard<mutex> lock(state->mutex);
+			state->intermediate = coarse;
+			state->hasIntermediate = true;
+			state->progressScale = 1.;
 		}
 
-		vector<Task*> tasks = CreateGaussianFitTasks(skinCoeffs, psp.sigmas, spectralGaussianCoeffs);
-		tq->EnqueueTasks(tasks);
-		tq->WaitForAllTasks();
+		// The full pass refines it
+		Clock::time_point fullStartTime = Clock::now();
+		report->coarseTime = chrono::duration_cast<chrono::nanoseconds>(fullStartTime - coarseStartTime);
+		report->sigmas = psp.sigmas;
+		SpectralGaussianCoeffs spectralGaussianCoeffs;
+		if (mode == LIVE_FIT_RGB) {
+			SpectralProfiles profiles;
+			tasks = CreateProfileTasks(skinCoeffs.layerCoeffs(), profiles, options);
+			runFitTasks(*tq, tasks);
+			report->componentStats = profiles.stats;
+			if (aborted())
+				return GaussianParams();
 
-		DestroyGaussianTasks(tasks);
-		ClearGaussianTasksCache();
-
-		// Our coeffs should be ready here
-		RGBProfile profile;
-		for (size_t sid = 0; sid < spectralGaussianCoeffs.sigmas.size(); sid++) {
-			float rgb[3];
-			spectralGaussianCoeffs.coeffs[sid].ToRGB(rgb);
-			profile.red.push_back(rgb[0]);
-			profile.green.push_back(rgb[1]);
-			profile.blue.push_back(rgb[2]);
-		}
-		return getParamsFromRGBProfile(profile, spectralGaussianCoeffs.sigmas);
+			RGBGaussianCoeffs rgbCoeffs;
+			tasks = CreateRGBFitTasks(profiles, psp.sigmas, rgbCoeffs);
+			runFitTasks(*tq, tasks);
+			report->channelStats = rgbCoeffs.stats;
+			report->channelErrors.assign(&rgbCoeffs.error[0], &rgbCoeffs.error[0] + ProfileSpace::NUM_CHANNELS);
+			if (aborted())
+				return GaussianParams();
+
+			rgbToProfile(rgbCoeffs, profile);
+		} else {
+			tasks = CreateGaussianFitTasks(skinCoeffs, psp.sigmas, spectralGaussianCoeffs, options);
+			runFitTasks(*tq, tasks);
+			report->componentStats = spectralGaussianCoeffs.stats;
+			// An aborted fit is incomplete and must not be cached
+			if (aborted())
+				return GaussianParams();
+
+			FillSkippedComponents(spectralGaussianCoeffs, numFittedComponents);
+			report->componentErrors.assign(&spectralGaussianCoeffs.error[0],
+				&spectralGaussianCoeffs.error[0] + SampledSpectrum::nComponents);
+			SpectralToRGBProfile(spectralGaussianCoeffs, profile);
+		}
+
+		Clock::time_point reduceStartTime = Clock::now();
+		report->fullTime = chrono::duration_cast<chrono::nanoseconds>(reduceStartTime - fullStartTime);
+		GaussianParams gp = getParamsFromRGBProfile(profile, &psp.sigmas[0], nSigmas);
+		Clock::time_point reduceEndTime = Clock::now();
+		report->reduceTime = chrono::duration_cast<chrono::nanoseconds>(reduceEndTime - reduceStartTime);
+		reductionError(profile, &psp.sigmas[0], nSigmas, gp, report->reductionError);
+
+		// The RGB mode and reduced fits are cheaper but less accurate
+		if (mode == LIVE_FIT_SPECTRAL && numFittedComponents >= MAX_LIVE_FIT_COMPONENTS) {
+			refineWithLiveFit(vps, profile);
+			if (liveFitCache) {
+				liveFitCache->insert(vps, options, spectralGaussianCoeffs, gp);
+				liveFitCache->save();
+			}
+		}
+		report->totalTime = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - startTime);
+		return gp;
 	});
 
 	weak_ptr<TaskQueue> weak_tq(tq);
-	weak_ptr<mutex> weak_pDelayMutex(pDelayMutex);
-	weak_ptr<condition_variable_any> weak_pDelayCondition(pDelayCondition);
-	weak_ptr<bool> weak_pCancel(pCancel);
-	return GaussianFuture(std::move(future), [weak_tq, weak_pDelayMutex, weak_pDelayCondition, weak_pCancel] {
-		if (auto tq = weak_tq.lock())
-			tq->Abort();
-		if (auto pDelayMutex = weak_pDelayMutex.lock()) {
-			if (auto pCancel = weak_pCancel.lock()) {
-				lock_guard<mutex> lock(*pDelayMutex);
-				*pCancel = true;
-			}
+	weak_ptr<LiveFitState> weak_state(state);
+	return GaussianFuture(ProgressiveGaussianFuture(std::move(future), [weak_tq, weak_state] {
+		// Cancel before aborting the tasks, so the fit sees the flag once its tasks are gone
+		if (auto state = weak_state.lock()) {
+			lock_guard<mutex> lock(state->mutex);
+			state->cancelled = true;
 		}
-		if (auto pDelayCondition = weak_pDelayCondition.lock())
-			pDelayCondition->notify_one();
-	}, [weak_tq] {
 		if (auto tq = weak_tq.lock())
-			return tq->Progress();
-		return 1.;
-	});
+			tq->Abort();
+	}, [weak_tq, weak_state] {
+		auto tq = weak_tq.lock();
+		auto state = weak_state.lock();
+		if (!tq || !state)
+			return 1.;
+		lock_guard<mutex> lock(state->mutex);
+		return tq->Progress() * state->progressScale;
+	}, [weak_state] (GaussianParams& out) {
+		auto state = weak_state.lock();
+		if (!state)
+			return false;
+		lock_guard<mutex> lock(state->mutex);
+		if (!state->hasIntermediate)
+			return false;
+		out = state->intermediate;
+		state->hasIntermediate = false;
+		return true;
+	}), report);
 }
 
-chrono::microseconds GaussianParamsCalculator::perf() const {
+chrono::nanoseconds GaussianParamsCalculator::perf() const {
 	RNG rng(31);
 	vector<VariableParams> vps;
 	// initialize bunch of VariableParams
@@ -487,6 +872,70 @@ chrono::microseconds GaussianParamsCalculator::perf() const {
 		volatile GaussianParams gp = getParams(vp);
 	}
 	chrono::high_resolution_clock::time_point endTime = chrono::high_resolution_clock::now();
-	return chrono::duration_cast<chrono::microseconds>((endTime - startTime) / NUM);
+	return chrono::duration_cast<chrono::nanoseconds>(endTime - startTime) / NUM;
+}
+
+
+void GaussianParamsCalculator::resample(int resolution, bool uniform, ProfileSpace& out) const {
+	// f_mel and f_blood are the axes that get dense in fitted tables
+	const int DENSE_DIMS[] = { 0, 2 };
+	int dims = (int)psp.paramSamplePoints.size();
+
+	out.sigmas = psp.sigmas;
+	out.paramSamplePoints = psp.paramSamplePoints;
+	for (int d : DENSE_DIMS) {
+		if (d >= dims)
+			continue;
+		vector<float>& points = out.paramSamplePoints[d].points;
+		float first = points.front();
+		float range = points.back() - first;
+		points.resize(resolution);
+		for (int i = 0; i < resolution; i++) {
+			float t = (float)i / (float)(resolution - 1);
+			// quadratic spacing is denser towards the low end, like the fitted tables
+			points[i] = first + range * (uniform ? t : t * t);
+		}
+	}
+	prepareSamplePoints(out.paramSamplePoints);
+
+	out.numProfiles = 1;
+	for (const SamplePoints& sp : out.paramSamplePoints)
+		out.numProfiles *= (int)sp.points.size();
+	out.mappedFile.reset();
+	out.mappedProfiles = nullptr;
+	out.ownedProfiles.resize((size_t)out.numProfiles * out.profileStride());
+
+	// Fill the dense grid by interpolating the loaded one
+	for (int gridId = 0; gridId < out.numProfiles; gridId++) {
+		LerpStruct lerps[MAX_DIMS];
+		for (int d = 0; d < dims; d++) {
+			const SamplePoints& sp = out.paramSamplePoints[d];
+			int id = gridId / sp.idMultiplier % (int)sp.points.size();
+			lerps[d] = searchLerp(psp.paramSamplePoints[d], sp.points[id]);
+		}
+		sample(lerps, &out.ownedProfiles[(size_t)gridId * out.profileStride()]);
+	}
 }
 
+vector<GaussianParamsCalculator::PerfSample> GaussianParamsCalculator::perfByResolution() const {
+	const int RESOLUTIONS[] = { 8, 32, 128 };
+	vector<PerfSample> samples;
+	for (int resolution : RESOLUTIONS) {
+		PerfSample perfSample;
+		perfSample.resolution = resolution;
+		{
+			GaussianParamsCalculator dense;
+			resample(resolution, true, dense.psp);
+			dense.buildReductionPlans();
+			perfSample.uniform = dense.perf();
+		}
+		{
+			GaussianParamsCalculator dense;
+			resample(resolution, false, dense.psp);
+			dense.buildReductionPlans();
+			perfSample.nonUniform = dense.perf();
+		}
+		samples.push_back(perfSample);
+	}
+	return samples;
+}
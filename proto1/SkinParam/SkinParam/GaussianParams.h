@@ -37,26 +37,13 @@
 
 #include "Utils/Color.h"
 #include "Parallel/AbortableFuture.h"
+#include "ProfileSpace.h"
 #include <vector>
 #include <chrono>
+#include <mutex>
+#include <atomic>
 
 namespace Skin {
-	// Necessary structs to store the gaussian params
-	typedef std::vector<float> SingleProfile;
-	struct RGBProfile {
-		SingleProfile red, green, blue;
-	};
-	struct SamplePoints {
-		std::vector<float> points;
-		int idMultiplier;
-	};
-	// The N-dimensional space of profiles
-	struct ProfileSpace {
-		std::vector<float> sigmas;
-		std::vector<SamplePoints> paramSamplePoints;
-		std::vector<RGBProfile> profiles;
-	};
-
 	struct GaussianParams {
 	public:
 		static const int NUM_GAUSSIANS = 6;
@@ -71,24 +58,134 @@ namespace Skin {
 	};
 
 	struct LerpStruct;
+	class LiveFitCache;
+	class AdaptiveProfileSpace;
+	struct LiveFitReport;
 
 	class GaussianParamsCalculator {
 	public:
-		typedef Parallel::AbortableFuture<GaussianParams,
-			std::function<void()>, std::function<double()> > GaussianFuture;
+		// Live fits publish a coarse result first, see getLiveFitParams
+		typedef Parallel::ProgressiveFuture<GaussianParams, std::function<void()>,
+			std::function<double()>, std::function<bool(GaussianParams&)> > ProgressiveGaussianFuture;
+
+		// A live fit along with the report of how it went
+		class GaussianFuture : public ProgressiveGaussianFuture {
+		public:
+			GaussianFuture(ProgressiveGaussianFuture&& base, std::shared_ptr<const LiveFitReport> report)
+				: ProgressiveGaussianFuture(std::move(base)), fitReport(report) { }
+			GaussianFuture(GaussianFuture&& other)
+				: ProgressiveGaussianFuture(std::move(other)), fitReport(std::move(other.fitReport)) { }
+
+			// The fit fills it in as it goes, so it is complete only once the future is ready
+			std::shared_ptr<const LiveFitReport> report() const { return fitReport; }
+		private:
+			std::shared_ptr<const LiveFitReport> fitReport;
+		};
+
+		// Upper bounds of the profile tables supported by the lookups
+		static const int MAX_DIMS = 4;
+		static const int MAX_SIGMAS = 32;
+		// Spectral components of a full live fit
+		static const int MAX_LIVE_FIT_COMPONENTS = 30;
+
+		// How the full pass of a live fit turns the spectral profiles into RGB
+		enum LiveFitMode {
+			// Fits each spectral component and converts the coefficients
+			LIVE_FIT_SPECTRAL,
+			// Converts the profiles and fits each channel. The profiles cost the same, so
+			// a fit takes about 15% less; the RGB profile is off by 0.2% for light skin
+			// and up to 7% with dense melanin and blood against the spectral mode.
+			LIVE_FIT_RGB
+		};
 
 		GaussianParamsCalculator(const Utils::TString& filename);
 		GaussianParams getParams(const VariableParams& vps) const;
+		// Same results as getParams for each element; large batches are split across cores
+		void getParamsBatch(const VariableParams* in, GaussianParams* out, size_t n) const;
+		// Starts a coarse fit at once and refines it in the background; aborting the
+		// future cancels both. The future reports the errors and costs of the full pass.
 		GaussianFuture getLiveFitParams(const VariableParams& vps) const;
-		std::chrono::microseconds perf() const;
+		// Completed live fits refine later lookups near them while enabled
+		void setAdaptiveRefinement(bool enabled) { adaptiveRefinement = enabled; }
+		bool getAdaptiveRefinement() const { return adaptiveRefinement; }
+		// Spectral components fitted by the full pass of later live fits, see
+		// GaussianFitOptions::numFittedComponents. Fits with fewer than all of them are
+		// cheaper but neither cached nor used for the adaptive refinement.
+		void setLiveFitComponents(int n) { liveFitComponents = n; }
+		int getLiveFitComponents() const { return liveFitComponents; }
+		// RGB fits are cheaper but neither cached nor used for the adaptive refinement
+		void setLiveFitMode(LiveFitMode mode) { liveFitMode = mode; }
+		LiveFitMode getLiveFitMode() const { return liveFitMode; }
+		std::chrono::nanoseconds perf() const;
+
+		struct PerfSample {
+			int resolution;
+			std::chrono::nanoseconds uniform;
+			std::chrono::nanoseconds nonUniform;
+		};
+		// Lookup cost with the f_mel and f_blood axes resampled to denser grids,
+		// once uniformly and once non-uniformly spaced
+		std::vector<PerfSample> perfByResolution() const;
 	private:
-		ProfileSpace psp;
-		RGBProfile sample(const float* params) const;
-		RGBProfile nsample(int baseId, int nDims, int dim, const LerpStruct* lerps) const;
-		void parseFile(const Utils::TString& filename);
+		// Number of lookups in a chunk of getParamsBatch
+		static const size_t BATCH_TASK_SIZE = 4096;
 
-		static GaussianParams getParamsFromRGBProfile(const RGBProfile& rgbProfile,
-			const std::vector<float>& sigmas);
+		ProfileSpace psp;
+		// Live fits already computed for this table, shared with pending fits
+		std::shared_ptr<LiveFitCache> liveFitCache;
+		// Held by the running live fit
+		mutable std::mutex liveFitMutex;
+		// Residuals of live fits against the table
+		std::shared_ptr<AdaptiveProfileSpace> adaptiveSpace;
+		// Set by the UI thread while lookups and live fits read them
+		std::atomic<bool> adaptiveRefinement;
+		std::atomic<int> liveFitComponents;
+		std::atomic<LiveFitMode> liveFitMode;
+
+		GaussianParamsCalculator() : adaptiveRefinement(false),
+			liveFitComponents(MAX_LIVE_FIT_COMPONENTS), liveFitMode(LIVE_FIT_SPECTRAL) { }
+		// adaptiveSpace refers to psp
+		GaussianParamsCalculator(const GaussianParamsCalculator&);
+		GaussianParamsCalculator& operator=(const GaussianParamsCalculator&);
+
+		void searchLerps(const VariableParams& vps, LerpStruct* lerps) const;
+		void refineWithLiveFit(const VariableParams& vps, const float* profile) const;
+		void seedAdaptiveSpace();
+		void resample(int resolution, bool uniform, ProfileSpace& out) const;
+		void sample(const LerpStruct* lerps, float* profile) const;
+		void getParamsRange(const VariableParams* in, GaussianParams* out, size_t n) const;
+
+		// Reduction of a profile to NUM_GAUSSIANS sigmas, fixed once the kept sigmas are known
+		struct ReductionPlan {
+			uint32_t selection;
+			// Kept sigma ids in increasing order
+			uint8_t selected[GaussianParams::NUM_GAUSSIANS];
+			// Index into selected that each sigma is merged into
+			uint8_t slots[MAX_SIGMAS];
+		};
+		static const uint16_t NO_PLAN = 0xffff;
+		// Precomputed for cells whose selection cannot change inside the cell,
+		// indexed by the grid id of the lowest corner
+		std::vector<ReductionPlan> reductionPlans;
+		std::vector<uint16_t> cellPlans;
+
+		void buildReductionPlans();
+		int cellGridId(const LerpStruct* lerps) const;
+		GaussianParams getParamsFromCell(const LerpStruct* lerps, float* profile) const;
+		static uint32_t selectSigmas(const float* profile, int nSigmas);
+		static void makeReductionPlan(uint32_t selection, const float* sigmas, int nSigmas,
+			ReductionPlan& plan);
+		static GaussianParams reduce(const ReductionPlan& plan, const float* profile,
+			const float* sigmas, int nSigmas);
+		void loadFile(const Utils::TString& filename);
+		void checkLimits(const Utils::TString& filename) const;
+
+		// profile is indexed [channel][sigma]
+		static GaussianParams getParamsFromRGBProfile(const float* profile,
+			const float* sigmas, int nSigmas);
+		// Relative L2 error per channel of gp against the profile it was reduced from
+		static void reductionError(const float* profile, const float* sigmas, int nSigmas,
+			const GaussianParams& gp, float* error);
 	};
 
 };
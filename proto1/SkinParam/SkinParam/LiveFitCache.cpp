@@ -0,0 +1,313 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Cache of live fit results keyed by quantized skin parameters
+ */
+
+#include "StdAfx.h"
+
+#include "LiveFitCache.h"
+#include <fstream>
+#include <sstream>
+#include <cmath>
+
+using namespace std;
+using namespace Skin;
+using namespace Utils;
+using namespace ProfileFit;
+
+namespace Skin {
+
+	// Parameters closer than this fall on the same cache entry
+	static const float PARAM_QUANTUM = 1e-4f;
+
+	// Cache file, all values little endian:
+	//   LiveFitFileHeader, with the fit revision and the options of all entries
+	//   for each entry up to the end of the file, oldest first:
+	//     int32_t params[4], uint32_t numSigmas, float sigmas[numSigmas]
+	//     float coeffs[numSigmas][numSpectralSamples], float error[numSpectralSamples]
+	//     float gaussianSigmas[NUM_GAUSSIANS], float gaussianCoeffs[NUM_GAUSSIANS][3]
+	struct LiveFitFileHeader {
+		static const uint32_t CURRENT_VERSION = 3;
+
+		char magic[4];
+		uint32_t version;
+		uint32_t fitRevision;
+		uint32_t desiredLength;
+		uint32_t profileEngine;
+		float profileTolerance;
+		uint32_t numSpectralSamples;
+	};
+
+	static const char LIVE_FIT_MAGIC[4] = { 'S', 'o', 'G', 'L' };
+
+	static uint32_t hashSigmas(const vector<float>& sigmas) {
+		// FNV-1a over the raw bits
+		uint32_t hash = 2166136261u;
+		const unsigned char* bytes = (const unsigned char*)(sigmas.empty() ? nullptr : &sigmas[0]);
+		for (size_t i = 0; i < sigmas.size() * sizeof(float); i++) {
+			hash ^= bytes[i];
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+
+	static void writeSpectrum(ostream& out, const SampledSpectrum& s) {
+		for (int i = 0; i < nSpectralSamples; i++)
+			out.write((const char*)&s[i], sizeof(float));
+	}
+
+	static bool readSpectrum(istream& in, SampledSpectrum& s) {
+		for (int i = 0; i < nSpectralSamples; i++) {
+			if (!in.read((char*)&s[i], sizeof(float)))
+				return false;
+		}
+		return true;
+	}
+
+} // namespace Skin
+
+const TCHAR* const LiveFitCache::EXTENSION = _T(".livefit");
+
+bool LiveFitCache::Key::operator<(const Key& other) const {
+	for (int i = 0; i < 4; i++) {
+		if (params[i] != other.params[i])
+			return params[i] < other.params[i];
+	}
+	return sigmaHash < other.sigmaHash;
+}
+
+LiveFitCache::LiveFitCache(const TString& filename, const GaussianFitOptions& fitOptions, size_t capacity)
+	: filename(filename), fitOptions(fitOptions), capacity(capacity), rewrite(true)
+{
+	load();
+}
+
+bool LiveFitCache::matches(const GaussianFitOptions& options) const {
+	// The number of fitted components is not stored, only full fits are cached
+	return options.desiredLength == fitOptions.desiredLength
+		&& options.profileEngine == fitOptions.profileEngine
+		&& options.profileTolerance == fitOptions.profileTolerance;
+}
+
+LiveFitCache::Key LiveFitCache::makeKey(const VariableParams& vps, const vector<float>& sigmas) {
+	float params[] = { vps.f_mel, vps.f_eu, vps.f_blood, vps.f_ohg };
+	Key key;
+	for (int i = 0; i < 4; i++)
+		key.params[i] = (int32_t)floor(params[i] / PARAM_QUANTUM + 0.5f);
+	key.sigmaHash = hashSigmas(sigmas);
+	return key;
+}
+
+bool LiveFitCache::find(const VariableParams& vps, const vector<float>& sigmas,
+	const GaussianFitOptions& options, GaussianParams& out)
+{
+	if (!matches(options))
+		return false;
+	Key key = makeKey(vps, sigmas);
+	lock_guard<std::mutex> lock(mutex);
+	auto iter = index.find(key);
+	// The sigma hash only narrows the search, the list itself has to match
+	if (iter == index.end() || iter->second->coeffs.sigmas != sigmas)
+		return false;
+	entries.splice(entries.begin(), entries, iter->second);
+	out = iter->second->params;
+	return true;
+}
+
+void LiveFitCache::insert(const VariableParams& vps, const GaussianFitOptions& options,
+	const SpectralGaussianCoeffs& coeffs, const GaussianParams& params)
+{
+	if (!matches(options))
+		return;
+	Entry entry;
+	entry.key = makeKey(vps, coeffs.sigmas);
+	entry.coeffs = coeffs;
+	entry.params = params;
+	lock_guard<std::mutex> lock(mutex);
+	add(entry);
+	unsaved.push_back(entry.key);
+}
+
+void LiveFitCache::add(const Entry& entry) {
+	auto iter = index.find(entry.key);
+	if (iter != index.end()) {
+		entries.erase(iter->second);
+		index.erase(iter);
+		rewrite = true;
+	}
+	entries.push_front(entry);
+	index[entry.key] = entries.begin();
+	while (entries.size() > capacity) {
+		index.erase(entries.back().key);
+		entries.pop_back();
+		rewrite = true;
+	}
+}
+
+void LiveFitCache::load() {
+	ifstream in(filename, ios::in | ios::binary);
+	if (!in)
+		return;
+
+	LiveFitFileHeader header;
+	if (!in.read((char*)&header, sizeof(header)) || memcmp(header.magic, LIVE_FIT_MAGIC, sizeof(LIVE_FIT_MAGIC))
+		|| header.version != LiveFitFileHeader::CURRENT_VERSION
+		|| header.fitRevision != GAUSSIAN_FIT_REVISION
+		|| header.desiredLength != fitOptions.desiredLength
+		|| header.profileEngine != (uint32_t)fitOptions.profileEngine
+		|| header.profileTolerance != fitOptions.profileTolerance
+		|| header.numSpectralSamples != (uint32_t)nSpectralSamples)
+	{
+		// Stale caches, or ones fitted otherwise, are rebuilt from scratch
+		return;
+	}
+
+	// The file only needs the new entries appended unless loading drops some of it.
+	// An entry cut short by a crash while appending is dropped with the rest of the file.
+	rewrite = false;
+	while (in.peek() != ifstream::traits_type::eof()) {
+		Entry entry;
+		if (!readEntry(in, entry)) {
+			rewrite = true;
+			return;
+		}
+		add(entry);
+	}
+}
+
+bool LiveFitCache::save() {
+	lock_guard<std::mutex> lock(mutex);
+	if (rewrite)
+		return rewriteFile();
+	if (unsaved.empty())
+		return true;
+
+	// Written in one go, so that an append of another instance does not land within
+	ostringstream data(ios::out | ios::binary);
+	for (const Key& key : unsaved)
+		writeEntry(data, *index[key]);
+	ofstream out(filename, ios::out | ios::binary | ios::app);
+	string bytes = data.str();
+	out.write(bytes.data(), bytes.size());
+	out.close();
+	if (out.fail()) {
+		rewrite = true;
+		return false;
+	}
+	unsaved.clear();
+	return true;
+}
+
+bool LiveFitCache::rewriteFile() {
+	// A crash or another instance never sees the file half written, the old one stays
+	// in place until the new one is complete
+	TStringStream tempFilename;
+	tempFilename << filename << _T(".") << GetCurrentProcessId() << _T(".tmp");
+	ofstream out(tempFilename.str(), ios::out | ios::binary | ios::trunc);
+	if (!out)
+		return false;
+
+	LiveFitFileHeader header;
+	memcpy(header.magic, LIVE_FIT_MAGIC, sizeof(LIVE_FIT_MAGIC));
+	header.version = LiveFitFileHeader::CURRENT_VERSION;
+	header.fitRevision = GAUSSIAN_FIT_REVISION;
+	header.desiredLength = fitOptions.desiredLength;
+	header.profileEngine = (uint32_t)fitOptions.profileEngine;
+	header.profileTolerance = fitOptions.profileTolerance;
+	header.numSpectralSamples = nSpectralSamples;
+	out.write((const char*)&header, sizeof(header));
+
+	// Oldest first, so loading restores the recency order
+	for (auto riter = entries.rbegin(); riter != entries.rend(); ++riter)
+		writeEntry(out, *riter);
+
+	out.close();
+	if (out.fail() || !MoveFileEx(tempFilename.str().c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		_tremove(tempFilename.str().c_str());
+		return false;
+	}
+	rewrite = false;
+	unsaved.clear();
+	return true;
+}
+
+bool LiveFitCache::readEntry(istream& in, Entry& entry) {
+	uint32_t numSigmas;
+	if (!in.read((char*)entry.key.params, sizeof(entry.key.params))
+		|| !in.read((char*)&numSigmas, sizeof(numSigmas))
+		|| numSigmas > (uint32_t)GaussianParamsCalculator::MAX_SIGMAS)
+	{
+		return false;
+	}
+	vector<float>& sigmas = entry.coeffs.sigmas;
+	sigmas.resize(numSigmas);
+	if (numSigmas && !in.read((char*)&sigmas[0], numSigmas * sizeof(float)))
+		return false;
+	entry.coeffs.coeffs.resize(numSigmas);
+	for (SampledSpectrum& s : entry.coeffs.coeffs) {
+		if (!readSpectrum(in, s))
+			return false;
+	}
+	if (!readSpectrum(in, entry.coeffs.error)
+		|| !in.read((char*)entry.params.sigmas, sizeof(entry.params.sigmas))
+		|| !in.read((char*)entry.params.coeffs, sizeof(entry.params.coeffs)))
+	{
+		return false;
+	}
+	entry.key.sigmaHash = hashSigmas(sigmas);
+	return true;
+}
+
+void LiveFitCache::writeEntry(ostream& out, const Entry& entry) {
+	const vector<float>& sigmas = entry.coeffs.sigmas;
+	uint32_t numSigmas = (uint32_t)sigmas.size();
+	out.write((const char*)entry.key.params, sizeof(entry.key.params));
+	out.write((const char*)&numSigmas, sizeof(numSigmas));
+	if (numSigmas)
+		out.write((const char*)&sigmas[0], numSigmas * sizeof(float));
+	for (const SampledSpectrum& s : entry.coeffs.coeffs)
+		writeSpectrum(out, s);
+	writeSpectrum(out, entry.coeffs.error);
+	out.write((const char*)entry.params.sigmas, sizeof(entry.params.sigmas));
+	out.write((const char*)entry.params.coeffs, sizeof(entry.params.coeffs));
+}
+
+void LiveFitCache::visit(const function<void(const VariableParams&, const SpectralGaussianCoeffs&)>& visitor) {
+	lock_guard<std::mutex> lock(mutex);
+	for (auto riter = entries.rbegin(); riter != entries.rend(); ++riter) {
+		const Key& key = riter->key;
+		VariableParams vps(key.params[0] * PARAM_QUANTUM, key.params[1] * PARAM_QUANTUM,
+			key.params[2] * PARAM_QUANTUM, key.params[3] * PARAM_QUANTUM);
+		visitor(vps, riter->coeffs);
+	}
+}
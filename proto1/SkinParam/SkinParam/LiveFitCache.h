@@ -0,0 +1,107 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Cache of live fit results keyed by quantized skin parameters
+ */
+
+#pragma once
+
+#include "GaussianParams.h"
+#include "ProfileFit/GaussianFitTask.h"
+#include <list>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace Skin {
+	// Live fits keyed by quantized (f_mel, f_eu, f_blood, f_ohg) and the sigma list.
+	// The most recently used entries are kept in memory and saved to a file,
+	// so the cache warms across sessions. All entries are fitted with the same
+	// options by the same revision of the fitting code, a file written with others
+	// is dropped. save appends the new entries to the file and only writes it anew,
+	// to a temporary file renamed over it, once entries are dropped. Cache hits
+	// reorder the entries in memory only.
+	class LiveFitCache {
+	public:
+		static const size_t DEFAULT_CAPACITY = 256;
+		static const TCHAR* const EXTENSION;
+
+		LiveFitCache(const Utils::TString& filename, const ProfileFit::GaussianFitOptions& fitOptions,
+			size_t capacity = DEFAULT_CAPACITY);
+
+		// Fits with other options than those of the cache are neither found nor kept
+		bool find(const VariableParams& vps, const std::vector<float>& sigmas,
+			const ProfileFit::GaussianFitOptions& options, GaussianParams& out);
+		void insert(const VariableParams& vps, const ProfileFit::GaussianFitOptions& options,
+			const ProfileFit::SpectralGaussianCoeffs& coeffs, const GaussianParams& params);
+		bool save();
+		// Calls visitor for every entry, oldest first, with the quantized parameters
+		void visit(const std::function<void(const VariableParams&, const ProfileFit::SpectralGaussianCoeffs&)>& visitor);
+	private:
+		LiveFitCache(const LiveFitCache&);
+		LiveFitCache& operator=(const LiveFitCache&);
+
+		struct Key {
+			int32_t params[4];
+			uint32_t sigmaHash;
+
+			bool operator<(const Key& other) const;
+		};
+		struct Entry {
+			Key key;
+			ProfileFit::SpectralGaussianCoeffs coeffs;
+			GaussianParams params;
+		};
+		// Most recently used first
+		typedef std::list<Entry> EntryList;
+
+		Utils::TString filename;
+		ProfileFit::GaussianFitOptions fitOptions;
+		size_t capacity;
+		std::mutex mutex;
+		EntryList entries;
+		std::map<Key, EntryList::iterator> index;
+		// Inserted since the last save, which appends them
+		std::vector<Key> unsaved;
+		// The file holds entries that were dropped since, or none of the entries at all,
+		// so the next save writes it anew
+		bool rewrite;
+
+		static Key makeKey(const VariableParams& vps, const std::vector<float>& sigmas);
+		bool matches(const ProfileFit::GaussianFitOptions& options) const;
+		void load();
+		void add(const Entry& entry);
+		bool rewriteFile();
+		static bool readEntry(std::istream& in, Entry& entry);
+		static void writeEntry(std::ostream& out, const Entry& entry);
+	};
+} // namespace Skin
@@ -0,0 +1,164 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Quality and cost of a live fit
+ */
+
+#include "StdAfx.h"
+
+#include "LiveFitReport.h"
+#include <cmath>
+#include <limits>
+
+using namespace std;
+using namespace Skin;
+using namespace ProfileFit;
+
+namespace Skin {
+
+	// JSON has no infinities or NaNs, missing values are NaN
+	static void writeNumber(ostream& out, double value) {
+		if (_finite(value))
+			out << value;
+		else
+			out << "null";
+	}
+
+	static void writeMilliseconds(ostream& out, chrono::nanoseconds time) {
+		writeNumber(out, (double)time.count() / 1e6);
+	}
+
+	static void writeFit(ostream& out, const vector<float>& sigmas, float error, const FitStats& stats) {
+		out << "\"fitted\": " << (stats.fitted ? "true" : "false")
+			<< ", \"cached\": " << (stats.cached ? "true" : "false")
+			<< ", \"error\": ";
+		writeNumber(out, error);
+		out << ", \"sigmaWindow\": ";
+		if (stats.firstSigma >= 0) {
+			out << "[";
+			writeNumber(out, sigmas[stats.firstSigma]);
+			out << ", ";
+			writeNumber(out, sigmas[stats.lastSigma]);
+			out << "]";
+		} else {
+			out << "null";
+		}
+		out << ", \"profileSamples\": " << stats.profileSamples << ", \"profileMs\": ";
+		writeMilliseconds(out, stats.profileTime);
+		out << ", \"resampleMs\": ";
+		writeMilliseconds(out, stats.resampleTime);
+		out << ", \"fitMs\": ";
+		writeMilliseconds(out, stats.fitTime);
+	}
+
+	// Sums the samples and stage times of the tasks
+	static void addStats(const vector<FitStats>& stats, FitStats& total) {
+		for (const FitStats& s : stats) {
+			total.profileSamples += s.profileSamples;
+			total.profileTime += s.profileTime;
+			total.resampleTime += s.resampleTime;
+			total.fitTime += s.fitTime;
+		}
+	}
+
+} // namespace Skin
+
+LiveFitReport::LiveFitReport(const VariableParams& vps, GaussianParamsCalculator::LiveFitMode mode,
+	int numFittedComponents)
+	: params(vps), mode(mode), numFittedComponents(numFittedComponents), cached(false),
+	aborted(false), coarseTime(0), fullTime(0), reduceTime(0), totalTime(0)
+{
+	for (int ch = 0; ch < ProfileSpace::NUM_CHANNELS; ch++)
+		reductionError[ch] = 0.f;
+}
+
+void LiveFitReport::writeJSON(ostream& out) const {
+	streamsize precision = out.precision(7);
+
+	out << "{" << endl;
+	out << "\t\"params\": {\"f_mel\": " << params.f_mel << ", \"f_eu\": " << params.f_eu
+		<< ", \"f_blood\": " << params.f_blood << ", \"f_ohg\": " << params.f_ohg << "}," << endl;
+	out << "\t\"mode\": \"" << (mode == GaussianParamsCalculator::LIVE_FIT_RGB ? "rgb" : "spectral")
+		<< "\"," << endl;
+	out << "\t\"fittedComponents\": " << numFittedComponents << "," << endl;
+	out << "\t\"cached\": " << (cached ? "true" : "false") << "," << endl;
+	out << "\t\"aborted\": " << (aborted ? "true" : "false") << "," << endl;
+
+	out << "\t\"components\": [";
+	for (size_t sc = 0; sc < componentStats.size(); sc++) {
+		out << (sc ? "," : "") << endl << "\t\t{\"wavelength\": "
+			<< SampledSpectrum::WaveLength((uint32_t)sc) << ", ";
+		float error = sc < componentErrors.size() ? componentErrors[sc] : numeric_limits<float>::quiet_NaN();
+		writeFit(out, sigmas, error, componentStats[sc]);
+		out << "}";
+	}
+	out << (componentStats.empty() ? "" : "\n\t") << "]," << endl;
+
+	out << "\t\"channels\": [";
+	for (size_t ch = 0; ch < channelStats.size(); ch++) {
+		out << (ch ? "," : "") << endl << "\t\t{";
+		writeFit(out, sigmas, channelErrors[ch], channelStats[ch]);
+		out << "}";
+	}
+	out << (channelStats.empty() ? "" : "\n\t") << "]," << endl;
+
+	out << "\t\"reductionError\": [";
+	for (int ch = 0; ch < ProfileSpace::NUM_CHANNELS; ch++) {
+		out << (ch ? ", " : "");
+		writeNumber(out, reductionError[ch]);
+	}
+	out << "]," << endl;
+
+	FitStats total;
+	addStats(componentStats, total);
+	addStats(channelStats, total);
+	out << "\t\"profileSamples\": " << total.profileSamples << "," << endl;
+	out << "\t\"taskMs\": {\"profile\": ";
+	writeMilliseconds(out, total.profileTime);
+	out << ", \"resample\": ";
+	writeMilliseconds(out, total.resampleTime);
+	out << ", \"fit\": ";
+	writeMilliseconds(out, total.fitTime);
+	out << "}," << endl;
+	out << "\t\"wallMs\": {\"coarse\": ";
+	writeMilliseconds(out, coarseTime);
+	out << ", \"full\": ";
+	writeMilliseconds(out, fullTime);
+	out << ", \"reduce\": ";
+	writeMilliseconds(out, reduceTime);
+	out << ", \"total\": ";
+	writeMilliseconds(out, totalTime);
+	out << "}" << endl;
+	out << "}" << endl;
+
+	out.precision(precision);
+}
@@ -0,0 +1,80 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Quality and cost of a live fit
+ */
+
+#pragma once
+
+#include "GaussianParams.h"
+#include "ProfileFit/GaussianFitTask.h"
+#include <chrono>
+#include <ostream>
+#include <vector>
+
+namespace Skin {
+	// Filled in by a live fit as it goes, see GaussianParamsCalculator::GaussianFuture
+	struct LiveFitReport {
+		LiveFitReport(const VariableParams& vps, GaussianParamsCalculator::LiveFitMode mode,
+			int numFittedComponents);
+
+		VariableParams params;
+		GaussianParamsCalculator::LiveFitMode mode;
+		int numFittedComponents;
+		// Taken from the live fit cache, nothing below is filled in
+		bool cached;
+		// Aborted fits stop after the pass that noticed it
+		bool aborted;
+
+		// Fits of the full pass, indexed by the sigma windows of the stats
+		std::vector<float> sigmas;
+		// Per spectral component. The RGB mode only computes their profiles, so the errors
+		// and windows are those of the channels instead.
+		std::vector<float> componentErrors;
+		std::vector<ProfileFit::FitStats> componentStats;
+		std::vector<float> channelErrors;
+		std::vector<ProfileFit::FitStats> channelStats;
+		// Relative L2 error of the NUM_GAUSSIANS kept against all of the fitted sigmas,
+		// per channel over the whole plane
+		float reductionError[ProfileSpace::NUM_CHANNELS];
+
+		// Wall time of each pass
+		std::chrono::nanoseconds coarseTime;
+		std::chrono::nanoseconds fullTime;
+		std::chrono::nanoseconds reduceTime;
+		std::chrono::nanoseconds totalTime;
+
+		// One JSON object; stage times of the tasks are summed over the tasks, which run
+		// in parallel, and all times are in milliseconds
+		void writeJSON(std::ostream& out) const;
+	};
+} // namespace Skin
@@ -372,7 +372,7 @@ void CMainWindow::initSSSDialog() {
 	int tmp;
 	CDXUTStatic* lblTmp;
 	DBG_UNREFERENCED_LOCAL_VARIABLE(lblTmp);
-	m_pdlgSSS->AddStatic(CID_SSS_LBL_CAPTION, _T("Subsurface Scattering"), 6, tmp = height - 246, 200, 20);
+	m_pdlgSSS->AddStatic(CID_SSS_LBL_CAPTION, _T("Subsurface Scattering"), 6, tmp = height - 266, 200, 20);
 	m_pdlgSSS->AddCheckBox(CID_SSS_CHK_ENABLE_SSS, _T("Enable (S)SS"), 6, tmp += 20, 200, 20, m_pRenderer->getSSS(), 0, false, &m_pchkEnableSSS);
 	m_pdlgSSS->AddCheckBox(CID_SSS_CHK_ADAPTIVE_GAUSSIAN, _T("A(d)aptive Blurring"), 6, tmp += 20, 200, 20, m_pRenderer->getAdaptiveGaussian(), 0, false, &m_pchkAdaptiveGaussian);
 	m_pdlgSSS->AddStatic(CID_SSS_LBL_SSS_STRENGTH_LABEL, _T("SSS Strength: "), 6, tmp += 20, 200, 20);
@@ -399,6 +399,7 @@ void CMainWindow::initSSSDialog() {
 	m_pdlgSSS->AddStatic(CID_SSS_LBL_ROUGHNESS, _T("0.30"), 180, tmp, 60, 20, false, &m_plblSSSRoughness);
 
 	m_pdlgSSS->AddCheckBox(CID_SSS_CHK_USELIVEFIT, _T("Compute live fit Sum of Gaussians"), 6, tmp += 20, 200, 20, m_pRenderer->getUseLiveFit(), 0, false, &m_pchkSSSUseLiveFit);
+	m_pdlgSSS->AddCheckBox(CID_SSS_CHK_REFINE_WITH_LIVEFIT, _T("Refine table with live fits"), 6, tmp += 20, 200, 20, m_pRenderer->getRefineWithLiveFit(), 0, false, &m_pchkSSSRefineWithLiveFit);
 	m_pdlgSSS->AddStatic(CID_SSS_LBL_PROGRESS_LABEL, _T("Live fit progress: "), 6, tmp += 20, 120, 20);
 	m_pdlgSSS->AddStatic(CID_SSS_LBL_PROGRESS, _T("  0%"), 150, tmp, 60, 20, false, &m_plblSSSProgress);
 
@@ -409,6 +410,7 @@ void CMainWindow::initSSSDialog() {
 	registerEventHandler(CID_SSS_SLD_SSS_STRENGTH, &CMainWindow::sldSSSStrength_Handler);
 	registerEventHandler(CID_SSS_SLD_ROUGHNESS, &CMainWindow::sldSSSRoughness_Handler);
 	registerEventHandler(CID_SSS_CHK_USELIVEFIT, &CMainWindow::chkSSSUseLiveFit_Handler);
+	registerEventHandler(CID_SSS_CHK_REFINE_WITH_LIVEFIT, &CMainWindow::chkSSSRefineWithLiveFit_Handler);
 }
 
 void CMainWindow::initUIDialogs() {
@@ -506,6 +508,7 @@ void CMainWindow::updateUI() {
 	m_psldSSS_f_blood->SetEnabled(m_pchkEnableSSS->GetChecked());
 	m_psldSSS_f_ohg->SetEnabled(m_pchkEnableSSS->GetChecked());
 	m_pchkSSSUseLiveFit->SetChecked(m_pRenderer->getUseLiveFit());
+	m_pchkSSSRefineWithLiveFit->SetChecked(m_pRenderer->getRefineWithLiveFit());
 	{
 		TStringStream tss;
 		tss << std::setiosflags(std::ios::fixed) << std::setprecision(0) << std::setw(4)
@@ -662,6 +665,12 @@ void CMainWindow::doPerf() {
 	double milliseconds = m_pRenderer->perfMilliseconds();
 	TStringStream tss;
 	tss << "Time per intepolation: " << milliseconds << "ms";
+	tss << std::endl << std::endl << "Dense f_mel / f_blood axes (uniform, non-uniform):";
+	for (const GaussianParamsCalculator::PerfSample& sample : m_pRenderer->perfByResolution()) {
+		tss << std::endl << sample.resolution << " points: "
+			<< sample.uniform.count() / 1000000. << "ms, "
+			<< sample.nonUniform.count() / 1000000. << "ms";
+	}
 	MessageBox(tss.str().c_str(), _T("Performance Test"), MB_OK);
 }
 
@@ -823,6 +832,11 @@ void CALLBACK CMainWindow::chkSSSUseLiveFit_Handler(CDXUTControl* sender, UINT n
 }
 
 
+void CALLBACK CMainWindow::chkSSSRefineWithLiveFit_Handler(CDXUTControl* sender, UINT nEvent) {
+	m_pRenderer->setRefineWithLiveFit(m_pchkSSSRefineWithLiveFit->GetChecked());
+}
+
+
 BOOL CMainWindow::PreTranslateMessage(MSG* pMsg) {
 	if (m_bChangingView || m_bChangingLight)
 		return FALSE;
@@ -897,6 +911,10 @@ afx_msg void CMainWindow::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags) {
 		if (GetKeyState(VK_CONTROL) && GetKeyState(VK_MENU) && GetKeyState(VK_SHIFT))
 			doPerf();
 		break;
+	case 'R':
+		if (GetKeyState(VK_CONTROL) && GetKeyState(VK_MENU) && GetKeyState(VK_SHIFT))
+			m_pRenderer->dumpLiveFitReport(_T("LiveFitReport.json"));
+		break;
 	}
 }
 
@@ -177,6 +177,7 @@ namespace Skin {
 		static const UINT CID_SSS_CHK_USELIVEFIT = 221;
 		static const UINT CID_SSS_LBL_PROGRESS_LABEL = 222;
 		static const UINT CID_SSS_LBL_PROGRESS = 223;
+		static const UINT CID_SSS_CHK_REFINE_WITH_LIVEFIT = 224;
 
 		// Info dialog
 		CDXUTStatic* m_plblScreenSize;
@@ -211,6 +212,7 @@ namespace Skin {
 		CDXUTSlider* m_psldSSSRoughness;
 		CDXUTStatic* m_plblSSSRoughness;
 		CDXUTCheckBox* m_pchkSSSUseLiveFit;
+		CDXUTCheckBox* m_pchkSSSRefineWithLiveFit;
 		CDXUTStatic* m_plblSSSProgress;
 
 		// UI Controls Message Mapping
@@ -246,6 +248,7 @@ namespace Skin {
 		DeclareHandlerForParam(ohg);
 		void CALLBACK sldSSSRoughness_Handler(CDXUTControl* sender, UINT nEvent);
 		void CALLBACK chkSSSUseLiveFit_Handler(CDXUTControl* sender, UINT nEvent);
+		void CALLBACK chkSSSRefineWithLiveFit_Handler(CDXUTControl* sender, UINT nEvent);
 
 		// Message mapping
 		BOOL PreTranslateMessage(MSG* pMsg);
@@ -52,7 +52,7 @@ public:
 	}
 	void abortWait() {
 		abort();
-		wait();
+		Base::wait();
 	}
 	double progress() {
 		return progressHandle();
@@ -68,4 +68,29 @@ private:
 	ProgressHandle progressHandle;
 };
 
+// An AbortableFuture that publishes intermediate results before the final one
+template <class T, class AbortHandle, class ProgressHandle, class IntermediateHandle>
+class ProgressiveFuture : public AbortableFuture<T, AbortHandle, ProgressHandle> {
+public:
+	typedef AbortableFuture<T, AbortHandle, ProgressHandle> Base;
+	ProgressiveFuture(std::future<T>&& base, AbortHandle handle, ProgressHandle progHandle,
+		IntermediateHandle interHandle)
+		: Base(std::move(base), handle, progHandle)
+	{
+		intermediateHandle = interHandle;
+	}
+
+	// Moves the latest intermediate result not taken yet into out, if any
+	bool takeIntermediate(T& out) {
+		return intermediateHandle(out);
+	}
+	ProgressiveFuture(ProgressiveFuture&& other)
+		: Base(std::move(other))
+	{
+		intermediateHandle = std::move(other.intermediateHandle);
+	}
+private:
+	IntermediateHandle intermediateHandle;
+};
+
 }
@@ -34,138 +34,68 @@
 #include "stdafx.h"
 
 #include "parallel.h"
-#include "memory.h"
-#ifdef PBRT_USE_GRAND_CENTRAL_DISPATCH
-#include <dispatch/dispatch.h>
-#endif // PBRT_USE_GRAND_CENTRAL_DISPATCH
-#if !defined(PBRT_IS_WINDOWS)
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/param.h>
-#include <sys/sysctl.h>
-#include <errno.h>
-#endif 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <list>
+#include <thread>
 
 namespace Parallel {
 
-// Parallel Local Declarations
-static
-#if defined(PBRT_IS_WINDOWS)
-DWORD WINAPI taskEntry(LPVOID arg);
-#else
-void *taskEntry(void *arg);
-#endif
-
 // Parallel Definitions
-#if !defined(PBRT_IS_WINDOWS)
-
 Mutex *Mutex::Create() {
-    int sz = sizeof(Mutex);
-    sz = (sz + (PBRT_L1_CACHE_LINE_SIZE-1)) & ~(PBRT_L1_CACHE_LINE_SIZE-1);
-    return new (AllocAligned(sz)) Mutex;
+    return new Mutex;
 }
 
 
 
 void Mutex::Destroy(Mutex *m) {
-    m->~Mutex();
-    FreeAligned(m);
+    delete m;
 }
 
 
 
 Mutex::Mutex() {
-    int err;
-    if ((err = pthread_mutex_init(&mutex, NULL)) != 0)
-        Severe("Error from pthread_mutex_init: %s", strerror(err));
 }
 
 
 
 Mutex::~Mutex() {
-    int err;
-    if ((err = pthread_mutex_destroy(&mutex)) != 0)
-        Severe("Error from pthread_mutex_destroy: %s", strerror(err));
-}
-
-
-
-
-MutexLock::MutexLock(Mutex &m) : mutex(m) {
-    int err;
-    if ((err = pthread_mutex_lock(&m.mutex)) != 0)
-        Severe("Error from pthread_mutex_lock: %s", strerror(err));
 }
 
 
 
-MutexLock::~MutexLock() {
-    int err;
-    if ((err = pthread_mutex_unlock(&mutex.mutex)) != 0)
-        Severe("Error from pthread_mutex_unlock: %s", strerror(err));
-}
-
-
-
-
 RWMutex *RWMutex::Create() {
-    int sz = sizeof(RWMutex);
-    sz = (sz + (PBRT_L1_CACHE_LINE_SIZE-1)) & ~(PBRT_L1_CACHE_LINE_SIZE-1);
-    return new (AllocAligned(sz)) RWMutex;
+    return new RWMutex;
 }
 
 
 
 void RWMutex::Destroy(RWMutex *m) {
-    m->~RWMutex();
-    FreeAligned(m);
-}
-
-
-
-RWMutex::RWMutex() {
-    int err;
-    if ((err = pthread_rwlock_init(&mutex, NULL)) != 0)
-        Severe("Error from pthread_rwlock_init: %s", strerror(err));
-}
-
-
-
-RWMutex::~RWMutex() {
-    int err;
-    if ((err = pthread_rwlock_destroy(&mutex)) != 0)
-        Severe("Error from pthread_rwlock_destroy: %s", strerror(err));
+    delete m;
 }
 
 
 
-
-RWMutexLock::RWMutexLock(RWMutex &m, RWMutexLockType t) : type(t), mutex(m) {
-    int err;
-    if (t == READ) err = pthread_rwlock_rdlock(&m.mutex);
-    else           err = pthread_rwlock_wrlock(&m.mutex);
+RWMutexLock::RWMutexLock(RWMutex &m, RWMutexLockType t)
+    : type(t), mutex(m) {
+    if (type == READ) mutex.AcquireRead();
+    else              mutex.AcquireWrite();
 }
 
 
 
 RWMutexLock::~RWMutexLock() {
-    int err;
-    if ((err = pthread_rwlock_unlock(&mutex.mutex)) != 0)
-       Severe("Error from pthread_rwlock_unlock: %s", strerror(err));
+    if (type == READ) mutex.ReleaseRead();
+    else              mutex.ReleaseWrite();
 }
 
 
 
 void RWMutexLock::UpgradeToWrite() {
     Assert(type == READ);
-    int err;
-    if ((err = pthread_rwlock_unlock(&mutex.mutex)) != 0)
-        Severe("Error from pthread_rwlock_unlock: %s", strerror(err));
-    if ((err = pthread_rwlock_wrlock(&mutex.mutex)) != 0)
-        Severe("Error from pthread_rwlock_wrlock: %s", strerror(err));
+    mutex.ReleaseRead();
+    mutex.AcquireWrite();
     type = WRITE;
 }
 
@@ -173,600 +103,545 @@ void RWMutexLock::UpgradeToWrite() {
 
 void RWMutexLock::DowngradeToRead() {
     Assert(type == WRITE);
-    int err;
-    if ((err = pthread_rwlock_unlock(&mutex.mutex)) != 0)
-        Severe("Error from pthread_rwlock_unlock: %s", strerror(err));
-    if ((err = pthread_rwlock_rdlock(&mutex.mutex)) != 0)
-        Severe("Error from pthread_rwlock_rdlock: %s", strerror(err));
+    mutex.ReleaseWrite();
+    mutex.AcquireRead();
     type = READ;
 }
 
 
-#endif // !PBRT_IS_WINDOWS
 #if defined(PBRT_IS_WINDOWS)
 
-Mutex *Mutex::Create() {
-    return new Mutex;
+// Slim reader/writer locks, taking an uncontended one is a single atomic operation
+RWMutex::RWMutex() {
+    InitializeSRWLock(&lock);
 }
 
 
 
-void Mutex::Destroy(Mutex *m) {
-    delete m;
+RWMutex::~RWMutex() {
 }
 
 
 
-Mutex::Mutex() {
-    InitializeCriticalSectionAndSpinCount(&criticalSection, 4096);
+void RWMutex::AcquireRead() {
+    AcquireSRWLockShared(&lock);
 }
 
 
 
-Mutex::~Mutex() {
-    DeleteCriticalSection(&criticalSection);
+void RWMutex::ReleaseRead() {
+    ReleaseSRWLockShared(&lock);
 }
 
 
 
-MutexLock::MutexLock(Mutex &m) : mutex(m) {
-    EnterCriticalSection(&mutex.criticalSection);
+void RWMutex::AcquireWrite() {
+    AcquireSRWLockExclusive(&lock);
 }
 
 
 
-MutexLock::~MutexLock() {
-    LeaveCriticalSection(&mutex.criticalSection);
+void RWMutex::ReleaseWrite() {
+    ReleaseSRWLockExclusive(&lock);
 }
 
 
+#else
 
-RWMutex *RWMutex::Create() {
-    return new RWMutex;
+RWMutex::RWMutex() {
+    int err;
+    if ((err = pthread_rwlock_init(&mutex, NULL)) != 0)
+        Severe("Error from pthread_rwlock_init: %s", strerror(err));
 }
 
 
 
-void RWMutex::Destroy(RWMutex *m) {
-    delete m;
+RWMutex::~RWMutex() {
+    int err;
+    if ((err = pthread_rwlock_destroy(&mutex)) != 0)
+        Severe("Error from pthread_rwlock_destroy: %s", strerror(err));
 }
 
 
 
-// vista has 'slim reader/writer (SRW)' locks... sigh.
-
-RWMutex::RWMutex() {
-    numWritersWaiting = numReadersWaiting = activeWriterReaders = 0;
-    InitializeCriticalSectionAndSpinCount(&cs, 4096);
-
-    hReadyToRead = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if (hReadyToRead == NULL) {
-        Severe("Error creating event for RWMutex: %d", GetLastError());
-    }
-
-    hReadyToWrite = CreateSemaphore(NULL, 0, 1, NULL);
-    if (hReadyToWrite == NULL) {
-        DWORD lastError = GetLastError();
-        CloseHandle(hReadyToRead);
-        Severe("Error creating semaphore for RWMutex: %d", lastError);
-    }
+void RWMutex::AcquireRead() {
+    int err;
+    if ((err = pthread_rwlock_rdlock(&mutex)) != 0)
+        Severe("Error from pthread_rwlock_rdlock: %s", strerror(err));
 }
 
 
 
-RWMutex::~RWMutex() {
-    if (hReadyToRead)
-        CloseHandle(hReadyToRead);
-    if (hReadyToWrite != NULL)
-        CloseHandle(hReadyToWrite);
-    DeleteCriticalSection(&cs);
+void RWMutex::ReleaseRead() {
+    int err;
+    if ((err = pthread_rwlock_unlock(&mutex)) != 0)
+        Severe("Error from pthread_rwlock_unlock: %s", strerror(err));
 }
 
 
 
-
-RWMutexLock::RWMutexLock(RWMutex &m, RWMutexLockType t)
-    : type(t), mutex(m) {
-    if (type == READ) mutex.AcquireRead();
-    else              mutex.AcquireWrite();
+void RWMutex::AcquireWrite() {
+    int err;
+    if ((err = pthread_rwlock_wrlock(&mutex)) != 0)
+        Severe("Error from pthread_rwlock_wrlock: %s", strerror(err));
 }
 
 
 
-void
-RWMutex::AcquireRead() {
-    bool fNotifyReaders = false;
-
-    EnterCriticalSection(&cs);
-
-    if ((numWritersWaiting > 0) || (HIWORD(activeWriterReaders) > 0)) {
-        ++numReadersWaiting;
-
-        while (true) {
-            ResetEvent(hReadyToRead);
-            LeaveCriticalSection(&cs);
-            WaitForSingleObject(hReadyToRead, INFINITE);
-            EnterCriticalSection(&cs);
-
-            // The reader is only allowed to read if there aren't
-            // any writers waiting and if a writer doesn't own the
-            // lock.
-            if ((numWritersWaiting == 0) && (HIWORD(activeWriterReaders) == 0))
-                break;
-        }
+void RWMutex::ReleaseWrite() {
+    ReleaseRead();
+}
 
-        // Reader is done waiting.
-        --numReadersWaiting;
 
-        // Reader can read.
-        ++activeWriterReaders;
-    }
-    else {
-        // Reader can read.
-        if ((++activeWriterReaders == 1) && (numReadersWaiting != 0)) {
-            // Set flag to notify other waiting readers
-            // outside of the critical section
-            // so that they don't when the threads
-            // are dispatched by the scheduler they
-            // don't immediately block on the critical
-            // section that this thread is holding.
-            fNotifyReaders = true;
-        }
-    }
+#endif // PBRT_IS_WINDOWS
 
-    Assert(HIWORD(activeWriterReaders) == 0);
-    LeaveCriticalSection(&cs);
 
-    if (fNotifyReaders)
-        SetEvent(hReadyToRead);
+Semaphore::Semaphore() : count(0) {
 }
 
 
 
+Semaphore::~Semaphore() {
+}
 
-void
-RWMutex::AcquireWrite() {
-    EnterCriticalSection(&cs);
-
-    // Are there active readers?
-    if (activeWriterReaders != 0) {
-        ++numWritersWaiting;
-
-        LeaveCriticalSection(&cs);
-        WaitForSingleObject(hReadyToWrite, INFINITE);
-
-        // Upon wakeup theirs no need for the writer
-        // to acquire the critical section.  It
-        // already has been transfered ownership of the
-        // lock by the signaler.
-    }
-    else {
-        Assert(activeWriterReaders == 0);
 
-        // Set that the writer owns the lock.
-        activeWriterReaders = MAKELONG(0, 1);
 
-        LeaveCriticalSection(&cs);
+void Semaphore::Post(int n) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        count += n;
     }
+    if (n == 1) cond.notify_one();
+    else        cond.notify_all();
 }
 
 
 
-void
-RWMutex::ReleaseRead() {
-    EnterCriticalSection(&cs);
-
-    // Assert that the lock isn't held by a writer.
-    Assert(HIWORD(activeWriterReaders) == 0);
-
-    // Assert that the lock is held by readers.
-    Assert(LOWORD(activeWriterReaders > 0));
-
-    // Decrement the number of active readers.
-    if (--activeWriterReaders == 0)
-        ResetEvent(hReadyToRead);
-
-    // if writers are waiting and this is the last reader
-    // hand owneership over to a writer.
-    if ((numWritersWaiting != 0) && (activeWriterReaders == 0)) {
-        // Decrement the number of waiting writers
-        --numWritersWaiting;
-
-        // Pass ownership to a writer thread.
-        activeWriterReaders = MAKELONG(0, 1);
-        ReleaseSemaphore(hReadyToWrite, 1, NULL);
-    }
-
-    LeaveCriticalSection(&cs);
+void Semaphore::Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (count == 0)
+        cond.wait(lock);
+    --count;
 }
 
 
 
-void
-RWMutex::ReleaseWrite() {
-    bool fNotifyWriter = false;
-    bool fNotifyReaders = false;
+bool Semaphore::TryWait() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (count == 0)
+        return false;
+    --count;
+    return true;
+}
 
-    EnterCriticalSection(&cs);
 
-    // Assert that the lock is owned by a writer.
-    Assert(HIWORD(activeWriterReaders) == 1);
 
-    // Assert that the lock isn't owned by one or more readers
-    Assert(LOWORD(activeWriterReaders) == 0);
+ConditionVariable::ConditionVariable() {
+}
 
-    if (numWritersWaiting != 0) {
-        // Writers waiting, decrement the number of
-        // waiting writers and release the semaphore
-        // which means ownership is passed to the thread
-        // that has been released.
-        --numWritersWaiting;
-        fNotifyWriter = true;
-    }
-    else {
-        // There aren't any writers waiting
-        // Release the exclusive hold on the lock.
-        activeWriterReaders = 0;
-
-        // if readers are waiting set the flag
-        // that will cause the readers to be notified
-        // once the critical section is released.  This
-        // is done so that an awakened reader won't immediately
-        // block on the critical section which is still being
-        // held by this thread.
-        if (numReadersWaiting != 0)
-            fNotifyReaders = true;
-    }
 
-    LeaveCriticalSection(&cs);
 
-    if (fNotifyWriter)
-        ReleaseSemaphore(hReadyToWrite, 1, NULL);
-    else if (fNotifyReaders)
-        SetEvent(hReadyToRead);
+ConditionVariable::~ConditionVariable() {
 }
 
 
 
-RWMutexLock::~RWMutexLock() {
-    if (type == READ) mutex.ReleaseRead();
-    else              mutex.ReleaseWrite();
+void ConditionVariable::Lock() {
+    mutex.lock();
 }
 
 
 
-void RWMutexLock::UpgradeToWrite() {
-    Assert(type == READ);
-    mutex.ReleaseRead();
-    mutex.AcquireWrite();
-    type = WRITE;
+void ConditionVariable::Unlock() {
+    mutex.unlock();
 }
 
 
 
-void RWMutexLock::DowngradeToRead() {
-    Assert(type == WRITE);
-    mutex.ReleaseWrite();
-    mutex.AcquireRead();
-    type = READ;
+void ConditionVariable::Wait() {
+    // The caller holds the lock and keeps it afterwards
+    std::unique_lock<std::mutex> lock(mutex, std::adopt_lock);
+    cond.wait(lock);
+    lock.release();
 }
 
 
-#endif 
-#if !defined(PBRT_IS_WINDOWS)
-Semaphore::Semaphore() {
-#ifdef PBRT_IS_OPENBSD
-    sem = (sem_t *)malloc(sizeof(sem_t));
-    if (!sem)
-        Severe("Error from sem_open");
-    int err = sem_init(sem, 0, 0);
-    if (err == -1)
-        Severe("Error from sem_init: %s", strerror(err));
-#else
-    char name[32];
-    sprintf(name, "pbrt.%d-%d", (int)getpid(), count++);
-    sem = sem_open(name, O_CREAT, S_IRUSR|S_IWUSR, 0);
-    if (!sem)
-        Severe("Error from sem_open: %s", strerror(errno));
-#endif // !PBRT_IS_OPENBSD
-}
-
 
-#endif // !PBRT_IS_WINDOWS
-#if defined(PBRT_IS_WINDOWS)
-Semaphore::Semaphore() {
-    handle = CreateSemaphore(NULL, 0, 16777215,  NULL);
-    if (!handle)
-        Severe("Error from CreateSemaphore: %d", GetLastError());
+void ConditionVariable::Signal() {
+    cond.notify_one();
 }
 
 
-#endif // PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-int Semaphore::count = 0;
-#endif // !PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-Semaphore::~Semaphore() {
-#ifdef PBRT_IS_OPENBSD
-    int err = sem_destroy(sem);
-    free((void *)sem);
-    sem = NULL;
-    if (err != 0)
-        Severe("Error from sem_destroy: %s", strerror(err));
-#else
-    int err;
-    if ((err = sem_close(sem)) != 0)
-        Severe("Error from sem_close: %s", strerror(err));
-#endif // !PBRT_IS_OPENBSD
-}
 
-
-#endif // !PBRT_IS_WINDOWS
-#if defined(PBRT_IS_WINDOWS)
-Semaphore::~Semaphore() {
-    CloseHandle(handle);
+void ConditionVariable::SignalAll() {
+    cond.notify_all();
 }
 
 
-#endif // PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-void Semaphore::Wait() {
-    int err;
-    if ((err = sem_wait(sem)) != 0)
-        Severe("Error from sem_wait: %s", strerror(err));
-}
+// Chase-Lev work stealing deque, see "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (Le et al. 2013). Only the owning worker pushes and pops
+// at the bottom, other workers steal from the top.
+class WorkStealingDeque {
+public:
+	WorkStealingDeque() : top(0), bottom(0) {
+		array = new Array(64);
+	}
+	~WorkStealingDeque() {
+		delete array.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < retired.size(); i++)
+			delete retired[i];
+	}
 
+	void Push(Task *task) {
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_acquire);
+		Array *a = array.load(std::memory_order_relaxed);
+		if (b - t > a->size - 1)
+			a = Grow(a, t, b);
+		a->Put(b, task);
+		bottom.store(b + 1, std::memory_order_release);
+	}
 
-#endif // !PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-bool Semaphore::TryWait() {
-    return (sem_trywait(sem) == 0);
-}
+	Task *Pop() {
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		Array *a = array.load(std::memory_order_relaxed);
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+		if (t > b) {
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return NULL;
+		}
+		Task *task = a->Get(b);
+		if (t == b) {
+			// The last task, race the thieves for it
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+				std::memory_order_relaxed))
+				task = NULL;
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return task;
+	}
 
+	// NULL when empty or when another thread took the task first
+	Task *Steal() {
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_acquire);
+		if (t >= b)
+			return NULL;
+		Array *a = array.load(std::memory_order_acquire);
+		Task *task = a->Get(t);
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+			std::memory_order_relaxed))
+			return NULL;
+		return task;
+	}
 
-#endif // !PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-void Semaphore::Post(int count) {
-    int err;
-    while (count-- > 0)
-        if ((err = sem_post(sem)) != 0)
-            Severe("Error from sem_post: %s", strerror(err));
-}
+private:
+	struct Array {
+		int64_t size;
+		std::atomic<Task*> *tasks;
 
+		explicit Array(int64_t size) : size(size) {
+			tasks = new std::atomic<Task*>[size];
+		}
+		~Array() {
+			delete[] tasks;
+		}
+		Task *Get(int64_t i) const {
+			return tasks[i & (size - 1)].load(std::memory_order_relaxed);
+		}
+		void Put(int64_t i, Task *task) {
+			tasks[i & (size - 1)].store(task, std::memory_order_relaxed);
+		}
+	};
+
+	Array *Grow(Array *a, int64_t t, int64_t b) {
+		Array *grown = new Array(a->size * 2);
+		for (int64_t i = t; i < b; i++)
+			grown->Put(i, a->Get(i));
+		array.store(grown, std::memory_order_release);
+		// Thieves may still read the old array
+		retired.push_back(a);
+		return grown;
+	}
 
-#endif // !PBRT_IS_WINDOWS
-#if defined(PBRT_IS_WINDOWS)
-void Semaphore::Wait() {
-    if (WaitForSingleObject(handle, INFINITE) == WAIT_FAILED)
-        Severe("Error from WaitForSingleObject: %d", GetLastError());
+	std::atomic<int64_t> top;
+	std::atomic<int64_t> bottom;
+	std::atomic<Array*> array;
+	vector<Array*> retired;
 
-}
+	WorkStealingDeque(const WorkStealingDeque &);
+	WorkStealingDeque &operator=(const WorkStealingDeque &);
+};
 
 
-#endif // PBRT_IS_WINDOWS
-#if defined(PBRT_IS_WINDOWS)
-bool Semaphore::TryWait() {
-    return (WaitForSingleObject(handle, 0L) == WAIT_OBJECT_0);
-}
+struct TaskQueue::Worker {
+	WorkStealingDeque tasks[NUM_TASK_PRIORITIES];
+	// Picks the victims to steal from
+	uint32_t rngState;
+	// Counts the turns of the weighted priorities
+	uint32_t turn;
+	// Keeps the workers on separate cache lines
+	char padding[64];
+};
 
 
-#endif // PBRT_IS_WINDOWS
 #if defined(PBRT_IS_WINDOWS)
-void Semaphore::Post(int count) {
-    if (!ReleaseSemaphore(handle, count, NULL))
-        Severe("Error from ReleaseSemaphore: %d", GetLastError());
-}
+#define PARALLEL_THREAD_LOCAL __declspec(thread)
+#else
+#define PARALLEL_THREAD_LOCAL __thread
+#endif
 
+// Index of the worker running on this thread, -1 on other threads
+static PARALLEL_THREAD_LOCAL int currentWorker = -1;
+// Queue of the task running on this thread
+static PARALLEL_THREAD_LOCAL TaskQueue *currentQueue = NULL;
 
-#endif // PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-ConditionVariable::ConditionVariable() {
-   int err;
-   if ((err = pthread_cond_init(&cond, NULL)) != 0)
-        Severe("Error from pthread_cond_init: %s", strerror(err));
-   if ((err = pthread_mutex_init(&mutex, NULL)) != 0)
-        Severe("Error from pthread_mutex_init: %s", strerror(err));
-}
+// Failed looks for a task, each followed by a yield, before a worker sleeps while
+// tasks are still queued or unfinished. Tasks being moved or taken by another worker
+// show up within a few; the ones that are running take milliseconds.
+static const int MAX_FAILED_FINDS = 64;
 
 
-#endif // !PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-ConditionVariable::~ConditionVariable() {
-    pthread_cond_destroy(&cond);
-    pthread_mutex_destroy(&mutex);
-}
+#if defined(PBRT_IS_WINDOWS)
+HANDLE* TaskQueue::threads = NULL;
+#else
+pthread_t* TaskQueue::threads = NULL;
+#endif
+std::atomic<TaskQueue::Worker**> TaskQueue::workers(NULL);
+std::atomic<int> TaskQueue::numWorkers(0);
+int TaskQueue::requestedNumWorkers = -1;
+bool TaskQueue::pinWorkers = false;
+std::atomic<bool> TaskQueue::strictPriorities(true);
+Mutex* TaskQueue::sharedTasksMutex = Mutex::Create();
+std::deque<Task*> TaskQueue::sharedTasks[NUM_TASK_PRIORITIES];
+std::atomic<int> TaskQueue::numQueuedTasks(0);
+std::atomic<int> TaskQueue::numQueuedByPriority[NUM_TASK_PRIORITIES];
+std::atomic<int> TaskQueue::numSleepingWorkers(0);
+std::atomic<uint32_t> TaskQueue::queueEpoch(0);
+std::atomic<int> TaskQueue::numStalledWorkers(0);
+ConditionVariable* TaskQueue::taskQueueCondition = new ConditionVariable;
+std::atomic<bool> TaskQueue::cleanup(false);
 
 
-#endif // !PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-void ConditionVariable::Lock() {
-    int err;
-    if ((err = pthread_mutex_lock(&mutex)) != 0)
-        Severe("Error from pthread_mutex_lock: %s", strerror(err));
+TaskQueue::TaskQueue() {
+	tasksRunningCondition = new ConditionVariable;
+	taskMutex = Mutex::Create();
+	numUnfinishedTasks = 0;
+	numTotalTasks = 0;
+	aborted = false;
+	priority = currentQueue ? currentQueue->priority : TASK_PRIORITY_NORMAL;
+	parent = NULL;
 }
 
 
-#endif // !PBRT_IS_WINDOWS
-#if !(defined(PBRT_IS_WINDOWS))
-void ConditionVariable::Unlock() {
-    int err;
-    if ((err = pthread_mutex_unlock(&mutex)) != 0)
-        Severe("Error from pthread_mutex_unlock: %s", strerror(err));
+TaskQueue::TaskQueue(TaskPriority priority) {
+	tasksRunningCondition = new ConditionVariable;
+	taskMutex = Mutex::Create();
+	numUnfinishedTasks = 0;
+	numTotalTasks = 0;
+	aborted = false;
+	this->priority = priority;
+	parent = NULL;
 }
 
 
-#endif // !PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-void ConditionVariable::Wait() {
-    int err;
-    if ((err = pthread_cond_wait(&cond, &mutex)) != 0)
-        Severe("Error from pthread_cond_wait: %s", strerror(err));
+TaskQueue::~TaskQueue() {
+	Mutex::Destroy(taskMutex);
+	delete tasksRunningCondition;
 }
 
 
-#endif // !PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-void ConditionVariable::Signal() {
-    int err;
-    if ((err = pthread_cond_signal(&cond)) != 0)
-        Severe("Error from pthread_cond_signal: %s", strerror(err));
-}
-
+void TaskQueue::SetNumWorkers(int n) {
+	taskQueueCondition->Lock();
+	requestedNumWorkers = std::max(n, 0);
+	bool running = workers.load() != NULL;
+	taskQueueCondition->Unlock();
 
-#endif // !PBRT_IS_WINDOWS
-#if !defined(PBRT_IS_WINDOWS)
-void ConditionVariable::SignalAll() {
-    int err;
-    if ((err = pthread_cond_broadcast(&cond)) != 0)
-        Severe("Error from pthread_cond_signal: %s", strerror(err));
+	// Started again with the new size by the next EnqueueTasks
+	if (running)
+		TasksCleanup();
 }
 
 
-#endif // !PBRT_IS_WINDOWS
-#if defined(PBRT_IS_WINDOWS)
-
-// http://www.cs.wustl.edu/\~schmidt/win32-cv-1.html
-
-ConditionVariable::ConditionVariable() {
-    waitersCount = 0;
-    InitializeCriticalSectionAndSpinCount(&waitersCountMutex, 4096);
-    InitializeCriticalSectionAndSpinCount(&conditionMutex, 4096);
-
-    events[SIGNAL] = CreateEvent (NULL,  // no security
-                               FALSE, // auto-reset event
-                               FALSE, // non-signaled initially
-                               NULL); // unnamed
-    events[BROADCAST] = CreateEvent (NULL,  // no security
-                                  TRUE,  // manual-reset
-                                  FALSE, // non-signaled initially
-                                  NULL); // unnamed
+int TaskQueue::NumWorkers() {
+	// A pool being stopped may have cleared the count already
+	if (workers.load(std::memory_order_acquire))
+		return std::max(numWorkers.load(std::memory_order_relaxed), 1);
 
+	taskQueueCondition->Lock();
+	int n = workers.load() ? numWorkers.load() : ConfiguredNumWorkers();
+	taskQueueCondition->Unlock();
+	return n;
 }
 
 
-#endif // PBRT_IS_WINDOWS
-#if defined(PBRT_IS_WINDOWS)
-ConditionVariable::~ConditionVariable() {
-    CloseHandle(events[SIGNAL]);
-    CloseHandle(events[BROADCAST]);
+void TaskQueue::SetPinWorkers(bool pin) {
+	taskQueueCondition->Lock();
+	pinWorkers = pin;
+	taskQueueCondition->Unlock();
 }
 
 
-#endif // PBRT_IS_WINDOWS
-#if defined(PBRT_IS_WINDOWS)
-void ConditionVariable::Lock() {
-    EnterCriticalSection(&conditionMutex);
+void TaskQueue::SetStrictPriorities(bool strict) {
+	strictPriorities = strict;
 }
 
 
-#endif // PBRT_IS_WINDOWS
+int TaskQueue::ConfiguredNumWorkers() {
+	int n = requestedNumWorkers;
+	if (n < 0) {
+		n = 0;
 #if defined(PBRT_IS_WINDOWS)
-void ConditionVariable::Unlock() {
-    LeaveCriticalSection(&conditionMutex);
+		char value[16];
+		DWORD length = GetEnvironmentVariableA("SKINPARAM_NUM_THREADS", value, sizeof(value));
+		if (length > 0 && length < sizeof(value))
+			n = std::max(atoi(value), 0);
+#else
+		if (const char* value = getenv("SKINPARAM_NUM_THREADS"))
+			n = std::max(atoi(value), 0);
+#endif
+	}
+	if (n == 0)
+		n = NumSystemCores();
+	return std::max(n, 1);
 }
 
 
-#endif // PBRT_IS_WINDOWS
-#if defined(PBRT_IS_WINDOWS)
-void ConditionVariable::Wait() {
-    // Avoid race conditions.
-    EnterCriticalSection(&waitersCountMutex);
-    waitersCount++;
-    LeaveCriticalSection(&waitersCountMutex);
-
-    // It's ok to release the <external_mutex> here since Win32
-    // manual-reset events maintain state when used with
-    // <SetEvent>.  This avoids the "lost wakeup" bug...
-    LeaveCriticalSection(&conditionMutex);
-
-    // Wait for either event to become signaled due to <pthread_cond_signal>
-    // being called or <pthread_cond_broadcast> being called.
-    int result = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+namespace {
 
-    EnterCriticalSection(&waitersCountMutex);
-    waitersCount--;
-    int last_waiter = (result == WAIT_OBJECT_0 + BROADCAST) &&
-        (waitersCount == 0);
-    LeaveCriticalSection(&waitersCountMutex);
+// Logical processors of a NUMA node, on Windows numbered within the processor group
+struct NumaNode {
+	int group;
+	vector<int> processors;
+};
 
-    // Some thread called <pthread_cond_broadcast>.
-    if (last_waiter)
-        // We're the last waiter to be notified or to stop waiting, so
-        // reset the manual event.
-        ResetEvent(events[BROADCAST]);
-
-    EnterCriticalSection(&conditionMutex);
-}
-
-
-#endif // PBRT_IS_WINDOWS
+vector<NumaNode> GetNumaNodes() {
+	vector<NumaNode> nodes;
 #if defined(PBRT_IS_WINDOWS)
-void ConditionVariable::Signal() {
-    EnterCriticalSection(&waitersCountMutex);
-    int haveWaiters = (waitersCount > 0);
-    LeaveCriticalSection(&waitersCountMutex);
-
-    if (haveWaiters)
-        SetEvent(events[SIGNAL]);
+	ULONG highestNode = 0;
+	if (GetNumaHighestNodeNumber(&highestNode)) {
+		for (ULONG n = 0; n <= highestNode; n++) {
+			GROUP_AFFINITY affinity;
+			if (!GetNumaNodeProcessorMaskEx((USHORT)n, &affinity) || !affinity.Mask)
+				continue;
+			NumaNode node;
+			node.group = affinity.Group;
+			for (int p = 0; p < (int)sizeof(KAFFINITY) * 8; p++) {
+				if (affinity.Mask & ((KAFFINITY)1 << p))
+					node.processors.push_back(p);
+			}
+			nodes.push_back(node);
+		}
+	}
+#elif defined(PBRT_IS_LINUX)
+	// cpulist holds ranges like "0-7,16-23"
+	for (int n = 0; ; n++) {
+		char path[64];
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", n);
+		FILE* f = fopen(path, "r");
+		if (!f)
+			break;
+		NumaNode node;
+		node.group = 0;
+		int first, last;
+		while (fscanf(f, "%d", &first) == 1) {
+			last = first;
+			int c = fgetc(f);
+			if (c == '-' && fscanf(f, "%d", &last) == 1)
+				c = fgetc(f);
+			for (int p = first; p <= last; p++)
+				node.processors.push_back(p);
+			if (c != ',')
+				break;
+		}
+		fclose(f);
+		if (!node.processors.empty())
+			nodes.push_back(node);
+	}
+#endif
+	if (nodes.empty()) {
+		NumaNode node;
+		node.group = 0;
+		for (int p = 0; p < NumSystemCores(); p++)
+			node.processors.push_back(p);
+		nodes.push_back(node);
+	}
+	return nodes;
 }
 
-
-#endif // PBRT_IS_WINDOWS
+// Restricts the thread to a processor of the node, or to the whole node when
+// processor is negative
+template <class Thread>
+void SetThreadAffinity(Thread thread, const NumaNode& node, int processor) {
 #if defined(PBRT_IS_WINDOWS)
-void ConditionVariable::SignalAll() {
-    EnterCriticalSection(&waitersCountMutex);
-    int haveWaiters = (waitersCount > 0);
-    LeaveCriticalSection(&waitersCountMutex);
-
-    if (haveWaiters)
-        SetEvent(events[BROADCAST]);
+	GROUP_AFFINITY affinity;
+	memset(&affinity, 0, sizeof(affinity));
+	affinity.Group = (WORD)node.group;
+	for (size_t i = 0; i < node.processors.size(); i++) {
+		if (processor < 0 || node.processors[i] == processor)
+			affinity.Mask |= (KAFFINITY)1 << node.processors[i];
+	}
+	if (!SetThreadGroupAffinity(thread, &affinity, NULL))
+		Error("Error from SetThreadGroupAffinity: %d", GetLastError());
+#elif defined(PBRT_IS_LINUX)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (size_t i = 0; i < node.processors.size(); i++) {
+		if (processor < 0 || node.processors[i] == processor)
+			CPU_SET(node.processors[i], &set);
+	}
+	int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (err != 0)
+		Error("Error from pthread_setaffinity_np: %s", strerror(err));
+#endif
 }
 
+} // namespace
 
-#endif // PBRT_IS_WINDOWS
 
+void TaskQueue::PlaceWorkers() {
+	// One node needs no placement unless pinned. On Windows this also spreads the
+	// workers over the processor groups, a thread only runs in its own group.
+	vector<NumaNode> nodes = GetNumaNodes();
+	if (nodes.size() < 2 && !pinWorkers)
+		return;
 
-#if defined(PBRT_IS_WINDOWS)
-HANDLE* TaskQueue::threads = NULL;
-#elif
-pthread_t* TaskQueue::threads = NULL;
-#endif 
-ConditionVariable* TaskQueue::taskQueueCondition = new ConditionVariable;
-std::deque<std::pair<Task*, TaskQueue*> > TaskQueue::taskQueue;
-bool TaskQueue::cleanup = false;
-
-
-TaskQueue::TaskQueue() {
-	tasksRunningCondition = new ConditionVariable;
-	taskMutex = Mutex::Create();
-	numUnfinishedTasks = 0;
-	numTotalTasks = 0;
-	aborted = false;
-}
-
-
-TaskQueue::~TaskQueue() {
-	Mutex::Destroy(taskMutex);
-	delete tasksRunningCondition;
+	vector<size_t> numPlaced(nodes.size(), 0);
+	for (int i = 0; i < numWorkers; ++i) {
+		size_t n = i % nodes.size();
+		const NumaNode& node = nodes[n];
+		int processor = -1;
+		if (pinWorkers)
+			processor = node.processors[numPlaced[n]++ % node.processors.size()];
+		SetThreadAffinity(threads[i], node, processor);
+	}
 }
 
 
-static const int NUM_CORES_CAP = 4;
-
-
 void TaskQueue::TasksInit() {
-	static const int nThreads = min(NumSystemCores(), NUM_CORES_CAP);
+	numWorkers = ConfiguredNumWorkers();
+	Worker **newWorkers = new Worker*[numWorkers];
+	for (int i = 0; i < numWorkers; ++i) {
+		newWorkers[i] = new Worker;
+		newWorkers[i]->rngState = 2654435761u * (i + 1);
+		newWorkers[i]->turn = 0;
+	}
+	// Published once filled, ScheduleTasks checks it without the lock. The
+	// threads started below see it through their creation.
+	workers.store(newWorkers, std::memory_order_release);
 #if !defined(PBRT_IS_WINDOWS)
-    threads = new pthread_t[nThreads];
-    for (int i = 0; i < nThreads; ++i) {
-        int err = pthread_create(&threads[i], NULL, &taskEntry, reinterpret_cast<void *>(
-			new std::pair<TaskQueue*, LPVOID>(this, reinterpret_cast<void *>(i))));
+    threads = new pthread_t[numWorkers];
+    for (int i = 0; i < numWorkers; ++i) {
+        int err = pthread_create(&threads[i], NULL, &taskEntry, reinterpret_cast<void *>(i));
         if (err != 0)
             Severe("Error from pthread_create: %s", strerror(err));
     }
 #else
-    threads = new HANDLE[nThreads];
-    for (int i = 0; i < nThreads; ++i) {
+    threads = new HANDLE[numWorkers];
+    for (int i = 0; i < numWorkers; ++i) {
 		CWinThread* pThread = AfxBeginThread(taskEntry, reinterpret_cast<void *>(i), THREAD_PRIORITY_IDLE,
 			CREATE_SUSPENDED);
 		threads[i] = NULL;
@@ -779,6 +654,7 @@ void TaskQueue::TasksInit() {
             Severe("Error from AfxBeginThread");
     }
 #endif // PBRT_IS_WINDOWS
+	PlaceWorkers();
 }
 
 
@@ -786,15 +662,15 @@ void TaskQueue::Cleanup() {
 	TasksCleanup();
 	delete taskQueueCondition;
 	taskQueueCondition = NULL;
+	Mutex::Destroy(sharedTasksMutex);
+	sharedTasksMutex = NULL;
 }
 
 
 void TaskQueue::TasksCleanup() {
 	taskQueueCondition->Lock();
-	taskQueue.clear();
-	
-    static const int nThreads = min(NumSystemCores(), NUM_CORES_CAP);
 
+	int nThreads = numWorkers;
 	decltype(threads) localThreads = NULL;
 
 	if (threads != NULL) {
@@ -818,12 +694,33 @@ void TaskQueue::TasksCleanup() {
 				Severe("Error from pthread_join: %s", strerror(err));
 		}
 #else
-		WaitForMultipleObjects(nThreads, localThreads, TRUE, INFINITE);
+		// At most MAXIMUM_WAIT_OBJECTS handles per wait
+		for (int i = 0; i < nThreads; i += MAXIMUM_WAIT_OBJECTS) {
+			WaitForMultipleObjects(std::min(nThreads - i, MAXIMUM_WAIT_OBJECTS), localThreads + i,
+				TRUE, INFINITE);
+		}
 		for (int i = 0; i < nThreads; ++i) {
 			CloseHandle(localThreads[i]);
 		}
 #endif // PBRT_IS_WINDOWS
 		free(localThreads);
+
+		// The tasks still queued are dropped
+		taskQueueCondition->Lock();
+		Worker **oldWorkers = workers.load(std::memory_order_relaxed);
+		workers.store(NULL, std::memory_order_release);
+		numWorkers = 0;
+		taskQueueCondition->Unlock();
+		for (int i = 0; i < nThreads; ++i)
+			delete oldWorkers[i];
+		delete[] oldWorkers;
+		MutexLock lock(*sharedTasksMutex);
+		for (int p = 0; p < NUM_TASK_PRIORITIES; p++) {
+			sharedTasks[p].clear();
+			numQueuedByPriority[p] = 0;
+		}
+		numQueuedTasks = 0;
+		cleanup = false;
 	}
 }
 
@@ -832,20 +729,40 @@ Task::~Task() {
 }
 
 
-void TaskQueue::EnqueueTasks(const vector<Task *> &tasks, TaskQueue* tq) {
-	taskQueueCondition->Lock();
-	if (!threads)
-        TasksInit();
+void TaskQueue::ScheduleTasks(const vector<Task *> &tasks, TaskPriority priority) {
+	if (tasks.empty())
+		return;
 
-	bool shouldSignal = taskQueue.size() == 0;
-	for (Task* task : tasks) {
-		taskQueue.push_back(std::make_pair(task, tq));
+	if (!workers.load(std::memory_order_acquire)) {
+		taskQueueCondition->Lock();
+		if (!workers.load(std::memory_order_relaxed))
+			TasksInit();
+		taskQueueCondition->Unlock();
 	}
 
-	taskQueueCondition->Unlock();
-
-	if (shouldSignal)
-		taskQueueCondition->SignalAll();
+	int worker = currentWorker;
+	if (worker >= 0) {
+		Worker *w = workers.load(std::memory_order_relaxed)[worker];
+		for (size_t i = 0; i < tasks.size(); i++)
+			w->tasks[priority].Push(tasks[i]);
+	} else {
+		MutexLock lock(*sharedTasksMutex);
+		sharedTasks[priority].insert(sharedTasks[priority].end(), tasks.begin(), tasks.end());
+	}
+	// Counted after queuing, so a worker that sees the count finds the tasks
+	numQueuedByPriority[priority] += (int)tasks.size();
+	numQueuedTasks += (int)tasks.size();
+	++queueEpoch;
+
+	if (numSleepingWorkers > 0) {
+		taskQueueCondition->Lock();
+		// A stalled worker may not take tasks of this priority, wake all then
+		if (tasks.size() == 1 && numStalledWorkers == 0)
+			taskQueueCondition->Signal();
+		else
+			taskQueueCondition->SignalAll();
+		taskQueueCondition->Unlock();
+	}
 }
 
 
@@ -854,50 +771,186 @@ void TaskQueue::EnqueueTasks(const vector<Task *> &tasks) {
 
 	if (aborted) return;
 
-    tasksRunningCondition->Lock();
-	numTotalTasks += tasks.size();
-    numUnfinishedTasks += tasks.size();
-    tasksRunningCondition->Unlock();
+	for (size_t i = 0; i < tasks.size(); i++)
+		tasks[i]->queue = this;
+	numTotalTasks += (int)tasks.size();
+	numUnfinishedTasks += (int)tasks.size();
 
+	ScheduleTasks(tasks, priority);
+}
+
+
+void TaskQueue::PriorityOrder(int worker, int *order) {
+	int first = 0;
+	if (!strictPriorities) {
+		// Of every 13 turns the interactive tasks go first in 8, the normal ones
+		// in 4 and the background ones in 1
+		static const int weights[NUM_TASK_PRIORITIES] = { 8, 4, 1 };
+		int turn = (int)(workers.load(std::memory_order_relaxed)[worker]->turn++ % 13);
+		while (turn >= weights[first])
+			turn -= weights[first++];
+	}
+	order[0] = first;
+	for (int p = 0, i = 1; p < NUM_TASK_PRIORITIES; p++) {
+		if (p != first)
+			order[i++] = p;
+	}
+}
+
+
+// Looks for a task in the priorities before priorityLimit in this turn's order
+Task *TaskQueue::FindTask(int worker, int priorityLimit) {
+	int order[NUM_TASK_PRIORITIES];
+	PriorityOrder(worker, order);
+	for (int i = 0; i < NUM_TASK_PRIORITIES && order[i] < priorityLimit; i++) {
+		int p = order[i];
+		if (numQueuedByPriority[p] <= 0)
+			continue;
+		Task *task = workers.load(std::memory_order_relaxed)[worker]->tasks[p].Pop();
+		if (!task)
+			task = TakeSharedTasks(worker, p);
+		if (!task)
+			task = StealTask(worker, p);
+		if (task) {
+			--numQueuedByPriority[p];
+			--numQueuedTasks;
+			return task;
+		}
+	}
+	return NULL;
+}
+
+
+Task *TaskQueue::TakeSharedTasks(int worker, int priority) {
+	MutexLock lock(*sharedTasksMutex);
+	std::deque<Task*> &shared = sharedTasks[priority];
+	if (shared.empty())
+		return NULL;
 
-	EnqueueTasks(tasks, this);
+	// Take a share of the tasks, so that the others take the lock less often.
+	// The rest of the share is stolen from the deque when this worker is busy.
+	size_t n = (size_t)numWorkers.load(std::memory_order_relaxed);
+	size_t share = (shared.size() + n - 1) / n;
+	Worker *w = workers.load(std::memory_order_relaxed)[worker];
+	for (size_t i = 1; i < share; i++) {
+		w->tasks[priority].Push(shared[share - i]);
+	}
+	Task *task = shared.front();
+	shared.erase(shared.begin(), shared.begin() + share);
+	return task;
+}
+
+
+Task *TaskQueue::StealTask(int worker, int priority) {
+	int n = numWorkers.load(std::memory_order_relaxed);
+	if (n < 2)
+		return NULL;
+
+	// Start from a random victim and try each once
+	// Only called on workers, which run while the array is published
+	Worker **all = workers.load(std::memory_order_relaxed);
+	uint32_t& rng = all[worker]->rngState;
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	int first = rng % (n - 1);
+	for (int i = 0; i < n - 1; i++) {
+		int victim = (worker + 1 + (first + i) % (n - 1)) % n;
+		if (Task *task = all[victim]->tasks[priority].Steal())
+			return task;
+	}
+	return NULL;
+}
+
+
+void TaskQueue::RunTask(Task *task) {
+	TaskQueue *tq = task->queue;
+	// Tasks run from YieldToHigherPriority or WaitForAllTasks interrupt another
+	TaskQueue *interrupted = currentQueue;
+	currentQueue = tq;
+	if (!tq->Aborted())
+		task->Run();
+	currentQueue = interrupted;
+	tq->TaskFinished();
+}
+
+
+void TaskQueue::TaskFinished() {
+	// Only the last task takes the lock, after which the queue may be destroyed
+	int unfinished = numUnfinishedTasks.load();
+	while (unfinished > 1 && !numUnfinishedTasks.compare_exchange_weak(unfinished, unfinished - 1))
+		;
+	if (unfinished <= 1) {
+		tasksRunningCondition->Lock();
+		if (--numUnfinishedTasks == 0)
+			tasksRunningCondition->SignalAll();
+		tasksRunningCondition->Unlock();
+	}
+	// Only the static members from here, the queue may be gone
+	QueueChanged();
+}
+
+
+void TaskQueue::QueueChanged() {
+	++queueEpoch;
+	if (numStalledWorkers > 0) {
+		taskQueueCondition->Lock();
+		taskQueueCondition->SignalAll();
+		taskQueueCondition->Unlock();
+	}
+}
+
+
+// Sleeps until a task is scheduled or finished after epoch was read. The stalled
+// count is raised before the epoch is checked and QueueChanged changes the epoch
+// before it reads the count, so one of them sees the other.
+void TaskQueue::WaitForChange(uint32_t epoch) {
+	taskQueueCondition->Lock();
+	++numSleepingWorkers;
+	++numStalledWorkers;
+	while (!cleanup && queueEpoch == epoch)
+		taskQueueCondition->Wait();
+	--numStalledWorkers;
+	--numSleepingWorkers;
+	taskQueueCondition->Unlock();
 }
 
 
 #if defined(PBRT_IS_WINDOWS)
 UINT TaskQueue::taskEntry(LPVOID arg) {
 #else
-void *taskEntry(void *arg) {
+void *TaskQueue::taskEntry(void *arg) {
 #endif
-    while (true) {
-        // Try to get task from task queue
-        Task *myTask = NULL;
-		TaskQueue* tq = NULL;
-        {
-			taskQueueCondition->Lock();
-			while (!cleanup && taskQueue.size() == 0)
-				taskQueueCondition->Wait();
-			if (cleanup) {
-				taskQueueCondition->Unlock();
-				break;
+	int worker = (int)reinterpret_cast<intptr_t>(arg);
+	currentWorker = worker;
+	int failedFinds = 0;
+	while (!cleanup) {
+		uint32_t epoch = queueEpoch;
+		Task *task = FindTask(worker, NUM_TASK_PRIORITIES);
+		if (task) {
+			RunTask(task);
+			failedFinds = 0;
+			continue;
+		}
+		if (numQueuedTasks > 0) {
+			// Being moved to a deque or taken by another worker
+			if (++failedFinds < MAX_FAILED_FINDS) {
+				std::this_thread::yield();
+			} else {
+				failedFinds = 0;
+				WaitForChange(epoch);
 			}
-			myTask = taskQueue.front().first;
-			tq = taskQueue.front().second;
-			taskQueue.pop_front();
-			taskQueueCondition->Unlock();
-        }
-
-        // Do work for _myTask_
-        myTask->Run();
-
-		// Optionally signal the waiting thread
-        tq->tasksRunningCondition->Lock();
-        int unfinished = --tq->numUnfinishedTasks;
-        tq->tasksRunningCondition->Unlock();
-
-        if (unfinished == 0)
-            tq->tasksRunningCondition->Signal();
-    }
+			continue;
+		}
+		failedFinds = 0;
+
+		taskQueueCondition->Lock();
+		++numSleepingWorkers;
+		while (!cleanup && numQueuedTasks <= 0)
+			taskQueueCondition->Wait();
+		--numSleepingWorkers;
+		taskQueueCondition->Unlock();
+	}
     // Cleanup from task thread and exit
 #if !defined(PBRT_IS_WINDOWS)
     pthread_exit(NULL);
@@ -907,6 +960,32 @@ void *taskEntry(void *arg) {
 
 
 void TaskQueue::WaitForAllTasks() {
+	int worker = currentWorker;
+	if (worker >= 0) {
+		// Blocking would take the worker from the pool, the tasks waited for may
+		// even be in its own deque. Lower priority tasks could hold up the return.
+		// Once the tasks left run elsewhere, it sleeps until one of them finishes or
+		// more tasks come.
+		int failedFinds = 0;
+		while (numUnfinishedTasks > 0) {
+			uint32_t epoch = queueEpoch;
+			if (Task *task = FindTask(worker, priority + 1)) {
+				RunTask(task);
+				failedFinds = 0;
+			} else if (++failedFinds < MAX_FAILED_FINDS) {
+				std::this_thread::yield();
+			} else {
+				failedFinds = 0;
+				if (numUnfinishedTasks > 0)
+					WaitForChange(epoch);
+			}
+		}
+		// The last task finishes under the lock, wait until it is released
+		tasksRunningCondition->Lock();
+		tasksRunningCondition->Unlock();
+		return;
+	}
+
     tasksRunningCondition->Lock();
     while (numUnfinishedTasks > 0)
         tasksRunningCondition->Wait();
@@ -917,32 +996,50 @@ void TaskQueue::WaitForAllTasks() {
 void TaskQueue::Abort() {
 	MutexLock lock(*taskMutex);
 
-	if (aborted) return;
+	// The workers skip the queued tasks, WaitForAllTasks returns once they are
+	// taken from the deques
 	aborted = true;
+}
 
-	taskQueueCondition->Lock();
-	auto removeIter = std::remove_if(taskQueue.begin(), taskQueue.end(), [this](const std::pair<Task*, TaskQueue*>& pair) {
-		return pair.second == this;
-	});
-	int numRemoved = taskQueue.end() - removeIter;
-	taskQueue.erase(removeIter, taskQueue.end());
-	taskQueueCondition->Unlock();
 
-    tasksRunningCondition->Lock();
-    int unfinished = (numUnfinishedTasks -= numRemoved);
-    tasksRunningCondition->Unlock();
+bool TaskQueue::Aborted() const {
+	for (const TaskQueue *tq = this; tq; tq = tq->parent) {
+		if (tq->aborted)
+			return true;
+	}
+	return false;
+}
 
-	if (unfinished == 0)
-		tasksRunningCondition->Signal();
+
+TaskQueue *TaskQueue::Current() {
+	return currentQueue;
+}
+
+
+void TaskQueue::YieldToHigherPriority() {
+	int worker = currentWorker;
+	TaskQueue *running = currentQueue;
+	if (worker < 0 || !running)
+		return;
+
+	for (;;) {
+		bool waiting = false;
+		for (int p = 0; p < running->priority; p++)
+			waiting = waiting || numQueuedByPriority[p] > 0;
+		if (!waiting)
+			return;
+		// With weighted priorities the turn may be the running task's
+		Task *task = FindTask(worker, running->priority);
+		if (!task)
+			return;
+		RunTask(task);
+	}
 }
 
 
 double TaskQueue::Progress() {
-	int total, unfinished;
-    tasksRunningCondition->Lock();
-	total = numTotalTasks;
-	unfinished = numUnfinishedTasks;
-	tasksRunningCondition->Unlock();
+	int total = numTotalTasks;
+	int unfinished = numUnfinishedTasks;
 
 	if (total == 0)
 		return 0.;
@@ -950,36 +1047,80 @@ double TaskQueue::Progress() {
 }
 
 
+namespace {
+
+// Runs chunks of a loop until none is left
+class ChunkTask : public Task {
+public:
+	ChunkTask() : nextChunk(NULL), numChunks(0), loop(NULL) { }
+	void Set(std::atomic<int64_t> *next, int64_t n, const ChunkedLoop *l) {
+		nextChunk = next;
+		numChunks = n;
+		loop = l;
+	}
+	void Run() {
+		RunChunks(*nextChunk, numChunks, *loop, TaskQueue::Current());
+	}
+	// Stops early when the queue is aborted
+	static void RunChunks(std::atomic<int64_t> &nextChunk, int64_t numChunks,
+		const ChunkedLoop &loop, const TaskQueue *queue) {
+		for (int64_t chunk = nextChunk++; chunk < numChunks; chunk = nextChunk++) {
+			if (queue && queue->Aborted())
+				break;
+			loop.RunChunk(chunk);
+			TaskQueue::YieldToHigherPriority();
+		}
+	}
+private:
+	std::atomic<int64_t> *nextChunk;
+	int64_t numChunks;
+	const ChunkedLoop *loop;
+};
+
+} // namespace
+
+
+void RunChunkedLoop(int64_t numChunks, const ChunkedLoop &loop) {
+	std::atomic<int64_t> nextChunk(0);
+	TaskQueue *outer = TaskQueue::Current();
+	// The calling thread takes chunks too, so it counts as one of the workers
+	int numTasks = (int)std::min(numChunks, (int64_t)TaskQueue::NumWorkers()) - 1;
+	if (numTasks <= 0) {
+		ChunkTask::RunChunks(nextChunk, numChunks, loop, outer);
+		return;
+	}
+
+	vector<ChunkTask> tasks(numTasks);
+	vector<Task *> taskPtrs(numTasks);
+	for (int i = 0; i < numTasks; i++) {
+		tasks[i].Set(&nextChunk, numChunks, &loop);
+		taskPtrs[i] = &tasks[i];
+	}
+	// Has the priority of the outer task and is aborted with it
+	TaskQueue queue;
+	queue.parent = outer;
+	queue.EnqueueTasks(taskPtrs);
+	ChunkTask::RunChunks(nextChunk, numChunks, loop, &queue);
+	queue.WaitForAllTasks();
+}
+
+
+int64_t ChunkGrain(int64_t count, int64_t grain) {
+	if (grain > 0)
+		return grain;
+	// A few chunks per worker even out chunks of uneven cost
+	int64_t numChunks = 4 * (int64_t)TaskQueue::NumWorkers();
+	return std::max((count + numChunks - 1) / numChunks, (int64_t)1);
+}
+
+
 int NumSystemCores() {
 #if defined(PBRT_IS_WINDOWS)
-    SYSTEM_INFO sysinfo;
-    GetSystemInfo(&sysinfo);
-    return sysinfo.dwNumberOfProcessors;
-#elif defined(PBRT_IS_LINUX)
-    return sysconf(_SC_NPROCESSORS_ONLN);
-#else
-    // mac/bsds
-#ifdef PBRT_IS_OPENBSD
-    int mib[2] = { CTL_HW, HW_NCPU };
+    // GetSystemInfo only counts the processor group of the process
+    return GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
 #else
-    int mib[2];
-    mib[0] = CTL_HW;
-    size_t length = 2;
-    if (sysctlnametomib("hw.logicalcpu", mib, &length) == -1) {
-        Error("sysctlnametomib() filed.  Guessing 2 CPU cores.");
-        return 2;
-    }
-    Assert(length == 2);
-#endif
-    int nCores = 0;
-    size_t size = sizeof(nCores);
-
-    /* get the number of CPUs from the system */
-    if (sysctl(mib, 2, &nCores, &size, NULL, 0) == -1) {
-        Error("sysctl() to find number of cores present failed");
-        return 2;
-    }
-    return nCores;
+    // hardware_concurrency is 0 when unknown
+    return std::max((int)std::thread::hardware_concurrency(), 1);
 #endif
 }
 
@@ -38,255 +38,106 @@
 
 #include "PbrtUtils/types.h"
 
-#if defined(PBRT_IS_APPLE_PPC)
-#include <libkern/OSAtomic.h>
-#endif // PBRT_IS_APPLE_PPC
-
 #if defined(PBRT_IS_WINDOWS)
 #include <windows.h>
 #else
 #include <pthread.h>
-#include <semaphore.h>
 #endif
 
+#include <algorithm>
 #include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 namespace Parallel {
 
 using namespace PbrtUtils;
 
 // Parallel Declarations
-#if defined(PBRT_IS_WINDOWS)
-	#if _MSC_VER >= 1300
-		extern "C" void _ReadWriteBarrier();
-		#pragma intrinsic(_ReadWriteBarrier)
-	#else
-		#define _ReadWriteBarrier()
-	#endif
-
-	typedef volatile LONG AtomicInt32;
-
-	#ifdef PBRT_HAS_64_BIT_ATOMICS
-		typedef volatile LONGLONG AtomicInt64;
-	#endif // 64-bit
-#else
-	typedef volatile int32_t AtomicInt32;
-	#ifdef PBRT_HAS_64_BIT_ATOMICS
-		typedef volatile int64_t AtomicInt64;
-	#endif
-#endif // !PBRT_IS_WINDOWS
+typedef std::atomic<int32_t> AtomicInt32;
+typedef std::atomic<int64_t> AtomicInt64;
+
+// The atomic operations are sequentially consistent. The arithmetic ones return the
+// new value, the compare and swaps the value found.
 inline int32_t AtomicAdd(AtomicInt32 *v, int32_t delta) {
-#if defined(PBRT_IS_WINDOWS)
-    // Do atomic add with MSVC inline assembly
-#if (PBRT_POINTER_SIZE == 8)
-    return InterlockedAdd(v, delta);
-#else
-    int32_t result;
-    _ReadWriteBarrier();
-    __asm {
-        __asm mov edx, v
-        __asm mov eax, delta
-        __asm lock xadd [edx], eax
-        __asm mov result, eax
-    }
-    _ReadWriteBarrier();
-    return result + delta;
-#endif
-#elif defined(PBRT_IS_APPLE_PPC)
-    return OSAtomicAdd32Barrier(delta, v);
-#else
-    // Do atomic add with gcc x86 inline assembly
-    int32_t origValue;
-    __asm__ __volatile__("lock\n"
-                         "xaddl %0,%1"
-                         : "=r"(origValue), "=m"(*v) : "0"(delta)
-                         : "memory");
-    return origValue + delta;
-#endif
+    return v->fetch_add(delta) + delta;
 }
 
+
 inline int32_t AtomicIncrement(AtomicInt32 *v) {
-#if defined(PBRT_IS_WINDOWS)
-	return InterlockedIncrement(v);
-#else
-	return AtomicAdd(v, 1);
-#endif
+    return ++*v;
 }
 
+
 inline int32_t AtomicDecrement(AtomicInt32 *v) {
-#if defined(PBRT_IS_WINDOWS)
-	return InterlockedDecrement(v);
-#else
-	return AtomicAdd(v, -1);
-#endif
+    return --*v;
 }
 
 
-inline int32_t AtomicCompareAndSwap(AtomicInt32 *v, int32_t newValue,
-                                    int32_t oldValue);
 inline int32_t AtomicCompareAndSwap(AtomicInt32 *v, int32_t newValue, int32_t oldValue) {
-#if defined(PBRT_IS_WINDOWS)
-    return InterlockedCompareExchange(v, newValue, oldValue);
-#elif defined(PBRT_IS_APPLE_PPC)
-    return OSAtomicCompareAndSwap32Barrier(oldValue, newValue, v);
-#else
-    int32_t result;
-    __asm__ __volatile__("lock\ncmpxchgl %2,%1"
-                          : "=a"(result), "=m"(*v)
-                          : "q"(newValue), "0"(oldValue)
-                          : "memory");
-    return result;
-#endif
+    v->compare_exchange_strong(oldValue, newValue);
+    return oldValue;
 }
 
 
 template <typename T>
-inline T *AtomicCompareAndSwapPointer(T **v, T *newValue, T *oldValue) {
-    PBRT_ATOMIC_MEMORY_OP();
-#if defined(PBRT_IS_WINDOWS)
-    return InterlockedCompareExchange(v, newValue, oldValue);
-#elif defined(PBRT_IS_APPLE_PPC)
-  #ifdef PBRT_HAS_64_BIT_ATOMICS
-    return OSAtomicCompareAndSwap64Barrier(oldValue, newValue, v);
-  #else
-    return OSAtomicCompareAndSwap32Barrier(oldValue, newValue, v);
-  #endif
-#else
-    T *result;
-    __asm__ __volatile__("lock\ncmpxchg"
-#ifdef PBRT_HAS_64_BIT_ATOMICS
-                                       "q"
-#else
-                                       "l"
-#endif // 64 bit atomics
-                                        " %2,%1"
-                          : "=a"(result), "=m"(*v)
-                          : "q"(newValue), "0"(oldValue)
-                          : "memory");
-    return result;
-#endif
+inline T *AtomicCompareAndSwapPointer(std::atomic<T *> *v, T *newValue, T *oldValue) {
+    v->compare_exchange_strong(oldValue, newValue);
+    return oldValue;
 }
 
 
-#ifdef PBRT_HAS_64_BIT_ATOMICS
 inline int64_t AtomicAdd(AtomicInt64 *v, int64_t delta) {
-    PBRT_ATOMIC_MEMORY_OP();
-#ifdef PBRT_IS_WINDOWS
-    return InterlockedAdd64(v, delta);
-#elif defined(PBRT_IS_APPLE_PPC)
-    return OSAtomicAdd64Barrier(delta, v);
-#else
-    int64_t result;
-    __asm__ __volatile__("lock\nxaddq %0,%1"
-                          : "=r"(result), "=m"(*v)
-                          : "0"(delta)
-                          : "memory");
-   return result + delta;
-#endif
+    return v->fetch_add(delta) + delta;
 }
 
 
 inline int64_t AtomicIncrement(AtomicInt64 *v) {
-#if defined(PBRT_IS_WINDOWS)
-	PBRT_ATOMIC_MEMORY_OP();
-	return InterlockedIncrement64(v);
-#else
-	return AtomicAdd(v, 1);
-#endif
+    return ++*v;
 }
 
 
 inline int64_t AtomicDecrement(AtomicInt64 *v) {
-#if defined(PBRT_IS_WINDOWS)
-	PBRT_ATOMIC_MEMORY_OP();
-	return InterlockedDecrement64(v);
-#else
-	return AtomicAdd(v, -1);
-#endif
+    return --*v;
 }
 
 
 inline int64_t AtomicCompareAndSwap(AtomicInt64 *v, int64_t newValue, int64_t oldValue) {
-    PBRT_ATOMIC_MEMORY_OP();
-#if defined(PBRT_IS_WINDOWS)
-    return InterlockedCompareExchange64(v, newValue, oldValue);
-#elif defined(PBRT_IS_APPLE_PPC)
-    return OSAtomicCompareAndSwap64Barrier(oldValue, newValue, v);
-#else
-    int64_t result;
-    __asm__ __volatile__("lock\ncmpxchgq %2,%1"
-                          : "=a"(result), "=m"(*v)
-                          : "q"(newValue), "0"(oldValue)
-                          : "memory");
-    return result;
-#endif
+    v->compare_exchange_strong(oldValue, newValue);
+    return oldValue;
 }
 
 
-#endif // PBRT_HAS_64_BIT_ATOMICS
-inline float AtomicAdd(volatile float *val, float delta) {
-    union bits { float f; int32_t i; };
-    bits oldVal, newVal;
-    do {
-        // On IA32/x64, adding a PAUSE instruction in compare/exchange loops
-        // is recommended to improve performance.  (And it does!)
-#if (defined(__i386__) || defined(__amd64__))
-        __asm__ __volatile__ ("pause\n");
-#endif
-        oldVal.f = *val;
-        newVal.f = oldVal.f + delta;
-    } while (AtomicCompareAndSwap(((AtomicInt32 *)val),
-                                  newVal.i, oldVal.i) != oldVal.i);
-    return newVal.f;
+inline float AtomicAdd(std::atomic<float> *val, float delta) {
+    float oldVal = val->load(std::memory_order_relaxed);
+    while (!val->compare_exchange_weak(oldVal, oldVal + delta))
+        ;
+    return oldVal + delta;
 }
 
-#ifdef PBRT_HAS_64_BIT_ATOMICS
-inline double AtomicAdd(volatile double *val, double delta) {
-    PBRT_ATOMIC_MEMORY_OP();
-    union bits { double d; int64_t i; };
-    bits oldVal, newVal;
-    do {
-        // On IA32/x64, adding a PAUSE instruction in compare/exchange loops
-        // is recommended to improve performance.  (And it does!)
-#if (defined(__i386__) || defined(__amd64__))
-        __asm__ __volatile__ ("pause\n");
-#endif
-        oldVal.d = *val;
-        newVal.d = oldVal.d + delta;
-    } while (AtomicCompareAndSwap(((AtomicInt64 *)val),
-                                  newVal.i, oldVal.i) != oldVal.i);
-    return newVal.d;
+
+inline double AtomicAdd(std::atomic<double> *val, double delta) {
+    double oldVal = val->load(std::memory_order_relaxed);
+    while (!val->compare_exchange_weak(oldVal, oldVal + delta))
+        ;
+    return oldVal + delta;
 }
-#endif // PBRT_HAS_64_BIT_ATOMICS
 
 
 inline int32_t AtomicMin(AtomicInt32 *val, int32_t compare) {
-	int32_t oldVal, newVal;
-	do {
-        // On IA32/x64, adding a PAUSE instruction in compare/exchange loops
-        // is recommended to improve performance.  (And it does!)
-#if (defined(__i386__) || defined(__amd64__))
-        __asm__ __volatile__ ("pause\n");
-#endif
-		oldVal = *val;
-		newVal = min(compare, oldVal);
-	} while (AtomicCompareAndSwap(val, newVal, oldVal) != oldVal);
-	return newVal;
+    int32_t oldVal = val->load(std::memory_order_relaxed);
+    while (compare < oldVal && !val->compare_exchange_weak(oldVal, compare))
+        ;
+    return std::min(compare, oldVal);
 }
 
 
 inline int32_t AtomicMax(AtomicInt32 *val, int32_t compare) {
-	int32_t oldVal, newVal;
-	do {
-        // On IA32/x64, adding a PAUSE instruction in compare/exchange loops
-        // is recommended to improve performance.  (And it does!)
-#if (defined(__i386__) || defined(__amd64__))
-        __asm__ __volatile__ ("pause\n");
-#endif
-		oldVal = *val;
-		newVal = max(compare, oldVal);
-	} while (AtomicCompareAndSwap(val, newVal, oldVal) != oldVal);
-	return newVal;
+    int32_t oldVal = val->load(std::memory_order_relaxed);
+    while (compare > oldVal && !val->compare_exchange_weak(oldVal, compare))
+        ;
+    return std::max(compare, oldVal);
 }
 
 
@@ -303,18 +154,17 @@ private:
     Mutex(Mutex &);
     Mutex &operator=(const Mutex &);
 
-    // System-dependent mutex implementation
-#if defined(PBRT_IS_WINDOWS)
-    CRITICAL_SECTION criticalSection;
-#else
-    pthread_mutex_t mutex;
-#endif
+    std::mutex mutex;
 };
 
 
 struct MutexLock {
-    MutexLock(Mutex &m);
-    ~MutexLock();
+    MutexLock(Mutex &m) : mutex(m) {
+        mutex.mutex.lock();
+    }
+    ~MutexLock() {
+        mutex.mutex.unlock();
+    }
 private:
     Mutex &mutex;
     MutexLock(const MutexLock &);
@@ -334,23 +184,14 @@ private:
     RWMutex(RWMutex &);
     RWMutex &operator=(const RWMutex &);
 
-    // System-dependent rw mutex implementation
-#if defined(PBRT_IS_WINDOWS)
     void AcquireRead();
     void ReleaseRead();
     void AcquireWrite();
     void ReleaseWrite();
-    
-    LONG numWritersWaiting;
-    LONG numReadersWaiting;
-    
-    // HIWORD is writer active flag;
-    // LOWORD is readers active count;
-    DWORD activeWriterReaders;
-    
-    HANDLE hReadyToRead;
-    HANDLE hReadyToWrite;
-    CRITICAL_SECTION cs;
+
+    // System-dependent rw mutex implementation
+#if defined(PBRT_IS_WINDOWS)
+    SRWLOCK lock;
 #else
     pthread_rwlock_t mutex;
 #endif
@@ -381,12 +222,9 @@ public:
     bool TryWait();
 private:
     // Semaphore Private Data
-#if defined(PBRT_IS_WINDOWS)
-    HANDLE handle;
-#else
-    sem_t *sem;
-    static int count;
-#endif
+    std::mutex mutex;
+    std::condition_variable cond;
+    int count;
 };
 
 
@@ -397,49 +235,111 @@ public:
     ~ConditionVariable();
     void Lock();
     void Unlock();
+    // Called with the lock held
     void Wait();
     void Signal();
 	void SignalAll();
 private:
     // ConditionVariable Private Data
-#if !defined(PBRT_IS_WINDOWS)
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-#else
-    // Count of the number of waiters.
-    uint32_t waitersCount;
-    // Serialize access to <waitersCount>.
-    CRITICAL_SECTION waitersCountMutex, conditionMutex;
-    // Signal and broadcast event HANDLEs.
-    enum { SIGNAL = 0, BROADCAST=1, NUM_EVENTS=2 };
-    HANDLE events[NUM_EVENTS];
-#endif
+    std::mutex mutex;
+    std::condition_variable cond;
 };
 
 
+// A loop split in numbered chunks, see ParallelForRange
+class ChunkedLoop {
+public:
+	virtual ~ChunkedLoop() { }
+	virtual void RunChunk(int64_t chunk) const = 0;
+};
+
+// Runs the chunks on the worker pool and the calling thread and returns when
+// all are done. The chunks are claimed from a shared counter, a handful of
+// tasks serve all of them. Called from a task, the loop has the priority of
+// the task, higher priority tasks run between its chunks and it stops taking
+// chunks once the queue of the task is aborted.
+void RunChunkedLoop(int64_t numChunks, const ChunkedLoop &loop);
+
+
+class TaskQueue;
 class Task {
 public:
+    Task() : queue(NULL) { }
     virtual ~Task();
     virtual void Run() = 0;
+private:
+    friend class TaskQueue;
+    // The queue the task was enqueued in
+    TaskQueue *queue;
+};
+
+
+// Scheduling classes of the tasks of a TaskQueue, in decreasing priority
+enum TaskPriority {
+	// Work a user waits on, such as a live fit
+	TASK_PRIORITY_INTERACTIVE,
+	TASK_PRIORITY_NORMAL,
+	// Long jobs that may wait, such as precomputing a table
+	TASK_PRIORITY_BACKGROUND,
+	NUM_TASK_PRIORITIES
 };
 
 
+// Tasks run on a pool of worker threads. Every worker has its own deque, tasks
+// enqueued by a worker go to its deque and idle workers steal from the others.
+// Tasks enqueued by other threads are shared out from a common queue. There are
+// separate deques and shared queues for each priority.
 class TaskQueue {
 public:
+	// The tasks get the priority of the task running on this thread, or
+	// TASK_PRIORITY_NORMAL on other threads
 	TaskQueue();
+	explicit TaskQueue(TaskPriority priority);
 	~TaskQueue();
 	void EnqueueTasks(const vector<Task *> &tasks);
+	// Called from a task, runs queued tasks of the same or a higher priority
+	// while waiting
 	void WaitForAllTasks();
+	// The tasks not started yet are skipped
 	void Abort();
+	// Also true when the queue was created by a loop of a task whose queue is
+	// aborted, see RunChunkedLoop
+	bool Aborted() const;
 	double Progress();
+	TaskPriority Priority() const { return priority; }
+
+	// The queue of the task running on this thread, NULL outside of tasks
+	static TaskQueue *Current();
+	// Called between steps of a long task, runs the queued tasks of a higher
+	// priority on this worker before the task continues
+	static void YieldToHigherPriority();
 
 	static void Cleanup();
+
+	// Number of worker threads, 0 starts one per logical processor. Without a call
+	// the SKINPARAM_NUM_THREADS environment variable is used when set. A running
+	// pool is restarted, so call it while no tasks are queued.
+	static void SetNumWorkers(int n);
+	// Does not lock while the pool runs, the parallel loops call it every time
+	static int NumWorkers();
+	// Pins each worker to a single logical processor. The workers are placed on the
+	// NUMA nodes in turn either way. Takes effect when the pool starts.
+	static void SetPinWorkers(bool pin);
+	// Strict priorities, the default, always take the tasks of the highest
+	// priority first. Otherwise the priorities take turns by weight, so that
+	// background tasks keep a share of the workers.
+	static void SetStrictPriorities(bool strict);
 private:
-	uint32_t numUnfinishedTasks;
-	uint32_t numTotalTasks;
+	friend void RunChunkedLoop(int64_t numChunks, const ChunkedLoop &loop);
+
+	std::atomic<int> numUnfinishedTasks;
+	std::atomic<int> numTotalTasks;
 	Mutex* taskMutex;
 	ConditionVariable *tasksRunningCondition;
-	bool aborted;
+	std::atomic<bool> aborted;
+	TaskPriority priority;
+	// Aborted with this queue
+	const TaskQueue *parent;
 
 #if defined(PBRT_IS_WINDOWS)
 	static UINT taskEntry(LPVOID arg);
@@ -448,20 +348,136 @@ private:
 #endif
 #if defined(PBRT_IS_WINDOWS)
 	static HANDLE *threads;
-#elif
+#else
 	static pthread_t *threads;
-#endif 
+#endif
+	struct Worker;
+	// Set while the pool runs, numWorkers is stored before it is published
+	static std::atomic<Worker**> workers;
+	static std::atomic<int> numWorkers;
+	static int requestedNumWorkers;
+	static bool pinWorkers;
+	static std::atomic<bool> strictPriorities;
+	// Tasks enqueued by threads that are not workers
+	static Mutex *sharedTasksMutex;
+	static std::deque<Task*> sharedTasks[NUM_TASK_PRIORITIES];
+	// Tasks in the deques and sharedTasks, idle workers sleep on taskQueueCondition
+	// until it is positive
+	static std::atomic<int> numQueuedTasks;
+	static std::atomic<int> numQueuedByPriority[NUM_TASK_PRIORITIES];
+	static std::atomic<int> numSleepingWorkers;
+	// Changed by every scheduled and finished task. Workers that find no task while
+	// others still run or move tasks sleep until it changes, see WaitForChange.
+	static std::atomic<uint32_t> queueEpoch;
+	static std::atomic<int> numStalledWorkers;
 	static ConditionVariable *taskQueueCondition;
-	static std::deque<std::pair<Task*, TaskQueue*> > taskQueue;
-	static bool cleanup;
+	static std::atomic<bool> cleanup;
 
 	static void TasksInit();
 	static void TasksCleanup();
-	static void EnqueueTasks(const vector<Task *> &tasks, TaskQueue* tq);
+	static int ConfiguredNumWorkers();
+	static void PlaceWorkers();
+	static void ScheduleTasks(const vector<Task *> &tasks, TaskPriority priority);
+	static void PriorityOrder(int worker, int *order);
+	static Task *FindTask(int worker, int priorityLimit);
+	static Task *TakeSharedTasks(int worker, int priority);
+	static Task *StealTask(int worker, int priority);
+	static void RunTask(Task *task);
+	static void WaitForChange(uint32_t epoch);
+	static void QueueChanged();
+	void TaskFinished();
 };
 
 int NumSystemCores();
 
+
+// Iterations per chunk for count iterations, grain <= 0 gives each worker
+// a few chunks
+int64_t ChunkGrain(int64_t count, int64_t grain);
+
+
+template <class Func> class RangeLoop : public ChunkedLoop {
+public:
+	RangeLoop(int64_t begin, int64_t end, int64_t grain, const Func &func)
+		: begin(begin), end(end), grain(grain), func(func) { }
+	void RunChunk(int64_t chunk) const {
+		int64_t first = begin + chunk * grain;
+		func(first, end - first > grain ? first + grain : end);
+	}
+private:
+	RangeLoop &operator=(const RangeLoop &);
+	int64_t begin, end, grain;
+	const Func &func;
+};
+
+// Calls func(first, last) on consecutive ranges [first, last) of [begin, end)
+// with grain iterations each, in parallel. Nothing is allocated per chunk.
+template <class Func>
+void ParallelForRange(int64_t begin, int64_t end, int64_t grain, const Func &func) {
+	if (end <= begin)
+		return;
+	grain = ChunkGrain(end - begin, grain);
+	RunChunkedLoop((end - begin + grain - 1) / grain,
+		RangeLoop<Func>(begin, end, grain, func));
+}
+
+
+template <class Func> class IndexRange {
+public:
+	explicit IndexRange(const Func &func) : func(func) { }
+	void operator()(int64_t first, int64_t last) const {
+		for (int64_t i = first; i < last; i++)
+			func(i);
+	}
+private:
+	IndexRange &operator=(const IndexRange &);
+	const Func &func;
+};
+
+// Calls func(i) for every i in [begin, end), in parallel
+template <class Func>
+void ParallelFor(int64_t begin, int64_t end, int64_t grain, const Func &func) {
+	ParallelForRange(begin, end, grain, IndexRange<Func>(func));
+}
+
+
+template <class T, class Func> class ReduceLoop : public ChunkedLoop {
+public:
+	ReduceLoop(int64_t begin, int64_t end, int64_t grain, const Func &func, T *partials)
+		: begin(begin), end(end), grain(grain), func(func), partials(partials) { }
+	void RunChunk(int64_t chunk) const {
+		int64_t first = begin + chunk * grain;
+		int64_t last = end - first > grain ? first + grain : end;
+		T &partial = partials[chunk];
+		for (int64_t i = first; i < last; i++)
+			func(i, partial);
+	}
+private:
+	ReduceLoop &operator=(const ReduceLoop &);
+	int64_t begin, end, grain;
+	const Func &func;
+	T *partials;
+};
+
+// Folds every i in [begin, end) with func(i, partial) into a partial result per
+// chunk, starting from identity, and combines the partials with reduce(a, b) in
+// chunk order. For a given grain the result does not depend on the scheduling,
+// grain <= 0 depends on the number of workers.
+template <class T, class Func, class Reduce>
+T ParallelReduce(int64_t begin, int64_t end, int64_t grain, const T &identity,
+	const Func &func, const Reduce &reduce) {
+	if (end <= begin)
+		return identity;
+	grain = ChunkGrain(end - begin, grain);
+	int64_t numChunks = (end - begin + grain - 1) / grain;
+	vector<T> partials((size_t)numChunks, identity);
+	RunChunkedLoop(numChunks, ReduceLoop<T, Func>(begin, end, grain, func, &partials[0]));
+	T result = partials[0];
+	for (size_t chunk = 1; chunk < partials.size(); chunk++)
+		result = reduce(result, partials[chunk]);
+	return result;
+}
+
 } // namespace Parallel
 
 #endif // PBRT_CORE_PARALLEL_H
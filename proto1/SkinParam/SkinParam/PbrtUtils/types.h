@@ -3,7 +3,11 @@
 #pragma warning (disable : 4305) // double constant assigned to float
 #pragma warning (disable : 4244) // int -> float conversion
 
+#if defined(_WIN32)
 #define PBRT_IS_WINDOWS
+#elif defined(__linux__)
+#define PBRT_IS_LINUX
+#endif
 
 #include <float.h>
 #include <vector>
@@ -11,8 +15,12 @@
 #include <limits>
 
 // Platform-specific definitions
+#if defined(PBRT_IS_WINDOWS)
 #define isnan _isnan
 #define isinf(f) (!_finite((f)))
+#else
+#include <math.h>
+#endif
 #include <stdint.h>
 
 namespace PbrtUtils {
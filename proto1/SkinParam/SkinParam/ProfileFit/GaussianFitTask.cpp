@@ -32,29 +32,278 @@
 #include "stdafx.h"
 
 #include "GaussianFitTask.h"
-#include "MultipoleProfileCalculator.h"
 #include "gaussianfit.h"
+#include <algorithm>
 #include <map>
+#include <list>
+#include <memory>
+#include <mutex>
 
 using namespace Parallel;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
 
 namespace ProfileFit {
 
-class GaussianFitTask : public Task {
+static const int nLayers = 2;
+// Times the stages of a fit
+typedef std::chrono::high_resolution_clock Clock;
+
+// Everything a GaussianFitTask reads, for one spectral component
+struct ComponentFitKey {
+	// Compared bytewise
+	struct Optics {
+		float mua[nLayers];
+		float musp[nLayers];
+		float et[nLayers];
+		float thickness[nLayers];
+		uint32_t desiredLength;
+		uint32_t profileEngine;
+		float profileTolerance;
+	} optics;
+	vector<float> sigmas;
+
+	bool operator<(const ComponentFitKey& other) const {
+		int order = memcmp(&optics, &other.optics, sizeof(optics));
+		if (order)
+			return order < 0;
+		return sigmas < other.sigmas;
+	}
+};
+
+// Fitted coefficients of single spectral components. An edit of one chromophore leaves
+// the optical coefficients of some components unchanged (e.g. f_eu while f_mel is zero,
+// f_ohg where both hemoglobins absorb alike), and those are not fitted again.
+class ComponentFitCache {
 public:
-	static const int nLayers = 2;
+	static const size_t CAPACITY = SampledSpectrum::nComponents * 64;
+
+	bool find(const ComponentFitKey& key, SpectralGaussianCoeffs& coeffs, int sc) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = index.find(key);
+		if (iter == index.end())
+			return false;
+		entries.splice(entries.begin(), entries, iter->second);
+		const Entry& entry = *iter->second;
+		for (size_t iSigma = 0; iSigma < entry.coeffs.size(); iSigma++)
+			coeffs.coeffs[iSigma][sc] = entry.coeffs[iSigma];
+		coeffs.error[sc] = entry.error;
+		FitStats& stats = coeffs.stats[sc];
+		stats.cached = true;
+		stats.firstSigma = entry.firstSigma;
+		stats.lastSigma = entry.lastSigma;
+		return true;
+	}
+
+	void insert(const ComponentFitKey& key, const SpectralGaussianCoeffs& coeffs, int sc) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (index.find(key) != index.end())
+			return;
+		entries.push_front(Entry());
+		Entry& entry = entries.front();
+		entry.key = key;
+		for (const SampledSpectrum& coeff : coeffs.coeffs)
+			entry.coeffs.push_back(coeff[sc]);
+		entry.error = coeffs.error[sc];
+		entry.firstSigma = coeffs.stats[sc].firstSigma;
+		entry.lastSigma = coeffs.stats[sc].lastSigma;
+		index[key] = entries.begin();
+		if (entries.size() > CAPACITY) {
+			index.erase(entries.back().key);
+			entries.pop_back();
+		}
+	}
+
+private:
+	struct Entry {
+		ComponentFitKey key;
+		vector<float> coeffs;
+		float error;
+		int firstSigma;
+		int lastSigma;
+	};
+	// Most recently used first
+	typedef std::list<Entry> EntryList;
+
+	std::mutex mutex;
+	EntryList entries;
+	std::map<ComponentFitKey, EntryList::iterator> index;
+};
+
+static ComponentFitCache componentFitCache;
+
+// The profile calculator keeps the profiles of single layers, so a fit that changes
+// only one layer reuses the other. Its cache is cleared once it holds this many fits.
+static const int32_t MAX_CACHED_PROFILES = SampledSpectrum::nComponents * 16;
+static AtomicInt32 numCachedProfiles(0);
+
+// Spacing of the RGB fit samples relative to their distance, away from the origin
+static const float RGB_FIT_GROWTH = 0.02f;
+// Components weighing less in a channel do not shape the grid and window of its fit
+static const float RGB_FIT_MIN_RELATIVE_WEIGHT = 0.1f;
+
+// Optical coefficients of the skin layers, per spectral component and in 1/mm
+struct SkinOptics {
+	SkinOptics(const SkinLayerCoeffs& layers) {
+		mua[0] = layers.mua_epi.toSampledSpectrum() / 10.f;
+		mua[1] = layers.mua_derm.toSampledSpectrum() / 10.f;
+		musp[0] = layers.musp_epi.toSampledSpectrum() / 10.f;
+		musp[1] = layers.musp_derm.toSampledSpectrum() / 10.f;
+		et[0] = et[1] = 1.4f;
+		thickness[0] = 0.25f;
+		thickness[1] = 20.f;
+	}
+
+	// Mean free paths of the thinnest and thickest layers, and their average
+	void meanFreePaths(int sc, float& mfpMin, float& mfpMax, float& mfpMean) const {
+		mfpMin = FLT_MAX;
+		mfpMax = 0.f;
+		float mfpTotal = 0.f;
+		for (int layer = 0; layer < nLayers; layer++) {
+			float mfp = 1.f / (mua[layer][sc] + musp[layer][sc]);
+			mfpTotal += mfp;
+			mfpMin = min(mfpMin, mfp);
+			mfpMax = max(mfpMax, mfp);
+		}
+		mfpMean = mfpTotal / (float)nLayers;
+	}
+
+	SampledSpectrum mua[nLayers];
+	SampledSpectrum musp[nLayers];
+	float et[nLayers];
+	float thickness[nLayers];
+};
 
-	GaussianFitTask(const SampledSpectrum* mua, const SampledSpectrum* musp,
-		const float* et, const float* thickness, SpectralGaussianCoeffs& coeffs,
-		int sc, uint32_t desiredLength)
-		: coeffs(coeffs), sc(sc), desiredLength(desiredLength)
+// Computes the profile of one spectral component, see MPC_Options for adaptiveTolerance
+static MPC_Output* ComputeComponentProfile(const float* mua, const float* musp,
+	const float* et, const float* thickness, uint32_t desiredLength, float desiredStepSize,
+	MPC_Engine engine, float adaptiveTolerance)
+{
+	MPC_LayerSpec pLayerSpecs[nLayers];
+	for (int layer = 0; layer < nLayers; layer++) {
+		MPC_LayerSpec& ls = pLayerSpecs[layer];
+		ls.g_HG = 0.f;
+		ls.ior = et[layer];
+		ls.mua = mua[layer];
+		ls.musp = musp[layer];
+		ls.thickness = thickness[layer];
+	}
+	MPC_Options options;
+	options.desiredLength = desiredLength;
+	options.lerpOnThinSlab = true;
+	options.desiredStepSize = desiredStepSize;
+	options.engine = engine;
+	options.adaptiveTolerance = adaptiveTolerance;
+
+	MPC_Output* pOutput;
+	MPC_ComputeDiffusionProfile(nLayers, pLayerSpecs, &options, &pOutput);
+	AtomicAdd(&numCachedProfiles, 1);
+	return pOutput;
+}
+
+// Weighs each sample by the area of the ring it stands for, the distances increase
+static void ComputeAreaWeights(const vector<float>& distance, vector<float>& weights) {
+	size_t length = distance.size();
+	weights.resize(length);
+	for (size_t i = 0; i < length; i++) {
+		float inner = i > 0 ? 0.5f * (distance[i - 1] + distance[i]) : 0.f;
+		float outer = i + 1 < length ? 0.5f * (distance[i] + distance[i + 1]) : distance[i];
+		weights[i] = outer * outer - inner * inner;
+	}
+}
+
+// Fits nTargetSigmas consecutive sigmas to a profile, trying the windows centered between
+// mfpMin / 2 and mfpMax * 2. Writes the coefficients of the best window to pCoeffs, which
+// holds one per sigma, and the window to stats, and returns its error. pStartCoeffs, laid
+// out like pCoeffs or NULL, seeds the fits. See GF_FitBestWindow for it and GF_FitSumGaussians
+// for pSampleWeights.
+static float FitProfileWindow(uint32_t length, const float* pDistance, const float* pReflectance,
+	const vector<float>& sigmas, float mfpMin, float mfpMax, float* pCoeffs, FitStats& stats,
+	const float* pSampleWeights = NULL, const float* pStartCoeffs = NULL)
+{
+	int nSigmas = sigmas.size();
+	const int nTargetSigmas = GAUSSIAN_FIT_WINDOW_SIGMAS;
+	const int sigmaNegExtent = nTargetSigmas / 2;
+	const int sigmaPosExtent = nTargetSigmas - sigmaNegExtent - 1;
+
+	// Try sigmas between mfpMin / 2 and mfpMax * 2
+	int firstCenter = sigmaNegExtent;
+	int lastCenter = nSigmas - sigmaPosExtent - 1;
+	int beginCenter = (int)(std::lower_bound(sigmas.begin() + firstCenter, sigmas.begin() + lastCenter + 1,
+		mfpMin / 2.f) - sigmas.begin());
+	int endCenter = (int)(std::upper_bound(sigmas.begin() + beginCenter, sigmas.begin() + lastCenter + 1,
+		mfpMax * 2.f) - sigmas.begin());
+	// Fall back to the window closest to that range
+	if (beginCenter == endCenter) {
+		beginCenter = std::min(beginCenter, lastCenter);
+		endCenter = beginCenter + 1;
+	}
+
+	// Ties go to the smaller center
+	uint32_t firstSigma;
+	GF_Output* pGFOutput;
+	GF_FitBestWindow(length, pDistance, pReflectance, nSigmas, &sigmas[0], nTargetSigmas,
+		beginCenter - sigmaNegExtent, endCenter - beginCenter, pStartCoeffs, &firstSigma,
+		&pGFOutput, pSampleWeights);
+
+	for (int iSigma = 0; iSigma < nTargetSigmas; iSigma++)
+		pCoeffs[firstSigma + iSigma] = pGFOutput->pNormalizedCoeffs[iSigma];
+	float error = pGFOutput->overallError;
+	stats.firstSigma = (int)firstSigma;
+	stats.lastSigma = (int)firstSigma + nTargetSigmas - 1;
+
+	GF_FreeOutput(pGFOutput);
+	return error;
+}
+
+// Coefficients of the components fitted so far by one set of fit tasks. A fit starts
+// from those of the closest fitted component, the previous one if it is done, as
+// neighbouring components mostly keep the window and weights. The seeds change the cost
+// of a fit, not its result, so the order the tasks run in does not matter.
+class ComponentSeeds {
+public:
+	ComponentSeeds() : coeffs(SampledSpectrum::nComponents) { }
+
+	// False if no component is fitted yet
+	bool closest(int sc, vector<float>& seed) const {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int distance = 1; distance < SampledSpectrum::nComponents; distance++) {
+			int neighbours[] = { sc - distance, sc + distance };
+			for (int neighbour : neighbours) {
+				if (neighbour >= 0 && neighbour < SampledSpectrum::nComponents && !coeffs[neighbour].empty()) {
+					seed = coeffs[neighbour];
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	void set(int sc, const vector<float>& fitted) {
+		std::lock_guard<std::mutex> lock(mutex);
+		coeffs[sc] = fitted;
+	}
+
+private:
+	mutable std::mutex mutex;
+	// By component, empty until fitted
+	vector<vector<float> > coeffs;
+};
+
+class GaussianFitTask : public Task {
+public:
+	GaussianFitTask(const SkinOptics& optics, SpectralGaussianCoeffs& coeffs,
+		int sc, const GaussianFitOptions& fitOptions, const std::shared_ptr<ComponentSeeds>& seeds)
+		: coeffs(coeffs), seeds(seeds), desiredLength(fitOptions.desiredLength),
+		profileEngine(fitOptions.profileEngine), profileTolerance(fitOptions.profileTolerance), sc(sc)
 	{
 		for (int i = 0; i < nLayers; i++) {
-			this->mua[i] = mua[i][sc];
-			this->musp[i] = musp[i][sc];
-			this->et[i] = et[i];
-			this->thickness[i] = thickness[i];
+			this->mua[i] = optics.mua[i][sc];
+			this->musp[i] = optics.musp[i][sc];
+			this->et[i] = optics.et[i];
+			this->thickness[i] = optics.thickness[i];
 		}
+		optics.meanFreePaths(sc, mfpMin, mfpMax, mfpMean);
 	}
 
 private:
@@ -62,147 +311,362 @@ private:
 	float musp[nLayers];
 	float et[nLayers];
 	float thickness[nLayers];
+	float mfpMin, mfpMax, mfpMean;
 	SpectralGaussianCoeffs& coeffs;
+	std::shared_ptr<ComponentSeeds> seeds;
 	uint32_t desiredLength;
+	MPC_Engine profileEngine;
+	float profileTolerance;
 	int sc;
 
 	void Run() override;
-	void DoGaussianFit(const MPC_Output* pOutput, float mfpMin, float mfpMax);
 };
 
 void GaussianFitTask::Run() {
-	MPC_LayerSpec* pLayerSpecs = new MPC_LayerSpec[nLayers];
-	MPC_Options options;
-	options.desiredLength = desiredLength;
-	options.lerpOnThinSlab = true;
-
-	// Compute mfp
-	float mfpMin = FLT_MAX;
-	float mfpMax = 0.f;
-	float mfpTotal = 0.f;
-	for (int layer = 0; layer < nLayers; layer++) {
-		float mfp = 1.f / (mua[layer] + musp[layer]);
-		mfpTotal += mfp;
-		mfpMin = min(mfpMin, mfp);
-		mfpMax = max(mfpMax, mfp);
-	}
-	float mfp = mfpTotal / (float)nLayers;
-	
-	// Fill in layer information
+	ComponentFitKey key;
 	for (int layer = 0; layer < nLayers; layer++) {
-		MPC_LayerSpec& ls = pLayerSpecs[layer];
-		ls.g_HG = 0.f;
-		ls.ior = et[layer];
-		ls.mua = mua[layer];
-		ls.musp = musp[layer];
-		ls.thickness = thickness[layer];
+		key.optics.mua[layer] = mua[layer];
+		key.optics.musp[layer] = musp[layer];
+		key.optics.et[layer] = et[layer];
+		key.optics.thickness[layer] = thickness[layer];
+	}
+	key.optics.desiredLength = desiredLength;
+	key.optics.profileEngine = profileEngine;
+	key.optics.profileTolerance = profileTolerance;
+	key.sigmas = coeffs.sigmas;
+	vector<float> fitted(coeffs.sigmas.size(), 0.f);
+	if (componentFitCache.find(key, coeffs, sc)) {
+		for (size_t iSigma = 0; iSigma < fitted.size(); iSigma++)
+			fitted[iSigma] = coeffs.coeffs[iSigma][sc];
+		seeds->set(sc, fitted);
+		return;
 	}
-	// Compute desired step size
-	options.desiredStepSize = 12.f * mfp / (float)options.desiredLength;
 
-	// Do the computation
-	MPC_Output* pOutput;
-	MPC_ComputeDiffusionProfile(nLayers, pLayerSpecs, &options, &pOutput);
-	MPC_ResampleForUniformDistanceSquaredDistribution(pOutput, pOutput->length);
+	FitStats& stats = coeffs.stats[sc];
+	Clock::time_point startTime = Clock::now();
+	MPC_Output* pOutput = ComputeComponentProfile(mua, musp, et, thickness,
+		desiredLength, 12.f * mfpMean / (float)desiredLength, profileEngine, profileTolerance);
+	stats.profileSamples = pOutput->length;
+	Clock::time_point profileTime = Clock::now();
+	stats.profileTime = duration_cast<nanoseconds>(profileTime - startTime);
+	// A profile sampled at all distances is resampled for a plain fit, the unevenly
+	// spaced samples of an adaptive one are weighted by area instead
+	if (profileTolerance <= 0.f)
+		MPC_ResampleForUniformDistanceSquaredDistribution(pOutput, pOutput->length);
+	Clock::time_point resampleTime = Clock::now();
+	stats.resampleTime = duration_cast<nanoseconds>(resampleTime - profileTime);
 
 	// Do gaussian fit
-	DoGaussianFit(pOutput, mfpMin, mfpMax);
-		
+	vector<float> distArray(pOutput->length);
+	for (uint32_t i = 0; i < pOutput->length; i++)
+		distArray[i] = sqrt(pOutput->pDistanceSquared[i]);
+	vector<float> sampleWeights;
+	if (profileTolerance > 0.f)
+		ComputeAreaWeights(distArray, sampleWeights);
+	vector<float> seed;
+	bool seeded = seeds->closest(sc, seed);
+	coeffs.error[sc] = FitProfileWindow(pOutput->length, &distArray[0], pOutput->pReflectance,
+		coeffs.sigmas, mfpMin, mfpMax, &fitted[0], stats,
+		sampleWeights.empty() ? NULL : &sampleWeights[0], seeded ? &seed[0] : NULL);
+	for (size_t iSigma = 0; iSigma < fitted.size(); iSigma++)
+		coeffs.coeffs[iSigma][sc] = fitted[iSigma];
+	seeds->set(sc, fitted);
+	stats.fitTime = duration_cast<nanoseconds>(Clock::now() - resampleTime);
+
 	MPC_FreeOutput(pOutput);
 
-	delete [] pLayerSpecs;
+	componentFitCache.insert(key, coeffs, sc);
 }
 
-void GaussianFitTask::DoGaussianFit(const MPC_Output* pOutput, float mfpMin, float mfpMax) {
-	const vector<float>& sigmas = coeffs.sigmas;
+// Computes the profile of one spectral component for the RGB fits
+class ComponentProfileTask : public Task {
+public:
+	ComponentProfileTask(const SkinOptics& optics, SpectralProfiles& profiles,
+		int sc, MPC_Engine profileEngine)
+		: profiles(profiles), sc(sc), profileEngine(profileEngine)
+	{
+		for (int i = 0; i < nLayers; i++) {
+			mua[i] = optics.mua[i][sc];
+			musp[i] = optics.musp[i][sc];
+			et[i] = optics.et[i];
+			thickness[i] = optics.thickness[i];
+		}
+	}
 
-	int nSigmas = sigmas.size();
-	const int nTargetSigmas = 6;
-	const int sigmaNegExtent = nTargetSigmas / 2;
-	const int sigmaPosExtent = nTargetSigmas - sigmaNegExtent - 1;
+private:
+	float mua[nLayers];
+	float musp[nLayers];
+	float et[nLayers];
+	float thickness[nLayers];
+	SpectralProfiles& profiles;
+	int sc;
+	MPC_Engine profileEngine;
+
+	void Run() override {
+		// RGBFitTask interpolates the profile at any distance, so all are sampled
+		uint32_t length = profiles.length;
+		Clock::time_point startTime = Clock::now();
+		MPC_Output* pOutput = ComputeComponentProfile(mua, musp, et, thickness,
+			length, profiles.stepSize[sc], profileEngine, 0.f);
+		Assert(pOutput->length == length);
+		std::copy(pOutput->pReflectance, pOutput->pReflectance + length,
+			profiles.reflectance.begin() + sc * length);
+		MPC_FreeOutput(pOutput);
+		profiles.stats[sc].profileSamples = length;
+		profiles.stats[sc].profileTime = duration_cast<nanoseconds>(Clock::now() - startTime);
+	}
+};
 
-	// Compute the best fit of nTargetSigmas gaussians
-	uint32 length = pOutput->length;
-	vector<float> distArray(length);
-	for (uint32 i = 0; i < length; i++) {
-		float dsq = pOutput->pDistanceSquared[i];
-		distArray[i] = sqrt(dsq);
+// Fits one channel of the RGB profile
+class RGBFitTask : public Task {
+public:
+	RGBFitTask(const SpectralProfiles& profiles, RGBGaussianCoeffs& coeffs, int channel)
+		: profiles(profiles), coeffs(coeffs), channel(channel),
+		weights(SampledSpectrum::nComponents, 0.f)
+	{
+		// The RGB conversion is linear, so the profile of a channel is a weighted sum
+		// of the spectral profiles. A skipped component is a lerp of its computed
+		// neighbours and adds to their weights instead.
+		const vector<int>& fitted = profiles.fitted;
+		for (size_t i = 0; i < fitted.size(); i++) {
+			int lower = fitted[i];
+			int upper = i + 1 < fitted.size() ? fitted[i + 1] : lower + 1;
+			for (int sc = lower; sc < upper; sc++) {
+				SampledSpectrum unit(0.f);
+				unit[sc] = 1.f;
+				float rgb[3];
+				unit.ToRGB(rgb);
+				float t = (float)(sc - lower) / (float)(upper - lower);
+				weights[lower] += (1.f - t) * rgb[channel];
+				if (sc != lower)
+					weights[upper] += t * rgb[channel];
+			}
+		}
 	}
-	GF_Output* pGFOutput;
 
-	float minError = FLT_MAX;
-	int minErrorSigmaCenter = 0;
-	std::map<int, GF_Output*> oCache;
-	// Try sigmas between mfpMin / 2 and mfpMax * 2
-	for (int iSigmaCenter = sigmaNegExtent; iSigmaCenter < nSigmas - sigmaPosExtent; iSigmaCenter++) {
-		float sigma = sigmas[iSigmaCenter];
-		if (sigma < mfpMin / 2.f) continue;
-		if (sigma > mfpMax * 2.f) break;
-		GF_FitSumGaussians(length, &distArray[0], pOutput->pReflectance,
-			nTargetSigmas, &sigmas[iSigmaCenter - sigmaNegExtent], &pGFOutput);
-		if (pGFOutput->overallError < minError) {
-			minError = pGFOutput->overallError;
-			minErrorSigmaCenter = iSigmaCenter;
+private:
+	const SpectralProfiles& profiles;
+	RGBGaussianCoeffs& coeffs;
+	int channel;
+	vector<float> weights;
+
+	void Run() override;
+};
+
+void RGBFitTask::Run() {
+	FitStats& stats = coeffs.stats[channel];
+	Clock::time_point startTime = Clock::now();
+	// The grid and the Gaussians searched follow the components that matter to the channel
+	float maxWeight = 0.f;
+	for (int sc : profiles.fitted)
+		maxWeight = max(maxWeight, fabsf(weights[sc]));
+	float stepMin = FLT_MAX;
+	float stepMax = 0.f;
+	float mfpMin = FLT_MAX;
+	float mfpMax = 0.f;
+	for (int sc : profiles.fitted) {
+		stepMax = max(stepMax, profiles.stepSize[sc]);
+		if (fabsf(weights[sc]) < RGB_FIT_MIN_RELATIVE_WEIGHT * maxWeight)
+			continue;
+		stepMin = min(stepMin, profiles.stepSize[sc]);
+		mfpMin = min(mfpMin, profiles.mfpMin[sc]);
+		mfpMax = max(mfpMax, profiles.mfpMax[sc]);
+	}
+
+	// The components span different distances, so evenly spaced squared distances fine
+	// enough for the shortest would take many times their samples. The channel is sampled
+	// as finely as its shortest component near the origin and geometrically further out
+	// instead, each sample weighted by the area it stands for as in the component fits.
+	uint32_t length = profiles.length;
+	float maxDist = stepMax * (float)(length - 1);
+	vector<float> distance(1, 0.f);
+	while (distance.back() < maxDist)
+		distance.push_back(distance.back() + max(stepMin, RGB_FIT_GROWTH * distance.back()));
+	distance.back() = maxDist;
+	uint32_t fitLength = (uint32_t)distance.size();
+	vector<float> sampleWeights;
+	ComputeAreaWeights(distance, sampleWeights);
+
+	vector<float> reflectance(fitLength, 0.f);
+	for (int sc : profiles.fitted) {
+		if (weights[sc] == 0.f)
+			continue;
+		const float* pComponent = &profiles.reflectance[sc * length];
+		float invStep = 1.f / profiles.stepSize[sc];
+		for (uint32_t i = 0; i < fitLength; i++) {
+			// Components with shorter mean free paths end earlier and are zero beyond
+			float pos = distance[i] * invStep;
+			uint32_t lower = (uint32_t)pos;
+			if (lower >= length - 1)
+				break;
+			float t = pos - (float)lower;
+			reflectance[i] += weights[sc] * Lerp(t, pComponent[lower], pComponent[lower + 1]);
 		}
-		oCache[iSigmaCenter] = pGFOutput;
-		pGFOutput = NULL;
 	}
 
-	// Use minErrorSigmaCenter to do fitting
-	//GF_FitSumGaussians(length, &distArray[0], pOutput->pReflectance,
-	//	nTargetSigmas, &sigmas[minErrorSigmaCenter - sigmaNegExtent], &pGFOutput);
-	pGFOutput = oCache[minErrorSigmaCenter];
+	Clock::time_point resampleTime = Clock::now();
+	stats.resampleTime = duration_cast<nanoseconds>(resampleTime - startTime);
 
-	for (int iSigma = minErrorSigmaCenter - sigmaNegExtent;
-		iSigma <= minErrorSigmaCenter + sigmaPosExtent; iSigma++)
-	{
-		coeffs.coeffs[iSigma][sc] =
-			pGFOutput->pNormalizedCoeffs[iSigma - (minErrorSigmaCenter - sigmaNegExtent)];
+	vector<float> fitted(coeffs.sigmas.size(), 0.f);
+	coeffs.error[channel] = FitProfileWindow(fitLength, &distance[0], &reflectance[0],
+		coeffs.sigmas, mfpMin, mfpMax, &fitted[0], stats, &sampleWeights[0]);
+	for (size_t iSigma = 0; iSigma < fitted.size(); iSigma++)
+		coeffs.coeffs[iSigma][channel] = fitted[iSigma];
+	stats.fitTime = duration_cast<nanoseconds>(Clock::now() - resampleTime);
+}
+
+// Weight of each spectral component in the CIE matching functions, square rooted since
+// the interpolation error of the skipped components also matters where the curves are small
+static float componentImportance[SampledSpectrum::nComponents];
+static std::once_flag componentImportanceFlag;
+
+static void InitComponentImportance() {
+	std::call_once(componentImportanceFlag, [] {
+		float delta = (float)(sampledLambdaEnd - sampledLambdaStart) / (float)nSpectralSamples;
+		for (int sc = 0; sc < SampledSpectrum::nComponents; sc++) {
+			float lambda0 = sampledLambdaStart + sc * delta;
+			float lambda1 = lambda0 + delta;
+			componentImportance[sc] = sqrtf(
+				AverageSpectrumSamples(CIE_lambda, CIE_X, nCIESamples, lambda0, lambda1) +
+				AverageSpectrumSamples(CIE_lambda, CIE_Y, nCIESamples, lambda0, lambda1) +
+				AverageSpectrumSamples(CIE_lambda, CIE_Z, nCIESamples, lambda0, lambda1));
+		}
+	});
+}
+
+// Picks the fitted components in increasing order. Both ends are always fitted so the others
+// can be interpolated, the rest are spread evenly over the cumulative importance.
+static vector<int> SelectFittedComponents(int numFittedComponents) {
+	const int nComponents = SampledSpectrum::nComponents;
+	int n = max(2, min(numFittedComponents, nComponents));
+	vector<int> fitted;
+	if (n == nComponents) {
+		for (int sc = 0; sc < nComponents; sc++)
+			fitted.push_back(sc);
+		return fitted;
 	}
-	coeffs.error[sc] = pGFOutput->overallError;
 
-	for (auto& pair : oCache)
-		GF_FreeOutput(pair.second);
+	InitComponentImportance();
+	// Cumulative weight at the center of each component
+	float cdf[SampledSpectrum::nComponents];
+	float total = 0.f;
+	for (int sc = 0; sc < nComponents; sc++) {
+		cdf[sc] = total + 0.5f * componentImportance[sc];
+		total += componentImportance[sc];
+	}
+
+	fitted.push_back(0);
+	for (int k = 1; k < n - 1; k++) {
+		float target = total * (float)k / (float)(n - 1);
+		int sc = (int)(std::lower_bound(cdf, cdf + nComponents, target) - cdf);
+		if (sc > 0 && target - cdf[sc - 1] < cdf[sc] - target)
+			sc--;
+		// Keep the components distinct, leaving room for the ones still to come
+		sc = max(sc, fitted.back() + 1);
+		sc = min(sc, nComponents - n + k);
+		fitted.push_back(sc);
+	}
+	fitted.push_back(nComponents - 1);
+	return fitted;
 }
 
 vector<Task*> CreateGaussianFitTasks(const SkinCoefficients& coeffs, const vector<float>& sigmas,
-	SpectralGaussianCoeffs& sgc)
+	SpectralGaussianCoeffs& sgc, const GaussianFitOptions& options)
 {
-	WLDValue mfp_min(FLT_MAX), mfp_max(0.f);
-	int nTotalTasks = 0;
-	WLDValue mutp_epi = coeffs.mua_epi() + coeffs.musp_epi();
-	WLDValue mutp_derm = coeffs.mua_derm() + coeffs.musp_derm();
-	WLDValue mfp_epi = WLDValue(10) / mutp_epi;
-	WLDValue mfp_derm = WLDValue(10) / mutp_derm;
-	mfp_min = Min(Min(mfp_min, mfp_epi), mfp_derm);
-	mfp_max = Max(Max(mfp_max, mfp_epi), mfp_derm);
-	float minmfp = mfp_min.Min();
-	float maxmfp = mfp_max.Max();
+	return CreateGaussianFitTasks(coeffs.layerCoeffs(), sigmas, sgc, options);
+}
 
+vector<Task*> CreateGaussianFitTasks(const SkinLayerCoeffs& layers, const vector<float>& sigmas,
+	SpectralGaussianCoeffs& sgc, const GaussianFitOptions& options)
+{
 	sgc.sigmas = sigmas;
-
-	SampledSpectrum mua[2] = {
-		coeffs.mua_epi().toSampledSpectrum() / 10.f,
-		coeffs.mua_derm().toSampledSpectrum() / 10.f
-	};
-	SampledSpectrum musp[2] = {
-		coeffs.musp_epi().toSampledSpectrum() / 10.f,
-		coeffs.musp_derm().toSampledSpectrum() / 10.f
-	};
-	float et[2] = { 1.4f, 1.4f };
-	float thickness[2] = {
-		0.25f, 20.f
-	};
+	SkinOptics optics(layers);
 
 	sgc.coeffs.resize(sigmas.size(), SampledSpectrum(0.f));
+	// No tasks run while fits are created
+	if (numCachedProfiles > MAX_CACHED_PROFILES)
+		ClearGaussianTasksCache();
+
 	vector<Task*> tasks;
-	for (int sc = 0; sc < SampledSpectrum::nComponents; sc++) {
-		tasks.push_back(new GaussianFitTask(mua, musp, et, thickness,
-			sgc, sc, 512));
+	vector<int> fitted = SelectFittedComponents(options.numFittedComponents);
+	sgc.stats.assign(SampledSpectrum::nComponents, FitStats());
+	std::shared_ptr<ComponentSeeds> seeds = std::make_shared<ComponentSeeds>();
+	for (int sc : fitted) {
+		sgc.stats[sc].fitted = true;
+		tasks.push_back(new GaussianFitTask(optics, sgc, sc, options, seeds));
 	}
 	return tasks;
 }
 
+vector<Task*> CreateProfileTasks(const SkinLayerCoeffs& layers, SpectralProfiles& profiles,
+	const GaussianFitOptions& options)
+{
+	SkinOptics optics(layers);
+	profiles.fitted = SelectFittedComponents(options.numFittedComponents);
+	profiles.length = options.desiredLength;
+	profiles.stepSize.assign(SampledSpectrum::nComponents, 0.f);
+	profiles.reflectance.assign(SampledSpectrum::nComponents * profiles.length, 0.f);
+	profiles.mfpMin.assign(SampledSpectrum::nComponents, 0.f);
+	profiles.mfpMax.assign(SampledSpectrum::nComponents, 0.f);
+	profiles.stats.assign(SampledSpectrum::nComponents, FitStats());
+	for (int sc : profiles.fitted) {
+		profiles.stats[sc].fitted = true;
+		// Each component spans as many mean free paths as in CreateGaussianFitTasks
+		float mfpMean;
+		optics.meanFreePaths(sc, profiles.mfpMin[sc], profiles.mfpMax[sc], mfpMean);
+		profiles.stepSize[sc] = 12.f * mfpMean / (float)profiles.length;
+	}
+
+	if (numCachedProfiles > MAX_CACHED_PROFILES)
+		ClearGaussianTasksCache();
+
+	vector<Task*> tasks;
+	for (int sc : profiles.fitted)
+		tasks.push_back(new ComponentProfileTask(optics, profiles, sc, options.profileEngine));
+	return tasks;
+}
+
+vector<Task*> CreateRGBFitTasks(const SpectralProfiles& profiles, const vector<float>& sigmas,
+	RGBGaussianCoeffs& rgc)
+{
+	rgc.sigmas = sigmas;
+	rgc.coeffs.assign(sigmas.size(), RGBSpectrum(0.f));
+	rgc.error = RGBSpectrum(0.f);
+	rgc.stats.assign(3, FitStats());
+
+	vector<Task*> tasks;
+	for (int channel = 0; channel < 3; channel++) {
+		rgc.stats[channel].fitted = true;
+		tasks.push_back(new RGBFitTask(profiles, rgc, channel));
+	}
+	return tasks;
+}
+
+void SpectralToRGBProfile(const SpectralGaussianCoeffs& sgc, float* profile) {
+	int nSigmas = (int)sgc.sigmas.size();
+	vector<float> rgb(3 * nSigmas);
+	SampledSpectrum::ToRGB(&sgc.coeffs[0], nSigmas, &rgb[0]);
+	for (int sid = 0; sid < nSigmas; sid++) {
+		for (int channel = 0; channel < 3; channel++)
+			profile[channel * nSigmas + sid] = rgb[3 * sid + channel];
+	}
+}
+
+void FillSkippedComponents(SpectralGaussianCoeffs& sgc, int numFittedComponents) {
+	vector<int> fitted = SelectFittedComponents(numFittedComponents);
+	for (size_t i = 0; i + 1 < fitted.size(); i++) {
+		int lower = fitted[i];
+		int upper = fitted[i + 1];
+		// Lerp between the fitted neighbours in wavelength
+		for (int sc = lower + 1; sc < upper; sc++) {
+			float t = (float)(sc - lower) / (float)(upper - lower);
+			for (SampledSpectrum& coeff : sgc.coeffs)
+				coeff[sc] = Lerp(t, coeff[lower], coeff[upper]);
+			sgc.error[sc] = Lerp(t, sgc.error[lower], sgc.error[upper]);
+		}
+	}
+}
+
 void DestroyGaussianTasks(vector<Task*>& tasks) {
 	for (Task* task : tasks)
 		delete task;
@@ -211,6 +675,7 @@ void DestroyGaussianTasks(vector<Task*>& tasks) {
 
 void ClearGaussianTasksCache() {
 	MPC_ClearCache();
+	numCachedProfiles = 0;
 }
 
 } // namespace ProfileFit
@@ -0,0 +1,550 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Diffusion profiles of layered slabs by the multipole model
+ */
+
+#include "stdafx.h"
+
+#include "MultipoleProfileCalculator.h"
+#include "ssemath.h"
+#include "PbrtUtils/types.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+using namespace ProfileFit;
+using namespace PbrtUtils;
+
+// Each layer is evaluated by the multipole model of Donner and Jensen 2005 in
+// the frequency domain, where stacking layers multiplies their profiles instead
+// of convolving them. The stack is transformed back once.
+//
+// MPC_ENGINE_SPATIAL sums the poles over distance and transforms the profiles of
+// each layer. A pole at depth z, z (1 + sigma_tr d) exp(-sigma_tr d) / d^3 with
+// d = sqrt(r^2 + z^2), transforms to 2 pi sign(z) exp(-|z| s) with
+// s = sqrt(sigma_tr^2 + k^2). The poles of a slab repeat every period, so
+// MPC_ENGINE_FREQUENCY sums all of them as geometric series instead.
+//
+// The transforms are the quasi-discrete Hankel transform of Guizar-Sicairos and
+// Gutierrez-Vega 2004. A profile is taken to vanish beyond R and is sampled at
+// r_i = j_i R / S, where j_i is the i-th zero of J0 and S = j_{n+1}; its spectrum
+// follows at k_m = j_m / R. Scaled by R, both grids and all kernels only depend
+// on the number of samples.
+
+namespace {
+
+const float PI = 3.14159265358979f;
+
+// Profiles are transformed over this many times the requested distance, so the
+// truncated tails do not ring back into the output
+const uint32_t PADDING_FACTOR = 2;
+
+// Image sources that contribute less than exp(-POLE_EXTINCTION) are left out
+const float POLE_EXTINCTION = 20.f;
+const int MAX_DIPOLE_PAIRS = 64;
+
+// Polynomial approximations from Abramowitz and Stegun 9.4.1 and 9.4.3,
+// absolute error below 1e-7
+double BesselJ0(double x) {
+	x = abs(x);
+	if (x <= 3.0) {
+		double y = (x / 3.0) * (x / 3.0);
+		return 1.0 + y * (-2.2499997 + y * (1.2656208 + y * (-0.3163866
+			+ y * (0.0444479 + y * (-0.0039444 + y * 0.0002100)))));
+	}
+	double u = 3.0 / x;
+	double f0 = 0.79788456 + u * (-0.00000077 + u * (-0.00552740 + u * (-0.00009512
+		+ u * (0.00137237 + u * (-0.00072805 + u * 0.00014476)))));
+	double theta0 = x - 0.78539816 + u * (-0.04166397 + u * (-0.00003954 + u * (0.00262573
+		+ u * (-0.00054125 + u * (-0.00029333 + u * 0.00013558)))));
+	return f0 * cos(theta0) / sqrt(x);
+}
+
+// Abramowitz and Stegun 9.4.4 and 9.4.6, for x >= 0
+double BesselJ1(double x) {
+	if (x <= 3.0) {
+		double y = (x / 3.0) * (x / 3.0);
+		return x * (0.5 + y * (-0.56249985 + y * (0.21093573 + y * (-0.03954289
+			+ y * (0.00443319 + y * (-0.00031761 + y * 0.00001109))))));
+	}
+	double u = 3.0 / x;
+	double f1 = 0.79788456 + u * (0.00000156 + u * (0.01659667 + u * (0.00017105
+		+ u * (-0.00249511 + u * (0.00113653 + u * -0.00020033)))));
+	double theta1 = x - 2.35619449 + u * (0.12499612 + u * (0.00005650 + u * (-0.00637879
+		+ u * (0.00074348 + u * (0.00079824 + u * -0.00029166)))));
+	return f1 * cos(theta1) / sqrt(x);
+}
+
+// i-th positive zero of J0, counting from 1
+double BesselJ0Zero(uint32_t i) {
+	// McMahon's expansion, then Newton steps
+	double beta = ((double)i - 0.25) * 3.14159265358979;
+	double zero = beta + 1.0 / (8.0 * beta) - 124.0 / (3.0 * pow(8.0 * beta, 3.0));
+	for (int iteration = 0; iteration < 3; iteration++)
+		zero += BesselJ0(zero) / BesselJ1(zero);
+	return zero;
+}
+
+// Grids and kernels of the transforms of n samples, rows zero padded to a
+// multiple of four
+class HankelKernel {
+public:
+	// The output is sampled at length distances evenly spaced over R / PADDING_FACTOR
+	explicit HankelKernel(uint32_t length)
+		: n(length * PADDING_FACTOR), stride((n + 3) & ~3u), length(length),
+		sampleRadii(stride, 0.f), sampleFrequencies(stride, 0.f), forwardWeights(n), inverseWeights(n),
+		forwardKernel(n * stride, 0.f), inverseKernel(length * stride, 0.f)
+	{
+		vector<double> zeros(n);
+		for (uint32_t i = 0; i < n; i++)
+			zeros[i] = BesselJ0Zero(i + 1);
+		double S = BesselJ0Zero(n + 1);
+		for (uint32_t i = 0; i < n; i++) {
+			double J1 = BesselJ1(zeros[i]);
+			sampleRadii[i] = (float)(zeros[i] / S);
+			sampleFrequencies[i] = (float)zeros[i];
+			forwardWeights[i] = (float)(4.0 * 3.14159265358979 / (S * S * J1 * J1));
+			inverseWeights[i] = (float)(1.0 / (3.14159265358979 * J1 * J1));
+		}
+		for (uint32_t m = 0; m < n; m++) {
+			for (uint32_t i = m; i < n; i++) {
+				float value = (float)BesselJ0(zeros[m] * zeros[i] / S);
+				forwardKernel[m * stride + i] = value;
+				forwardKernel[i * stride + m] = value;
+			}
+		}
+		for (uint32_t j = 0; j < length; j++) {
+			for (uint32_t m = 0; m < n; m++)
+				inverseKernel[j * stride + m] = (float)BesselJ0(zeros[m] * j / n);
+		}
+	}
+
+	uint32_t size() const { return n; }
+	uint32_t rowStride() const { return stride; }
+	uint32_t outputLength() const { return length; }
+	// r_i / R
+	const float* radii() const { return &sampleRadii[0]; }
+	// k_m R
+	const float* frequencies() const { return &sampleFrequencies[0]; }
+
+	// 2 pi integral of f(r) J0(k_m r) r dr, from f(r_i)
+	void forward(const float* profile, float R, float* spectrum) const {
+		vector<float> weighted(stride, 0.f);
+		for (uint32_t i = 0; i < n; i++)
+			weighted[i] = profile[i] * forwardWeights[i] * R * R;
+		for (uint32_t m = 0; m < n; m++)
+			spectrum[m] = Dot(&forwardKernel[m * stride], &weighted[0]);
+	}
+
+	// Prepares F(k_m) for inverseAt, weighted holds rowStride values
+	void weighInverse(const float* spectrum, float R, float* weighted) const {
+		for (uint32_t m = 0; m < n; m++)
+			weighted[m] = spectrum[m] * inverseWeights[m] / (R * R);
+		for (uint32_t m = n; m < stride; m++)
+			weighted[m] = 0.f;
+	}
+
+	// 1 / (2 pi) integral of F(k) J0(k r) k dk at output distance j
+	float inverseAt(const float* weighted, uint32_t j) const {
+		return Dot(&inverseKernel[j * stride], weighted);
+	}
+
+private:
+	uint32_t n;
+	uint32_t stride;
+	uint32_t length;
+	vector<float> sampleRadii;
+	vector<float> sampleFrequencies;
+	vector<float> forwardWeights;
+	vector<float> inverseWeights;
+	// J0(j_m j_i / S), symmetric
+	vector<float> forwardKernel;
+	// J0(j_m r_j / R) at the output distances
+	vector<float> inverseKernel;
+
+	float Dot(const float* row, const float* v) const {
+		__m128 sum0 = _mm_setzero_ps();
+		__m128 sum1 = _mm_setzero_ps();
+		uint32_t i = 0;
+		for (; i + 8 <= stride; i += 8) {
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(row + i), _mm_loadu_ps(v + i)));
+			sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(row + i + 4), _mm_loadu_ps(v + i + 4)));
+		}
+		if (i < stride)
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(row + i), _mm_loadu_ps(v + i)));
+		return hsum_ps(_mm_add_ps(sum0, sum1));
+	}
+};
+
+// Diffuse Fresnel reflectance of Egan and Hilgeman
+float FresnelDiffuseReflectance(float eta) {
+	return -1.440f / (eta * eta) + 0.710f / eta + 0.668f + 0.0636f * eta;
+}
+
+// Adds the flux of a dipole pole at depth z to profile,
+// scale * z (1 + sigma_tr d) exp(-sigma_tr d) / d^3 with d = sqrt(r^2 + z^2)
+void AddPole(float z, float sigma_tr, float scale, const float* distSq, uint32_t n, float* profile) {
+	__m128 zz = _mm_set1_ps(z * z);
+	__m128 st = _mm_set1_ps(sigma_tr);
+	__m128 one = _mm_set1_ps(1.f);
+	__m128 s = _mm_set1_ps(scale * z);
+	// n is padded to a multiple of four by the caller
+	for (uint32_t j = 0; j < n; j += 4) {
+		__m128 dSq = _mm_add_ps(_mm_loadu_ps(distSq + j), zz);
+		__m128 d = _mm_sqrt_ps(dSq);
+		__m128 sd = _mm_mul_ps(st, d);
+		__m128 flux = _mm_mul_ps(_mm_add_ps(one, sd), exp_ps(_mm_sub_ps(_mm_setzero_ps(), sd)));
+		// Keeps a pole on the surface from dividing zero by zero
+		__m128 dCubed = _mm_max_ps(_mm_mul_ps(dSq, d), _mm_set1_ps(FLT_MIN));
+		flux = _mm_div_ps(_mm_mul_ps(s, flux), dCubed);
+		_mm_storeu_ps(profile + j, _mm_add_ps(_mm_loadu_ps(profile + j), flux));
+	}
+}
+
+struct Multipole {
+	float alpha_p;
+	float sigma_tr;
+	float zr;
+	float zb;
+	float thickness;
+	// The poles repeat every 2 (d + 2 zb), each further away than the last
+	float period;
+
+	explicit Multipole(const MPC_LayerSpec& ls) {
+		float sigma_tp = ls.mua + ls.musp;
+		alpha_p = ls.musp / sigma_tp;
+		sigma_tr = sqrt(3.f * ls.mua * sigma_tp);
+		zr = 1.f / sigma_tp;
+		float Fdr = FresnelDiffuseReflectance(ls.ior);
+		float A = (1.f + Fdr) / (1.f - Fdr);
+		zb = 2.f * A / (3.f * sigma_tp);
+		thickness = ls.thickness;
+		period = 2.f * (thickness + 2.f * zb);
+	}
+};
+
+// Reflectance and transmittance of a slab at the given squared distances
+void ComputeMultipole(const Multipole& mp, const float* distSq, uint32_t n,
+	float* reflectance, float* transmittance)
+{
+	int numPairs = MAX_DIPOLE_PAIRS;
+	if (mp.sigma_tr * mp.period > 0.f)
+		numPairs = min(numPairs, (int)ceil(POLE_EXTINCTION / (mp.sigma_tr * mp.period)));
+
+	float d = mp.thickness;
+	float scale = mp.alpha_p / (4.f * PI);
+	for (int i = -numPairs; i <= numPairs; i++) {
+		float zr_i = (float)i * mp.period + mp.zr;
+		float zv_i = (float)i * mp.period - mp.zr - 2.f * mp.zb;
+		AddPole(zr_i, mp.sigma_tr, scale, distSq, n, reflectance);
+		AddPole(zv_i, mp.sigma_tr, -scale, distSq, n, reflectance);
+		AddPole(d - zr_i, mp.sigma_tr, scale, distSq, n, transmittance);
+		AddPole(d - zv_i, mp.sigma_tr, -scale, distSq, n, transmittance);
+	}
+}
+
+// Sum of sign(z) exp(-|z| s) over the poles z = offset + i period of all integers i,
+// for the four s. q is exp(-period s).
+inline __m128 SumPoleSeries(float offset, float period, __m128 s, __m128 q) {
+	// Shift to the pole in [0, period), the ones above it are positive and the
+	// ones below negative
+	float lowest = offset - period * floor(offset / period);
+	__m128 above = exp_ps(_mm_mul_ps(_mm_set1_ps(-lowest), s));
+	__m128 below = exp_ps(_mm_mul_ps(_mm_set1_ps(lowest - period), s));
+	__m128 sum = _mm_sub_ps(above, below);
+	__m128 denom = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.f), q), _mm_set1_ps(1e-7f));
+	return _mm_div_ps(sum, denom);
+}
+
+// Transforms of the reflectance and transmittance of a slab at the frequencies k,
+// with every pole
+void ComputeMultipoleSpectrum(const Multipole& mp, const float* k, uint32_t n,
+	float* reflectance, float* transmittance)
+{
+	float d = mp.thickness;
+	__m128 sigma_trSq = _mm_set1_ps(mp.sigma_tr * mp.sigma_tr);
+	__m128 scale = _mm_set1_ps(mp.alpha_p / 2.f);
+	// n is padded to a multiple of four by the caller
+	for (uint32_t m = 0; m < n; m += 4) {
+		__m128 km = _mm_loadu_ps(k + m);
+		__m128 s = _mm_sqrt_ps(_mm_add_ps(sigma_trSq, _mm_mul_ps(km, km)));
+		__m128 q = exp_ps(_mm_mul_ps(_mm_set1_ps(-mp.period), s));
+		__m128 R = _mm_sub_ps(SumPoleSeries(mp.zr, mp.period, s, q),
+			SumPoleSeries(-mp.zr - 2.f * mp.zb, mp.period, s, q));
+		__m128 T = _mm_sub_ps(SumPoleSeries(d - mp.zr, mp.period, s, q),
+			SumPoleSeries(d + mp.zr + 2.f * mp.zb, mp.period, s, q));
+		_mm_storeu_ps(reflectance + m, _mm_mul_ps(scale, R));
+		_mm_storeu_ps(transmittance + m, _mm_mul_ps(scale, T));
+	}
+}
+
+// Everything a layer transform depends on, compared bytewise
+struct LayerKey {
+	MPC_LayerSpec spec;
+	uint32_t length;
+	float stepSize;
+	uint32_t lerpOnThinSlab;
+	uint32_t engine;
+
+	bool operator<(const LayerKey& other) const {
+		return memcmp(this, &other, sizeof(LayerKey)) < 0;
+	}
+};
+
+// Profiles of a single layer in the frequency domain
+struct LayerTransform {
+	vector<float> reflectance;
+	vector<float> transmittance;
+};
+
+shared_ptr<const LayerTransform> ComputeLayerTransform(const MPC_LayerSpec& ls,
+	const HankelKernel& kernel, float R, const MPC_Options& options)
+{
+	uint32_t n = kernel.size();
+	uint32_t paddedLength = kernel.rowStride();
+	Multipole mp(ls);
+	shared_ptr<LayerTransform> transform = make_shared<LayerTransform>();
+	if (options.engine == MPC_ENGINE_FREQUENCY) {
+		vector<float> k(paddedLength);
+		for (uint32_t m = 0; m < paddedLength; m++)
+			k[m] = kernel.frequencies()[m] / R;
+		transform->reflectance.resize(paddedLength);
+		transform->transmittance.resize(paddedLength);
+		ComputeMultipoleSpectrum(mp, &k[0], paddedLength,
+			&transform->reflectance[0], &transform->transmittance[0]);
+		transform->reflectance.resize(n);
+		transform->transmittance.resize(n);
+	} else {
+		vector<float> distSq(paddedLength);
+		for (uint32_t i = 0; i < paddedLength; i++)
+			distSq[i] = kernel.radii()[i] * R * kernel.radii()[i] * R;
+		vector<float> reflectance(paddedLength, 0.f), transmittance(paddedLength, 0.f);
+		ComputeMultipole(mp, &distSq[0], paddedLength, &reflectance[0], &transmittance[0]);
+		transform->reflectance.resize(n);
+		transform->transmittance.resize(n);
+		kernel.forward(&reflectance[0], R, &transform->reflectance[0]);
+		kernel.forward(&transmittance[0], R, &transform->transmittance[0]);
+	}
+
+	float opticalDepth = (ls.mua + ls.musp) * ls.thickness;
+	if (options.lerpOnThinSlab && opticalDepth < 1.f) {
+		// A slab that does not scatter reflects nothing and lets the attenuated
+		// light through where it entered
+		float t = opticalDepth;
+		float unscattered = exp(-ls.mua * ls.thickness);
+		for (uint32_t m = 0; m < n; m++) {
+			transform->reflectance[m] *= t;
+			transform->transmittance[m] = Lerp(t, unscattered, transform->transmittance[m]);
+		}
+	}
+	return transform;
+}
+
+// Rows of the inverse transform evaluated before the adaptive refinement
+const uint32_t ADAPTIVE_COARSE_STRIDE = 16;
+
+// Evaluates the rows of the inverse transform needed to lerp the profile within
+// tolerance of its peak. Intervals between every ADAPTIVE_COARSE_STRIDE-th row are
+// bisected for as long as their midpoint is off the lerp of their ends.
+void InverseAdaptively(const HankelKernel& kernel, const float* weighted, float tolerance,
+	float* profile, vector<bool>& sampled)
+{
+	uint32_t last = kernel.outputLength() - 1;
+	vector<uint32_t> coarse;
+	for (uint32_t j = 0; j < last; j += ADAPTIVE_COARSE_STRIDE)
+		coarse.push_back(j);
+	coarse.push_back(last);
+
+	sampled.assign(last + 1, false);
+	float peak = 0.f;
+	for (uint32_t j : coarse) {
+		// Ringing of the truncated transform
+		profile[j] = max(kernel.inverseAt(weighted, j), 0.f);
+		sampled[j] = true;
+		peak = max(peak, profile[j]);
+	}
+	vector<pair<uint32_t, uint32_t> > intervals;
+	for (size_t i = 0; i + 1 < coarse.size(); i++)
+		intervals.push_back(make_pair(coarse[i], coarse[i + 1]));
+
+	float threshold = tolerance * peak;
+	while (!intervals.empty()) {
+		uint32_t a = intervals.back().first;
+		uint32_t b = intervals.back().second;
+		intervals.pop_back();
+		if (b - a < 2)
+			continue;
+		uint32_t mid = (a + b) / 2;
+		profile[mid] = max(kernel.inverseAt(weighted, mid), 0.f);
+		sampled[mid] = true;
+		float t = (float)(mid - a) / (float)(b - a);
+		if (abs(profile[mid] - Lerp(t, profile[a], profile[b])) > threshold) {
+			intervals.push_back(make_pair(a, mid));
+			intervals.push_back(make_pair(mid, b));
+		}
+	}
+}
+
+mutex cacheMutex;
+map<uint32_t, shared_ptr<const HankelKernel> > kernelCache;
+map<LayerKey, shared_ptr<const LayerTransform> > layerCache;
+
+shared_ptr<const HankelKernel> GetHankelKernel(uint32_t length) {
+	lock_guard<mutex> lock(cacheMutex);
+	shared_ptr<const HankelKernel>& kernel = kernelCache[length];
+	if (!kernel)
+		kernel = make_shared<HankelKernel>(length);
+	return kernel;
+}
+
+shared_ptr<const LayerTransform> GetLayerTransform(const MPC_LayerSpec& ls,
+	const MPC_Options& options, const HankelKernel& kernel)
+{
+	LayerKey key;
+	memset(&key, 0, sizeof(key));
+	key.spec = ls;
+	key.length = kernel.outputLength();
+	key.stepSize = options.desiredStepSize;
+	key.lerpOnThinSlab = options.lerpOnThinSlab ? 1 : 0;
+	key.engine = options.engine;
+	{
+		lock_guard<mutex> lock(cacheMutex);
+		auto iter = layerCache.find(key);
+		if (iter != layerCache.end())
+			return iter->second;
+	}
+	// Computed outside the lock, a concurrent miss on the same layer only costs time
+	shared_ptr<const LayerTransform> transform =
+		ComputeLayerTransform(ls, kernel, kernel.size() * options.desiredStepSize, options);
+	lock_guard<mutex> lock(cacheMutex);
+	layerCache[key] = transform;
+	return transform;
+}
+
+} // namespace
+
+void MPC_ComputeDiffusionProfile(uint32_t numLayers, const MPC_LayerSpec* pLayerSpecs,
+	const MPC_Options* pOptions, MPC_Output** ppOutput)
+{
+	Assert(numLayers > 0 && pOptions->desiredLength > 0 && pOptions->desiredStepSize > 0.f);
+	uint32_t length = pOptions->desiredLength;
+	float step = pOptions->desiredStepSize;
+	shared_ptr<const HankelKernel> kernel = GetHankelKernel(length);
+	uint32_t n = kernel->size();
+
+	// Reflectance from above and below and transmittance of the layers added so far
+	shared_ptr<const LayerTransform> top = GetLayerTransform(pLayerSpecs[0], *pOptions, *kernel);
+	vector<float> reflectance(top->reflectance);
+	vector<float> reflectanceBelow(top->reflectance);
+	vector<float> transmittance(top->transmittance);
+	for (uint32_t layer = 1; layer < numLayers; layer++) {
+		shared_ptr<const LayerTransform> next = GetLayerTransform(pLayerSpecs[layer], *pOptions, *kernel);
+		for (uint32_t m = 0; m < n; m++) {
+			float R = next->reflectance[m];
+			float T = next->transmittance[m];
+			// Light bouncing between the stack and the next layer
+			float bounces = 1.f / max(1.f - reflectanceBelow[m] * R, 1e-6f);
+			reflectance[m] += transmittance[m] * R * transmittance[m] * bounces;
+			reflectanceBelow[m] = R + T * reflectanceBelow[m] * T * bounces;
+			transmittance[m] *= T * bounces;
+		}
+	}
+
+	vector<float> weighted(kernel->rowStride());
+	kernel->weighInverse(&reflectance[0], n * step, &weighted[0]);
+	vector<float> profile(length);
+	vector<bool> sampled(length, true);
+	if (pOptions->adaptiveTolerance > 0.f) {
+		InverseAdaptively(*kernel, &weighted[0], pOptions->adaptiveTolerance, &profile[0], sampled);
+	} else {
+		for (uint32_t j = 0; j < length; j++) {
+			// Ringing of the truncated transform
+			profile[j] = max(kernel->inverseAt(&weighted[0], j), 0.f);
+		}
+	}
+
+	MPC_Output* pOutput = new MPC_Output;
+	pOutput->length = (uint32_t)std::count(sampled.begin(), sampled.end(), true);
+	pOutput->pDistanceSquared = new float[pOutput->length];
+	pOutput->pReflectance = new float[pOutput->length];
+	uint32_t i = 0;
+	for (uint32_t j = 0; j < length; j++) {
+		if (!sampled[j])
+			continue;
+		pOutput->pDistanceSquared[i] = (float)j * step * (float)j * step;
+		pOutput->pReflectance[i] = profile[j];
+		i++;
+	}
+	*ppOutput = pOutput;
+}
+
+void MPC_ResampleForUniformDistanceSquaredDistribution(MPC_Output* pOutput, uint32_t desiredLength) {
+	uint32_t length = pOutput->length;
+	Assert(length > 1 && desiredLength > 1);
+	// The input is evenly spaced in distance
+	float step = sqrt(pOutput->pDistanceSquared[1]);
+	float maxDistSq = pOutput->pDistanceSquared[length - 1];
+
+	float* pDistanceSquared = new float[desiredLength];
+	float* pReflectance = new float[desiredLength];
+	for (uint32_t i = 0; i < desiredLength; i++) {
+		float distSq = maxDistSq * (float)i / (float)(desiredLength - 1);
+		float pos = sqrt(distSq) / step;
+		uint32_t lower = min((uint32_t)pos, length - 2);
+		float t = min(pos - (float)lower, 1.f);
+		pDistanceSquared[i] = distSq;
+		pReflectance[i] = Lerp(t, pOutput->pReflectance[lower], pOutput->pReflectance[lower + 1]);
+	}
+
+	delete [] pOutput->pDistanceSquared;
+	delete [] pOutput->pReflectance;
+	pOutput->length = desiredLength;
+	pOutput->pDistanceSquared = pDistanceSquared;
+	pOutput->pReflectance = pReflectance;
+}
+
+void MPC_FreeOutput(MPC_Output* pOutput) {
+	delete [] pOutput->pDistanceSquared;
+	delete [] pOutput->pReflectance;
+	delete pOutput;
+}
+
+void MPC_ClearCache() {
+	lock_guard<mutex> lock(cacheMutex);
+	layerCache.clear();
+}
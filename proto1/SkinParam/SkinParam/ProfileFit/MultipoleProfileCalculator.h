@@ -0,0 +1,93 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Diffusion profiles of layered slabs by the multipole model
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// Optical properties of one layer, lengths in mm. Layers are given top down.
+struct MPC_LayerSpec {
+	// Only the reduced scattering coefficient enters the diffusion approximation,
+	// so g_HG is not used
+	float g_HG;
+	// Relative to the medium around the slab
+	float ior;
+	float mua;
+	float musp;
+	float thickness;
+};
+
+enum MPC_Engine {
+	// Sums the poles of each layer over distance and transforms them
+	MPC_ENGINE_SPATIAL,
+	// Sums all poles of each layer in closed form in the frequency domain, which
+	// is cheaper and does not truncate the series
+	MPC_ENGINE_FREQUENCY
+};
+
+struct MPC_Options {
+	// Number of samples in the profile
+	uint32_t desiredLength;
+	// Layers thinner than a transport mean free path are blended with a slab that
+	// does not scatter, where the diffusion approximation no longer holds
+	bool lerpOnThinSlab;
+	// Distance between two samples
+	float desiredStepSize;
+	MPC_Engine engine;
+	// Samples are left out where the profile is within this fraction of its peak of
+	// the lerp of the samples around them, 0 keeps all of them
+	float adaptiveTolerance;
+};
+
+// Radial reflectance profile, allocated by the calculator and freed by MPC_FreeOutput
+struct MPC_Output {
+	uint32_t length;
+	// Squared distance of each sample from the point of incidence
+	float* pDistanceSquared;
+	float* pReflectance;
+};
+
+// The profile of the whole stack is sampled at desiredLength distances,
+// desiredStepSize apart, starting at 0. With an adaptiveTolerance only some of them
+// are kept, more where the profile bends.
+void MPC_ComputeDiffusionProfile(uint32_t numLayers, const MPC_LayerSpec* pLayerSpecs,
+	const MPC_Options* pOptions, MPC_Output** ppOutput);
+// Resamples the profile at desiredLength squared distances, evenly spaced between 0
+// and the largest one, so that a plain least squares fit weighs it by area. The
+// profile has to be sampled at all distances, without an adaptiveTolerance.
+void MPC_ResampleForUniformDistanceSquaredDistribution(MPC_Output* pOutput, uint32_t desiredLength);
+void MPC_FreeOutput(MPC_Output* pOutput);
+// Profiles of single layers are kept and reused by later calls until cleared
+void MPC_ClearCache();
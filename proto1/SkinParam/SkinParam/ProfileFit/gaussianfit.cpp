@@ -0,0 +1,400 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Non-negative sums of Gaussians fitted to radial profiles
+ */
+
+#include "stdafx.h"
+
+#include "gaussianfit.h"
+#include "ssemath.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+using namespace ProfileFit;
+
+namespace {
+
+const double PI = 3.14159265358979323846;
+
+// Samples are padded to a multiple of two for the SSE2 loops
+uint32_t PaddedLength(uint32_t length) {
+	return (length + 1) & ~1u;
+}
+
+double Dot(const double* a, const double* b, uint32_t paddedLength) {
+	__m128d sum0 = _mm_setzero_pd();
+	__m128d sum1 = _mm_setzero_pd();
+	uint32_t i = 0;
+	for (; i + 4 <= paddedLength; i += 4) {
+		sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+		sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+	}
+	if (i < paddedLength)
+		sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+	return hsum_pd(_mm_add_pd(sum0, sum1));
+}
+
+// Solves the rows and columns of gram selected by passive for x.
+// Gaussian elimination with partial pivoting, the systems are tiny.
+void SolvePassive(const vector<double>& gram, const vector<double>& rhs, const vector<int>& passive,
+	vector<double>& x)
+{
+	int n = (int)rhs.size();
+	int np = (int)passive.size();
+	vector<double> a(np * (np + 1));
+	for (int i = 0; i < np; i++) {
+		for (int j = 0; j < np; j++)
+			a[i * (np + 1) + j] = gram[passive[i] * n + passive[j]];
+		a[i * (np + 1) + np] = rhs[passive[i]];
+	}
+	for (int col = 0; col < np; col++) {
+		int pivot = col;
+		for (int row = col + 1; row < np; row++) {
+			if (abs(a[row * (np + 1) + col]) > abs(a[pivot * (np + 1) + col]))
+				pivot = row;
+		}
+		if (pivot != col) {
+			for (int j = 0; j <= np; j++)
+				swap(a[col * (np + 1) + j], a[pivot * (np + 1) + j]);
+		}
+		double diag = a[col * (np + 1) + col];
+		if (diag == 0.0)
+			continue;
+		for (int row = col + 1; row < np; row++) {
+			double factor = a[row * (np + 1) + col] / diag;
+			for (int j = col; j <= np; j++)
+				a[row * (np + 1) + j] -= factor * a[col * (np + 1) + j];
+		}
+	}
+	x.assign(n, 0.0);
+	for (int i = np - 1; i >= 0; i--) {
+		double sum = a[i * (np + 1) + np];
+		for (int j = i + 1; j < np; j++)
+			sum -= a[i * (np + 1) + j] * x[passive[j]];
+		double diag = a[i * (np + 1) + i];
+		x[passive[i]] = diag != 0.0 ? sum / diag : 0.0;
+	}
+}
+
+// Moves w from the feasible point it holds towards the solution over the passive set,
+// dropping the weights that reach zero on the way, until the solution is feasible
+void SolveFeasible(const vector<double>& gram, const vector<double>& rhs, vector<bool>& isPassive,
+	vector<int>& passive, vector<double>& w)
+{
+	vector<double> z;
+	while (!passive.empty()) {
+		SolvePassive(gram, rhs, passive, z);
+		// Step towards z until the first weight reaches zero
+		double alpha = 1.0;
+		for (int i : passive) {
+			if (z[i] <= 0.0)
+				alpha = min(alpha, w[i] / (w[i] - z[i]));
+		}
+		for (int i : passive)
+			w[i] += alpha * (z[i] - w[i]);
+		if (alpha == 1.0)
+			break;
+		for (size_t p = 0; p < passive.size(); ) {
+			int i = passive[p];
+			if (w[i] <= 0.0) {
+				w[i] = 0.0;
+				isPassive[i] = false;
+				passive.erase(passive.begin() + p);
+			} else {
+				p++;
+			}
+		}
+	}
+}
+
+// Lawson and Hanson's active set method on the normal equations gram w = rhs. The
+// weights of pStart, if given, seed the passive set. The final weights are solved
+// over the passive set in index order, so any seed that ends with the same passive
+// set gives the same weights, bit for bit.
+void SolveNonNegative(const vector<double>& gram, const vector<double>& rhs, vector<double>& w,
+	const vector<double>* pStart = NULL)
+{
+	int n = (int)rhs.size();
+	double tolerance = 0.0;
+	for (int i = 0; i < n; i++)
+		tolerance = max(tolerance, abs(rhs[i]));
+	tolerance *= 1e-12;
+
+	w.assign(n, 0.0);
+	vector<bool> isPassive(n, false);
+	vector<int> passive;
+	if (pStart) {
+		for (int i = 0; i < n; i++) {
+			if ((*pStart)[i] > 0.0) {
+				w[i] = (*pStart)[i];
+				isPassive[i] = true;
+				passive.push_back(i);
+			}
+		}
+		SolveFeasible(gram, rhs, isPassive, passive, w);
+	}
+	for (int iteration = 0; iteration < 3 * n; iteration++) {
+		// Add the weight whose increase lowers the residual the most
+		int best = -1;
+		double bestGradient = tolerance;
+		for (int i = 0; i < n; i++) {
+			if (isPassive[i])
+				continue;
+			double gradient = rhs[i];
+			for (int j = 0; j < n; j++)
+				gradient -= gram[i * n + j] * w[j];
+			if (gradient > bestGradient) {
+				best = i;
+				bestGradient = gradient;
+			}
+		}
+		if (best < 0)
+			break;
+		isPassive[best] = true;
+		passive.push_back(best);
+		SolveFeasible(gram, rhs, isPassive, passive, w);
+	}
+
+	std::sort(passive.begin(), passive.end());
+	vector<double> z;
+	SolvePassive(gram, rhs, passive, z);
+	for (int i = 0; i < n; i++)
+		w[i] = max(z[i], 0.0);
+}
+
+// Gaussians sampled at the profile distances, one column of paddedLength per sigma
+void SampleGaussians(uint32_t length, const float* pDistances, const vector<double>& rowScales,
+	uint32_t numSigmas, const float* pSigmas, vector<double>& columns)
+{
+	uint32_t paddedLength = PaddedLength(length);
+	// The exponentials are taken four at a time in single precision, which is all the
+	// profile has
+	vector<float> negDistSq((length + 3) & ~3u, 0.f);
+	for (uint32_t i = 0; i < length; i++)
+		negDistSq[i] = -pDistances[i] * pDistances[i];
+	columns.assign(numSigmas * paddedLength, 0.0);
+	for (uint32_t k = 0; k < numSigmas; k++) {
+		double variance = (double)pSigmas[k] * pSigmas[k];
+		double norm = 1.0 / (2.0 * PI * variance);
+		__m128 invTwoVariance = _mm_set1_ps((float)(1.0 / (2.0 * variance)));
+		double* column = &columns[k * paddedLength];
+		for (uint32_t i = 0; i < length; i += 4) {
+			float values[4];
+			_mm_storeu_ps(values, exp_ps(_mm_mul_ps(_mm_loadu_ps(&negDistSq[i]), invTwoVariance)));
+			uint32_t count = min(length - i, 4u);
+			for (uint32_t j = 0; j < count; j++)
+				column[i + j] = norm * rowScales[i + j] * values[j];
+		}
+	}
+}
+
+// Normal equations of the least squares fit of the columns to the profile
+void NormalEquations(const vector<double>& columns, const vector<double>& profile, uint32_t numSigmas,
+	vector<double>& gram, vector<double>& rhs)
+{
+	uint32_t paddedLength = (uint32_t)profile.size();
+	gram.resize(numSigmas * numSigmas);
+	rhs.resize(numSigmas);
+	for (uint32_t k = 0; k < numSigmas; k++) {
+		const double* column = &columns[k * paddedLength];
+		for (uint32_t l = 0; l <= k; l++) {
+			double value = Dot(column, &columns[l * paddedLength], paddedLength);
+			gram[k * numSigmas + l] = value;
+			gram[l * numSigmas + k] = value;
+		}
+		rhs[k] = Dot(column, &profile[0], paddedLength);
+	}
+}
+
+// Squared norm of the residual of the weighted columns
+double ResidualNormSq(const vector<double>& profile, const double* pColumns, const vector<double>& weights) {
+	uint32_t paddedLength = (uint32_t)profile.size();
+	vector<double> residual(profile);
+	for (size_t k = 0; k < weights.size(); k++) {
+		if (weights[k] == 0.0)
+			continue;
+		__m128d w = _mm_set1_pd(weights[k]);
+		const double* column = pColumns + k * paddedLength;
+		for (uint32_t i = 0; i < paddedLength; i += 2) {
+			__m128d fitted = _mm_mul_pd(w, _mm_loadu_pd(column + i));
+			_mm_storeu_pd(&residual[i], _mm_sub_pd(_mm_loadu_pd(&residual[i]), fitted));
+		}
+	}
+	return Dot(&residual[0], &residual[0], paddedLength);
+}
+
+// Profile scaled by the root of the sample weights, and the scales
+void ScaleProfile(uint32_t length, const float* pReflectance, const float* pSampleWeights,
+	vector<double>& rowScales, vector<double>& profile)
+{
+	// Weighted least squares is plain least squares on rows scaled by the root of the weights
+	rowScales.assign(length, 1.0);
+	if (pSampleWeights) {
+		for (uint32_t i = 0; i < length; i++)
+			rowScales[i] = sqrt((double)pSampleWeights[i]);
+	}
+	profile.assign(PaddedLength(length), 0.0);
+	for (uint32_t i = 0; i < length; i++)
+		profile[i] = rowScales[i] * pReflectance[i];
+}
+
+GF_Output* NewOutput(double residualNormSq, double profileNormSq, const vector<double>& weights) {
+	GF_Output* pOutput = new GF_Output;
+	pOutput->overallError = profileNormSq > 0.0 ? (float)sqrt(residualNormSq / profileNormSq) : 0.f;
+	pOutput->pNormalizedCoeffs = new float[weights.size()];
+	for (size_t k = 0; k < weights.size(); k++)
+		pOutput->pNormalizedCoeffs[k] = (float)weights[k];
+	return pOutput;
+}
+
+} // namespace
+
+void GF_FitSumGaussians(uint32_t length, const float* pDistances, const float* pReflectance,
+	uint32_t numSigmas, const float* pSigmas, GF_Output** ppOutput, const float* pSampleWeights)
+{
+	vector<double> rowScales, profile;
+	ScaleProfile(length, pReflectance, pSampleWeights, rowScales, profile);
+	vector<double> columns;
+	SampleGaussians(length, pDistances, rowScales, numSigmas, pSigmas, columns);
+	vector<double> gram, rhs;
+	NormalEquations(columns, profile, numSigmas, gram, rhs);
+
+	vector<double> weights;
+	SolveNonNegative(gram, rhs, weights);
+
+	double profileNormSq = Dot(&profile[0], &profile[0], (uint32_t)profile.size());
+	*ppOutput = NewOutput(ResidualNormSq(profile, &columns[0], weights), profileNormSq, weights);
+}
+
+void GF_FitBestWindow(uint32_t length, const float* pDistances, const float* pReflectance,
+	uint32_t numSigmas, const float* pSigmas, uint32_t windowSigmas, uint32_t firstWindow,
+	uint32_t numWindows, const float* pStartCoeffs, uint32_t* pBestWindow, GF_Output** ppOutput,
+	const float* pSampleWeights)
+{
+	// The windows overlap, the Gaussians and normal equations of all their sigmas are
+	// computed once and the windows take their blocks
+	numWindows = min(numWindows, numSigmas - windowSigmas + 1 - firstWindow);
+	uint32_t paddedLength = PaddedLength(length);
+	uint32_t spanSigmas = numWindows + windowSigmas - 1;
+	vector<double> rowScales, profile;
+	ScaleProfile(length, pReflectance, pSampleWeights, rowScales, profile);
+	vector<double> columns;
+	SampleGaussians(length, pDistances, rowScales, spanSigmas, pSigmas + firstWindow, columns);
+	vector<double> spanGram, spanRhs;
+	NormalEquations(columns, profile, spanSigmas, spanGram, spanRhs);
+	double profileNormSq = Dot(&profile[0], &profile[0], paddedLength);
+
+	// Start at the window that holds the most of the seed, then go outwards from it
+	vector<double> seed(spanSigmas, 0.0);
+	uint32_t startWindow = 0;
+	if (pStartCoeffs) {
+		for (uint32_t k = 0; k < spanSigmas; k++)
+			seed[k] = max((double)pStartCoeffs[firstWindow + k], 0.0);
+		double bestSum = 0.0;
+		for (uint32_t window = 0; window < numWindows; window++) {
+			double sum = 0.0;
+			for (uint32_t k = 0; k < windowSigmas; k++)
+				sum += seed[window + k];
+			if (sum > bestSum) {
+				bestSum = sum;
+				startWindow = window;
+			}
+		}
+	}
+	vector<uint32_t> order(1, startWindow);
+	for (uint32_t step = 1; order.size() < numWindows; step++) {
+		if (startWindow >= step)
+			order.push_back(startWindow - step);
+		if (startWindow + step < numWindows)
+			order.push_back(startWindow + step);
+	}
+
+	vector<double> gram(windowSigmas * windowSigmas), rhs(windowSigmas);
+	vector<double> start(windowSigmas), weights, bestWeights;
+	double bestResidualNormSq = 0.0;
+	float bestError = 0.f;
+	uint32_t bestWindow = numWindows;
+	for (uint32_t window : order) {
+		for (uint32_t k = 0; k < windowSigmas; k++) {
+			for (uint32_t l = 0; l < windowSigmas; l++)
+				gram[k * windowSigmas + l] = spanGram[(window + k) * spanSigmas + window + l];
+			rhs[k] = spanRhs[window + k];
+		}
+
+		// Seeded with the last fit, or the given coefficients at first
+		for (uint32_t k = 0; k < windowSigmas; k++)
+			start[k] = seed[window + k];
+		SolveNonNegative(gram, rhs, weights, &start);
+		for (uint32_t k = 0; k < windowSigmas; k++)
+			seed[window + k] = weights[k];
+
+		if (bestWindow < numWindows) {
+			// The weights are solved either way, on the normal equations that costs less
+			// than a pass over the profile. The residual follows from them too, within
+			// about 1e-15 of the profile norm for non-negative weights, and the pass is
+			// skipped when even the lower bound of that is worse than the best, by a
+			// margin that keeps every window within a float of the best error. The
+			// unconstrained least squares residual would bound a window before its solve,
+			// but from the normal equations it cancels to well above the true residual.
+			double estimate = profileNormSq;
+			for (uint32_t k = 0; k < windowSigmas; k++) {
+				double gramWeights = 0.0;
+				for (uint32_t l = 0; l < windowSigmas; l++)
+					gramWeights += gram[k * windowSigmas + l] * weights[l];
+				estimate += weights[k] * (gramWeights - 2.0 * rhs[k]);
+			}
+			double lowerBound = estimate - 1e-12 * profileNormSq;
+			if (lowerBound > bestResidualNormSq * (1.0 + 1e-6))
+				continue;
+		}
+		double residualNormSq = ResidualNormSq(profile, &columns[window * paddedLength], weights);
+		float error = profileNormSq > 0.0 ? (float)sqrt(residualNormSq / profileNormSq) : 0.f;
+		// Ties go to the first window, whatever the order they were tried in
+		if (bestWindow == numWindows || error < bestError || (error == bestError && window < bestWindow)) {
+			bestWindow = window;
+			bestError = error;
+			bestResidualNormSq = residualNormSq;
+			bestWeights = weights;
+		}
+	}
+
+	*pBestWindow = firstWindow + bestWindow;
+	*ppOutput = NewOutput(bestResidualNormSq, profileNormSq, bestWeights);
+}
+
+void GF_FreeOutput(GF_Output* pOutput) {
+	delete [] pOutput->pNormalizedCoeffs;
+	delete pOutput;
+}
@@ -0,0 +1,68 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Non-negative sums of Gaussians fitted to radial profiles
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Allocated by the fit and freed by GF_FreeOutput
+struct GF_Output {
+	// Residual relative to the profile, sqrt(sum (fit - profile)^2 / sum profile^2)
+	float overallError;
+	// Weight of each Gaussian exp(-r^2 / (2 sigma^2)) / (2 pi sigma^2), which
+	// integrates to one over the plane
+	float* pNormalizedCoeffs;
+};
+
+// Least squares fit of numSigmas Gaussians with non-negative weights to the profile
+// sampled at pDistances. Samples are weighted by pSampleWeights, or alike without them,
+// see MPC_ResampleForUniformDistanceSquaredDistribution. The error is weighted the same.
+void GF_FitSumGaussians(uint32_t length, const float* pDistances, const float* pReflectance,
+	uint32_t numSigmas, const float* pSigmas, GF_Output** ppOutput,
+	const float* pSampleWeights = NULL);
+// Fits windows of windowSigmas consecutive sigmas, those starting at firstWindow to
+// firstWindow + numWindows - 1, and keeps the window with the smallest error, ties going
+// to the first. Gives the window and the output of GF_FitSumGaussians on it, bit for bit,
+// at a fraction of the cost of fitting every window: the Gaussians and normal equations
+// are computed once, each window's weights are solved starting from the last ones, and the
+// residual over the profile is only evaluated for windows that may beat the best.
+// pStartCoeffs, one per sigma or NULL, seeds the first fit and picks the window tried
+// first, e.g. with the fit of a similar profile. It changes the cost, not the result.
+void GF_FitBestWindow(uint32_t length, const float* pDistances, const float* pReflectance,
+	uint32_t numSigmas, const float* pSigmas, uint32_t windowSigmas, uint32_t firstWindow,
+	uint32_t numWindows, const float* pStartCoeffs, uint32_t* pBestWindow, GF_Output** ppOutput,
+	const float* pSampleWeights = NULL);
+void GF_FreeOutput(GF_Output* pOutput);
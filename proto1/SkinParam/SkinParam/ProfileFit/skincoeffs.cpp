@@ -31,6 +31,9 @@
 
 #include "stdafx.h"
 #include "skincoeffs.h"
+#include <mutex>
+#include <algorithm>
+#include <emmintrin.h>
 
 using namespace ProfileFit;
 
@@ -87,3 +90,186 @@ const float WLD_lambdas[] = {
 };
 
 } // namespace ProfileFit
+
+struct SkinCoefficients::ConstantSpectra {
+	WLDValue mua_skinbaseline;
+	WLDValue mua_eumel;
+	WLDValue mua_pheomel;
+	WLDValue musp_Mie_fibers;
+	WLDValue musp_Rayleigh;
+	WLDValue musp_epi;
+	WLDValue musp_derm;
+	// mua_blood of blood with only oxy- or deoxyhemoglobin
+	WLDValue mua_blood_ohg;
+	WLDValue mua_blood_dhg;
+};
+
+namespace {
+
+// Calculated SampledSpectrum from wavelength->value mapping
+template <class MappingFunction>
+WLDValue Calculate(const MappingFunction& mapping) {
+	WLDValue res;
+	for (int i = 0; i < WLD_nSamples; i++) {
+		res[i] = mapping(WLD_lambdas[i]);
+	}
+	return res;
+}
+
+std::once_flag constantSpectraFlag;
+
+} // namespace
+
+const SkinCoefficients::ConstantSpectra& SkinCoefficients::constants() {
+	// Constant initialized, unlike the spectra
+	static const ConstantSpectra* constantSpectra = nullptr;
+	std::call_once(constantSpectraFlag, [] {
+		ConstantSpectra* spectra = new ConstantSpectra;
+		spectra->mua_skinbaseline = Calculate([] (float wl) {
+			return 0.244f + 85.3f * expf(-(wl - 154.f) / 66.2f);
+		});
+		spectra->mua_eumel = Calculate([] (float wl) {
+			return 6.6e11f * powf(wl, -3.33f);
+		});
+		spectra->mua_pheomel = Calculate([] (float wl) {
+			return 2.9e15f * powf(wl, -4.75f);
+		});
+		spectra->musp_Mie_fibers = Calculate([] (float wl) {
+			//return 2e5f * powf(wl, -1.5f);
+			return 147.4f * powf(wl, -0.22);
+		});
+		spectra->musp_Rayleigh = Calculate([] (float wl) {
+			return 2e12f * pow(wl, -4.f);
+		});
+		spectra->musp_epi = spectra->musp_Rayleigh + spectra->musp_Mie_fibers;
+		// scale coeff by 50% as the dermis is more translucent
+		spectra->musp_derm = spectra->musp_epi * 0.5f;
+
+		const float ln10 = 2.303f;
+		const float molarWeight = 64500.f; // g/mole
+		const float concentration = 150.f; // g/L
+		spectra->mua_blood_ohg = ln10 / molarWeight * concentration *
+			WLDValue::FromSampled(ohg_lambdas, ohg_vals, ohg_n);
+		spectra->mua_blood_dhg = ln10 / molarWeight * concentration *
+			WLDValue::FromSampled(dhg_lambdas, dhg_vals, dhg_n);
+		constantSpectra = spectra;
+	});
+	return *constantSpectra;
+}
+
+const WLDValue& SkinCoefficients::mua_skinbaseline() {
+	return constants().mua_skinbaseline;
+}
+
+const WLDValue& SkinCoefficients::mua_eumel() {
+	return constants().mua_eumel;
+}
+
+const WLDValue& SkinCoefficients::mua_pheomel() {
+	return constants().mua_pheomel;
+}
+
+const WLDValue& SkinCoefficients::musp_epi() {
+	return constants().musp_epi;
+}
+
+const WLDValue& SkinCoefficients::musp_Mie_fibers() {
+	return constants().musp_Mie_fibers;
+}
+
+const WLDValue& SkinCoefficients::musp_Rayleigh() {
+	return constants().musp_Rayleigh;
+}
+
+const WLDValue& SkinCoefficients::musp_derm() {
+	return constants().musp_derm;
+}
+
+WLDValue SkinCoefficients::mua_epi() const {
+	const ConstantSpectra& cs = constants();
+	return f_mel * f_eu * cs.mua_eumel + f_mel * (1 - f_eu) * cs.mua_pheomel +
+		(1 - f_mel) * cs.mua_skinbaseline;
+}
+
+WLDValue SkinCoefficients::mua_blood() const {
+	const ConstantSpectra& cs = constants();
+	return f_ohg * cs.mua_blood_ohg + (1.f - f_ohg) * cs.mua_blood_dhg;
+}
+
+WLDValue SkinCoefficients::mua_derm() const {
+	const ConstantSpectra& cs = constants();
+	return f_blood * f_ohg * cs.mua_blood_ohg + f_blood * (1.f - f_ohg) * cs.mua_blood_dhg +
+		(1 - f_blood) * cs.mua_skinbaseline;
+}
+
+SkinLayerCoeffs SkinCoefficients::layerCoeffs() const {
+	SkinLayerCoeffs res;
+	layerCoeffsBatch(this, 1, &res);
+	return res;
+}
+
+namespace {
+
+// Weights of the constant spectra in mua_epi and mua_derm
+struct MixWeights {
+	float eumel, pheomel, epiBaseline;
+	float ohg, dhg, dermBaseline;
+};
+
+} // namespace
+
+void SkinCoefficients::layerCoeffsBatch(const SkinCoefficients* coeffs, size_t n, SkinLayerCoeffs* out) {
+	const ConstantSpectra& cs = constants();
+	// The sets are mixed in tiles, so that their spectra stay in the cache while each
+	// group of wavelengths of the constant spectra is loaded once per tile
+	const size_t TILE_SIZE = 16;
+	MixWeights weights[TILE_SIZE];
+	for (size_t first = 0; first < n; first += TILE_SIZE) {
+		size_t count = std::min(n - first, TILE_SIZE);
+		SkinLayerCoeffs* tile = out + first;
+		// Computed as mua_epi and mua_derm do, so that the results are identical
+		for (size_t s = 0; s < count; s++) {
+			const SkinCoefficients& sc = coeffs[first + s];
+			MixWeights& w = weights[s];
+			w.eumel = sc.f_mel * sc.f_eu;
+			w.pheomel = sc.f_mel * (1 - sc.f_eu);
+			w.epiBaseline = 1 - sc.f_mel;
+			w.ohg = sc.f_blood * sc.f_ohg;
+			w.dhg = sc.f_blood * (1.f - sc.f_ohg);
+			w.dermBaseline = 1 - sc.f_blood;
+			tile[s].musp_epi = cs.musp_epi;
+			tile[s].musp_derm = cs.musp_derm;
+		}
+
+		int i = 0;
+		for (; i + 4 <= WLD_nSamples; i += 4) {
+			__m128 eumel = _mm_loadu_ps(&cs.mua_eumel[i]);
+			__m128 pheomel = _mm_loadu_ps(&cs.mua_pheomel[i]);
+			__m128 baseline = _mm_loadu_ps(&cs.mua_skinbaseline[i]);
+			__m128 ohg = _mm_loadu_ps(&cs.mua_blood_ohg[i]);
+			__m128 dhg = _mm_loadu_ps(&cs.mua_blood_dhg[i]);
+			for (size_t s = 0; s < count; s++) {
+				const MixWeights& w = weights[s];
+				__m128 epi = _mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(_mm_set1_ps(w.eumel), eumel),
+					_mm_mul_ps(_mm_set1_ps(w.pheomel), pheomel)),
+					_mm_mul_ps(_mm_set1_ps(w.epiBaseline), baseline));
+				__m128 derm = _mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(_mm_set1_ps(w.ohg), ohg),
+					_mm_mul_ps(_mm_set1_ps(w.dhg), dhg)),
+					_mm_mul_ps(_mm_set1_ps(w.dermBaseline), baseline));
+				_mm_storeu_ps(&tile[s].mua_epi[i], epi);
+				_mm_storeu_ps(&tile[s].mua_derm[i], derm);
+			}
+		}
+		for (; i < WLD_nSamples; i++) {
+			for (size_t s = 0; s < count; s++) {
+				const MixWeights& w = weights[s];
+				tile[s].mua_epi[i] = w.eumel * cs.mua_eumel[i] + w.pheomel * cs.mua_pheomel[i] +
+					w.epiBaseline * cs.mua_skinbaseline[i];
+				tile[s].mua_derm[i] = w.ohg * cs.mua_blood_ohg[i] + w.dhg * cs.mua_blood_dhg[i] +
+					w.dermBaseline * cs.mua_skinbaseline[i];
+			}
+		}
+	}
+}
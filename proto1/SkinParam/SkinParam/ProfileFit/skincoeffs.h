@@ -54,6 +54,7 @@ public:
 
 	WLDValue(float v = 0.f) : Base(v) { }
     WLDValue(const Base& v) : Base(v) { }
+	template <class E> WLDValue(const SpectrumExpr<WLD_nSamples, E>& e) : Base(e) { }
 
 	static WLDValue FromSampled(const float* lambdas, const float* vals, int n) {
 		WLDValue res;
@@ -95,8 +96,18 @@ public:
 	}
 };
 
+// Absorption and reduced scattering coefficients of the skin layers for a set of
+// skin parameters, see SkinCoefficients
+struct SkinLayerCoeffs {
+	WLDValue mua_epi;
+	WLDValue mua_derm;
+	WLDValue musp_epi;
+	WLDValue musp_derm;
+};
+
 // Calculate various absorption/scattering coefficients of human skin
 // http://omlc.ogi.edu/news/jan98/skinoptics.html
+// The spectra that do not depend on the parameters are computed once and shared.
 class SkinCoefficients {
 public:
 	SkinCoefficients(float f_mel, float f_eu, float f_blood, float f_ohg,
@@ -105,98 +116,58 @@ public:
 	  ga_epi(ga_epi), ga_derm(ga_derm), b_derm(b_derm) {}
 
 	// Baseline absorption coefficient, mua.skinbaseline
-	static WLDValue mua_skinbaseline() {
-		return calculate([] (float wl) {
-			return 0.244f + 85.3f * expf(-(wl - 154.f) / 66.2f);
-		});
-	}
+	static const WLDValue& mua_skinbaseline();
 
 	// == Epidermis ============================================
 	// Absorption coefficient of a single eumelanosome, mua.eumel
-	static WLDValue mua_eumel() {
-		return calculate([] (float wl) {
-			return 6.6e11f * powf(wl, -3.33f);
-		});
-	}
+	static const WLDValue& mua_eumel();
 	// Absorption coefficient of a single pheomelanosome, mua.pheomel
-	static WLDValue mua_pheomel() {
-		return calculate([] (float wl) {
-			return 2.9e15f * powf(wl, -4.75f);
-		});
-	}
+	static const WLDValue& mua_pheomel();
 	// Volume fraction of melanosomes in epidermis
 	float f_mel;
 	// Fraction of eumelanin in melanosomes
 	float f_eu;
 	// Net epidermal absorption coefficient, mua.epi
-	WLDValue mua_epi() const {
-		return f_mel * (f_eu * mua_eumel() + (1 - f_eu) * mua_pheomel()) +
-			(1 - f_mel) * mua_skinbaseline();
-	}
+	WLDValue mua_epi() const;
 	//// Scattering coefficient of the epidermis, mus.epi
 	//Spectrum mus_epi() const;
 	//// Anisotropy of the epidermis, g.epi
 	//float g_epi;
 	// Reduced scattering coefficient of the epidermis, musp.epi
-	static WLDValue musp_epi() {
-		return musp_Rayleigh() + musp_Mie_fibers();
-	}
+	static const WLDValue& musp_epi();
 
 	// == Dermis ============================================
 	// Volume fraction of oxyhemoglobin, f_ohg
 	float f_ohg;
 	// Absorption coefficient of whole blood, mua.blood
 	// Data from: http://www.npsg.uwaterloo.ca/data/blood.php
-	WLDValue mua_blood() const {
-		const float ln10 = 2.303f;
-		const float molarWeight = 64500.f; // g/mole
-		const float concentration = 150.f; // g/L
-		return ln10 / molarWeight * concentration *
-			(f_ohg * WLDValue::FromSampled(
-			ohg_lambdas, ohg_vals, ohg_n) +
-			(1.f - f_ohg) * WLDValue::FromSampled(
-			dhg_lambdas, dhg_vals, dhg_n));
-	}
+	WLDValue mua_blood() const;
 	// Average volume fraction of blood, f.blood
 	float f_blood;
 	// Absorption coefficient of dermis perfused with blood, mua.derm
-	WLDValue mua_derm() const {
-		return f_blood * mua_blood() + (1 - f_blood) * mua_skinbaseline();
-	}
+	WLDValue mua_derm() const;
 	// (Reduced) Mie scattering coefficient of collagen fibers, musp_Mie.fibers
-	static WLDValue musp_Mie_fibers() {
-		return calculate([] (float wl) {
-			//return 2e5f * powf(wl, -1.5f);
-			return 147.4f * powf(wl, -0.22);
-		});
-	}
+	static const WLDValue& musp_Mie_fibers();
 	// (Reduced) Rayleigh scattering coefficient of the dermis, musp_Rayleigh
-	static WLDValue musp_Rayleigh() {
-		return calculate([] (float wl) {
-			return 2e12f * pow(wl, -4.f);
-		});
-	}
+	static const WLDValue& musp_Rayleigh();
 	// (Reduced) scattering coefficient of dermis, musp.derm
-	static WLDValue musp_derm() {
-		// scale coeff by 50% as the dermis is more translucent
-		return musp_epi() * 0.5f;
-	}
+	static const WLDValue& musp_derm();
 	// Anisotropy of the epidermis, ga.epi
 	float ga_epi;
 	// Anisotropy of the epidermis, ga.derm
 	float ga_derm;
 	// Isotropic scattering coefficient of the dermis, b.derm;
 	float b_derm;
+
+	// Coefficients of both layers
+	SkinLayerCoeffs layerCoeffs() const;
+	// layerCoeffs of n parameter sets, with the same results. Each group of wavelengths
+	// of the constant spectra is loaded once and mixed for all the sets.
+	static void layerCoeffsBatch(const SkinCoefficients* coeffs, size_t n, SkinLayerCoeffs* out);
 private:
-	// Calculated SampledSpectrum from wavelength->value mapping
-	template <class MappingFunction>
-	static WLDValue calculate(const MappingFunction& mapping) {
-		WLDValue res;
-		for (int i = 0; i < WLD_nSamples; i++) {
-			res[i] = mapping(WLD_lambdas[i]);
-		}
-		return res;
-	}
+	// Spectra that do not depend on the parameters
+	struct ConstantSpectra;
+	static const ConstantSpectra& constants();
 
 	static const float ohg_lambdas[];
 	static const float ohg_vals[];
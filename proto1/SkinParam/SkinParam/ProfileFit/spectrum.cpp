@@ -33,8 +33,10 @@
 // core/spectrum.cpp*
 #include "stdafx.h"
 #include "spectrum.h"
+#include "ssemath.h"
 #include <sstream>
 #include <iomanip>
+#include <mutex>
 
 namespace ProfileFit {
 
@@ -102,89 +104,144 @@ RGBSpectrum SampledSpectrum::ToRGBSpectrum() const {
 }
 
 
-SampledSpectrum SampledSpectrum::FromRGB(const float rgb[3],
-                                         SpectrumType type) {
-    SampledSpectrum r;
-    if (type == SPECTRUM_REFLECTANCE) {
-        // Convert reflectance spectrum to RGB
-        if (rgb[0] <= rgb[1] && rgb[0] <= rgb[2]) {
-            // Compute reflectance _SampledSpectrum_ with _rgb[0]_ as minimum
-            r += rgb[0] * rgbRefl2SpectWhite;
-            if (rgb[1] <= rgb[2]) {
-                r += (rgb[1] - rgb[0]) * rgbRefl2SpectCyan;
-                r += (rgb[2] - rgb[1]) * rgbRefl2SpectBlue;
-            }
-            else {
-                r += (rgb[2] - rgb[0]) * rgbRefl2SpectCyan;
-                r += (rgb[1] - rgb[2]) * rgbRefl2SpectGreen;
-            }
-        }
-        else if (rgb[1] <= rgb[0] && rgb[1] <= rgb[2]) {
-            // Compute reflectance _SampledSpectrum_ with _rgb[1]_ as minimum
-            r += rgb[1] * rgbRefl2SpectWhite;
-            if (rgb[0] <= rgb[2]) {
-                r += (rgb[0] - rgb[1]) * rgbRefl2SpectMagenta;
-                r += (rgb[2] - rgb[0]) * rgbRefl2SpectBlue;
-            }
-            else {
-                r += (rgb[2] - rgb[1]) * rgbRefl2SpectMagenta;
-                r += (rgb[0] - rgb[2]) * rgbRefl2SpectRed;
+// Index into the tables of FromRGB for the order of the channels
+static int RGBOrder(const float rgb[3]) {
+    if (rgb[0] <= rgb[1] && rgb[0] <= rgb[2])
+        return rgb[1] <= rgb[2] ? 0 : 1;
+    else if (rgb[1] <= rgb[0] && rgb[1] <= rgb[2])
+        return rgb[0] <= rgb[2] ? 2 : 3;
+    else
+        return rgb[0] <= rgb[1] ? 4 : 5;
+}
+
+
+// Splits the white, cyan, magenta, yellow, red, green and blue spectra of the RGB to
+// spectrum conversion into the spectra each channel adds for each order of the channels.
+// The one with the smallest value adds white, the others add the secondary color
+// between them and the one with the largest value its primary color, each by the
+// difference to the next smaller channel.
+static void SplitRGBToSpectrum(const SampledSpectrum& white, const SampledSpectrum& cyan,
+    const SampledSpectrum& magenta, const SampledSpectrum& yellow, const SampledSpectrum& red,
+    const SampledSpectrum& green, const SampledSpectrum& blue, float scale,
+    SampledSpectrum bases[6][3])
+{
+    // r <= g <= b
+    bases[0][0] = scale * (white - cyan);
+    bases[0][1] = scale * (cyan - blue);
+    bases[0][2] = scale * blue;
+    // r <= b < g
+    bases[1][0] = scale * (white - cyan);
+    bases[1][1] = scale * green;
+    bases[1][2] = scale * (cyan - green);
+    // g <= r <= b
+    bases[2][0] = scale * (magenta - blue);
+    bases[2][1] = scale * (white - magenta);
+    bases[2][2] = scale * blue;
+    // g <= b < r
+    bases[3][0] = scale * red;
+    bases[3][1] = scale * (white - magenta);
+    bases[3][2] = scale * (magenta - red);
+    // b < r <= g
+    bases[4][0] = scale * (yellow - green);
+    bases[4][1] = scale * green;
+    bases[4][2] = scale * (white - yellow);
+    // b < g < r
+    bases[5][0] = scale * red;
+    bases[5][1] = scale * (yellow - red);
+    bases[5][2] = scale * (white - yellow);
+}
+
+
+static std::once_flag spectraInitFlag;
+
+void SampledSpectrum::Init() {
+    std::call_once(spectraInitFlag, [] {
+        // Compute XYZ matching functions for _SampledSpectrum_
+        float scale = float(sampledLambdaEnd - sampledLambdaStart) /
+            float(CIE_Y_integral * nSpectralSamples);
+        for (int i = 0; i < nSpectralSamples; ++i) {
+            float wl0 = Lerp(float(i) / float(nSpectralSamples),
+                             sampledLambdaStart, sampledLambdaEnd);
+            float wl1 = Lerp(float(i+1) / float(nSpectralSamples),
+                             sampledLambdaStart, sampledLambdaEnd);
+            float xyz[3] = {
+                AverageSpectrumSamples(CIE_lambda, CIE_X, nCIESamples, wl0, wl1) * scale,
+                AverageSpectrumSamples(CIE_lambda, CIE_Y, nCIESamples, wl0, wl1) * scale,
+                AverageSpectrumSamples(CIE_lambda, CIE_Z, nCIESamples, wl0, wl1) * scale
+            };
+            float rgb[3];
+            XYZToRGB(xyz, rgb);
+            for (int row = 0; row < 3; ++row) {
+                toXYZ[row][i] = xyz[row];
+                toRGB[row][i] = rgb[row];
             }
         }
-        else {
-            // Compute reflectance _SampledSpectrum_ with _rgb[2]_ as minimum
-            r += rgb[2] * rgbRefl2SpectWhite;
-            if (rgb[0] <= rgb[1]) {
-                r += (rgb[0] - rgb[2]) * rgbRefl2SpectYellow;
-                r += (rgb[1] - rgb[0]) * rgbRefl2SpectGreen;
-            }
-            else {
-                r += (rgb[1] - rgb[2]) * rgbRefl2SpectYellow;
-                r += (rgb[0] - rgb[1]) * rgbRefl2SpectRed;
+
+        // Compute RGB to spectrum functions for _SampledSpectrum_
+        SampledSpectrum refl[7], illum[7];
+        const float* reflSamples[7] = { RGBRefl2SpectWhite, RGBRefl2SpectCyan,
+            RGBRefl2SpectMagenta, RGBRefl2SpectYellow, RGBRefl2SpectRed,
+            RGBRefl2SpectGreen, RGBRefl2SpectBlue };
+        const float* illumSamples[7] = { RGBIllum2SpectWhite, RGBIllum2SpectCyan,
+            RGBIllum2SpectMagenta, RGBIllum2SpectYellow, RGBIllum2SpectRed,
+            RGBIllum2SpectGreen, RGBIllum2SpectBlue };
+        for (int i = 0; i < nSpectralSamples; ++i) {
+            float wl0 = Lerp(float(i) / float(nSpectralSamples),
+                             sampledLambdaStart, sampledLambdaEnd);
+            float wl1 = Lerp(float(i+1) / float(nSpectralSamples),
+                             sampledLambdaStart, sampledLambdaEnd);
+            for (int k = 0; k < 7; ++k) {
+                refl[k].c[i] = AverageSpectrumSamples(RGB2SpectLambda, reflSamples[k],
+                    nRGB2SpectSamples, wl0, wl1);
+                illum[k].c[i] = AverageSpectrumSamples(RGB2SpectLambda, illumSamples[k],
+                    nRGB2SpectSamples, wl0, wl1);
             }
         }
-        r *= .94;
+        SplitRGBToSpectrum(refl[0], refl[1], refl[2], refl[3], refl[4], refl[5], refl[6],
+            .94f, rgbRefl2Spect);
+        SplitRGBToSpectrum(illum[0], illum[1], illum[2], illum[3], illum[4], illum[5], illum[6],
+            .86445f, rgbIllum2Spect);
+    });
+}
+
+
+void SampledSpectrum::Project(const float matrix[3][nSpectralSamples], const float* c,
+    float out[3])
+{
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    __m128 sum2 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= nSpectralSamples; i += 4) {
+        __m128 v = _mm_loadu_ps(c + i);
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(matrix[0] + i), v));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(matrix[1] + i), v));
+        sum2 = _mm_add_ps(sum2, _mm_mul_ps(_mm_loadu_ps(matrix[2] + i), v));
     }
-    else {
-        // Convert illuminant spectrum to RGB
-        if (rgb[0] <= rgb[1] && rgb[0] <= rgb[2]) {
-            // Compute illuminant _SampledSpectrum_ with _rgb[0]_ as minimum
-            r += rgb[0] * rgbIllum2SpectWhite;
-            if (rgb[1] <= rgb[2]) {
-                r += (rgb[1] - rgb[0]) * rgbIllum2SpectCyan;
-                r += (rgb[2] - rgb[1]) * rgbIllum2SpectBlue;
-            }
-            else {
-                r += (rgb[2] - rgb[0]) * rgbIllum2SpectCyan;
-                r += (rgb[1] - rgb[2]) * rgbIllum2SpectGreen;
-            }
-        }
-        else if (rgb[1] <= rgb[0] && rgb[1] <= rgb[2]) {
-            // Compute illuminant _SampledSpectrum_ with _rgb[1]_ as minimum
-            r += rgb[1] * rgbIllum2SpectWhite;
-            if (rgb[0] <= rgb[2]) {
-                r += (rgb[0] - rgb[1]) * rgbIllum2SpectMagenta;
-                r += (rgb[2] - rgb[0]) * rgbIllum2SpectBlue;
-            }
-            else {
-                r += (rgb[2] - rgb[1]) * rgbIllum2SpectMagenta;
-                r += (rgb[0] - rgb[2]) * rgbIllum2SpectRed;
-            }
-        }
-        else {
-            // Compute illuminant _SampledSpectrum_ with _rgb[2]_ as minimum
-            r += rgb[2] * rgbIllum2SpectWhite;
-            if (rgb[0] <= rgb[1]) {
-                r += (rgb[0] - rgb[2]) * rgbIllum2SpectYellow;
-                r += (rgb[1] - rgb[0]) * rgbIllum2SpectGreen;
-            }
-            else {
-                r += (rgb[1] - rgb[2]) * rgbIllum2SpectYellow;
-                r += (rgb[0] - rgb[1]) * rgbIllum2SpectRed;
-            }
-        }
-        r *= .86445f;
+    out[0] = hsum_ps(sum0);
+    out[1] = hsum_ps(sum1);
+    out[2] = hsum_ps(sum2);
+    for (; i < nSpectralSamples; ++i) {
+        out[0] += matrix[0][i] * c[i];
+        out[1] += matrix[1][i] * c[i];
+        out[2] += matrix[2][i] * c[i];
     }
+}
+
+
+void SampledSpectrum::ToRGB(const SampledSpectrum* spectra, size_t n, float* rgb) {
+    for (size_t i = 0; i < n; ++i)
+        Project(toRGB, spectra[i].c, rgb + 3 * i);
+}
+
+
+SampledSpectrum SampledSpectrum::FromRGB(const float rgb[3],
+                                         SpectrumType type) {
+    const SampledSpectrum* bases = (type == SPECTRUM_REFLECTANCE ?
+        rgbRefl2Spect : rgbIllum2Spect)[RGBOrder(rgb)];
+    SampledSpectrum r;
+    for (int i = 0; i < nSpectralSamples; ++i)
+        r.c[i] = rgb[0] * bases[0].c[i] + rgb[1] * bases[1].c[i] + rgb[2] * bases[2].c[i];
     return r.Clamp();
 }
 
@@ -630,23 +687,10 @@ const float CIE_lambda[nCIESamples] = {
     822, 823, 824, 825, 826, 827, 828, 829, 830 };
 
 // Spectral Data Definitions
-SampledSpectrum SampledSpectrum::X;
-SampledSpectrum SampledSpectrum::Y;
-SampledSpectrum SampledSpectrum::Z;
-SampledSpectrum SampledSpectrum::rgbRefl2SpectWhite;
-SampledSpectrum SampledSpectrum::rgbRefl2SpectCyan;
-SampledSpectrum SampledSpectrum::rgbRefl2SpectMagenta;
-SampledSpectrum SampledSpectrum::rgbRefl2SpectYellow;
-SampledSpectrum SampledSpectrum::rgbRefl2SpectRed;
-SampledSpectrum SampledSpectrum::rgbRefl2SpectGreen;
-SampledSpectrum SampledSpectrum::rgbRefl2SpectBlue;
-SampledSpectrum SampledSpectrum::rgbIllum2SpectWhite;
-SampledSpectrum SampledSpectrum::rgbIllum2SpectCyan;
-SampledSpectrum SampledSpectrum::rgbIllum2SpectMagenta;
-SampledSpectrum SampledSpectrum::rgbIllum2SpectYellow;
-SampledSpectrum SampledSpectrum::rgbIllum2SpectRed;
-SampledSpectrum SampledSpectrum::rgbIllum2SpectGreen;
-SampledSpectrum SampledSpectrum::rgbIllum2SpectBlue;
+float SampledSpectrum::toXYZ[3][nSpectralSamples];
+float SampledSpectrum::toRGB[3][nSpectralSamples];
+SampledSpectrum SampledSpectrum::rgbRefl2Spect[SampledSpectrum::nRGBOrders][3];
+SampledSpectrum SampledSpectrum::rgbIllum2Spect[SampledSpectrum::nRGBOrders][3];
 const float RGB2SpectLambda[nRGB2SpectSamples] = {
     380.000000, 390.967743, 401.935486, 412.903229, 423.870972, 434.838715,
     445.806458, 456.774200, 467.741943, 478.709686, 489.677429, 500.645172,
@@ -38,6 +38,7 @@
 
 // core/spectrum.h*
 #include "PbrtUtils/types.h"
+#include "spectrumexpr.h"
 
 namespace ProfileFit {
 
@@ -95,7 +96,8 @@ extern const float RGBIllum2SpectGreen[nRGB2SpectSamples];
 extern const float RGBIllum2SpectBlue[nRGB2SpectSamples];
 
 // Spectrum Declarations
-template <int nSamples> class CoefficientSpectrum {
+template <int nSamples> class CoefficientSpectrum
+    : public SpectrumExpr<nSamples, CoefficientSpectrum<nSamples> > {
 public:
 	static const int nComponents = nSamples;
 
@@ -127,78 +129,44 @@ public:
         }
         fprintf(f, "]");
     }
-    CoefficientSpectrum &operator+=(const CoefficientSpectrum &s2) {
-        Assert(!s2.HasNaNs());
-        for (int i = 0; i < nSamples; ++i)
-            c[i] += s2.c[i];
-        return *this;
-    }
-    CoefficientSpectrum operator+(const CoefficientSpectrum &s2) const {
-        Assert(!s2.HasNaNs());
-        CoefficientSpectrum ret = *this;
-        for (int i = 0; i < nSamples; ++i)
-            ret.c[i] += s2.c[i];
-        return ret;
-    }
-    CoefficientSpectrum operator-(const CoefficientSpectrum &s2) const {
-        Assert(!s2.HasNaNs());
-        CoefficientSpectrum ret = *this;
-        for (int i = 0; i < nSamples; ++i)
-            ret.c[i] -= s2.c[i];
-        return ret;
+    // The arithmetic operators build expressions, see spectrumexpr.h
+    template <class E> CoefficientSpectrum(const SpectrumExpr<nSamples, E> &e) {
+        EvalSpectrumExpr(e, c);
+        Assert(!HasNaNs());
     }
-    CoefficientSpectrum operator/(const CoefficientSpectrum &s2) const {
-        Assert(!s2.HasNaNs());
-        CoefficientSpectrum ret = *this;
-        for (int i = 0; i < nSamples; ++i)
-            ret.c[i] /= s2.c[i];
-        return ret;
+    template <class E> CoefficientSpectrum &operator=(const SpectrumExpr<nSamples, E> &e) {
+        EvalSpectrumExpr(e, c);
+        Assert(!HasNaNs());
+        return *this;
     }
-    CoefficientSpectrum operator*(const CoefficientSpectrum &sp) const {
-        Assert(!sp.HasNaNs());
-        CoefficientSpectrum ret = *this;
-        for (int i = 0; i < nSamples; ++i)
-            ret.c[i] *= sp.c[i];
-        return ret;
+    template <class E> CoefficientSpectrum &operator+=(const SpectrumExpr<nSamples, E> &e) {
+        EvalSpectrumExpr(*this + e, c);
+        return *this;
     }
-    CoefficientSpectrum &operator*=(const CoefficientSpectrum &sp) {
-        Assert(!sp.HasNaNs());
-        for (int i = 0; i < nSamples; ++i)
-            c[i] *= sp.c[i];
+    template <class E> CoefficientSpectrum &operator-=(const SpectrumExpr<nSamples, E> &e) {
+        EvalSpectrumExpr(*this - e, c);
         return *this;
     }
-    CoefficientSpectrum operator*(float a) const {
-        CoefficientSpectrum ret = *this;
-        for (int i = 0; i < nSamples; ++i)
-            ret.c[i] *= a;
-        Assert(!ret.HasNaNs());
-        return ret;
+    template <class E> CoefficientSpectrum &operator*=(const SpectrumExpr<nSamples, E> &e) {
+        EvalSpectrumExpr(*this * e, c);
+        return *this;
     }
     CoefficientSpectrum &operator*=(float a) {
-        for (int i = 0; i < nSamples; ++i)
-            c[i] *= a;
+        EvalSpectrumExpr(*this * a, c);
         Assert(!HasNaNs());
         return *this;
     }
-    friend inline
-    CoefficientSpectrum operator*(float a, const CoefficientSpectrum &s) {
-        Assert(!isnan(a) && !s.HasNaNs());
-        return s * a;
-    }
-    CoefficientSpectrum operator/(float a) const {
-        Assert(!isnan(a));
-        CoefficientSpectrum ret = *this;
-        for (int i = 0; i < nSamples; ++i)
-            ret.c[i] /= a;
-        Assert(!ret.HasNaNs());
-        return ret;
-    }
     CoefficientSpectrum &operator/=(float a) {
         Assert(!isnan(a));
-        for (int i = 0; i < nSamples; ++i)
-            c[i] /= a;
+        EvalSpectrumExpr(*this / a, c);
         return *this;
     }
+    float Eval(int i) const {
+        return c[i];
+    }
+    __m128 Eval4(int i) const {
+        return _mm_loadu_ps(c + i);
+    }
     bool operator==(const CoefficientSpectrum &sp) const {
         for (int i = 0; i < nSamples; ++i)
             if (c[i] != sp.c[i]) return false;
@@ -226,12 +194,6 @@ public:
         return ret;
     }
     template <int n> friend inline CoefficientSpectrum<n> Pow(const CoefficientSpectrum<n> &s, float e);
-    CoefficientSpectrum operator-() const {
-        CoefficientSpectrum ret;
-        for (int i = 0; i < nSamples; ++i)
-            ret.c[i] = -c[i];
-        return ret;
-    }
     friend CoefficientSpectrum Exp(const CoefficientSpectrum &s) {
         CoefficientSpectrum ret;
         for (int i = 0; i < nSamples; ++i)
@@ -300,6 +262,8 @@ public:
     }
     SampledSpectrum(const CoefficientSpectrum<nSpectralSamples> &v)
         : CoefficientSpectrum<nSpectralSamples>(v) { }
+    template <class E> SampledSpectrum(const SpectrumExpr<nSpectralSamples, E> &e)
+        : CoefficientSpectrum<nSpectralSamples>(e) { }
 	const SampledSpectrum& ToSampledSpectrum() const { return *this; }
 	static const SampledSpectrum& FromSampledSpectrum(const SampledSpectrum& v) { return v; }
     static SampledSpectrum FromSampled(const float *lambda,
@@ -322,83 +286,22 @@ public:
         }
         return r;
     }
-    static void Init() {
-        // Compute XYZ matching functions for _SampledSpectrum_
-        for (int i = 0; i < nSpectralSamples; ++i) {
-            float wl0 = Lerp(float(i) / float(nSpectralSamples),
-                             sampledLambdaStart, sampledLambdaEnd);
-            float wl1 = Lerp(float(i+1) / float(nSpectralSamples),
-                             sampledLambdaStart, sampledLambdaEnd);
-            X.c[i] = AverageSpectrumSamples(CIE_lambda, CIE_X, nCIESamples,
-                                            wl0, wl1);
-            Y.c[i] = AverageSpectrumSamples(CIE_lambda, CIE_Y, nCIESamples,
-                                            wl0, wl1);
-            Z.c[i] = AverageSpectrumSamples(CIE_lambda, CIE_Z, nCIESamples,
-                                            wl0, wl1);
-        }
-
-        // Compute RGB to spectrum functions for _SampledSpectrum_
-        for (int i = 0; i < nSpectralSamples; ++i) {
-            float wl0 = Lerp(float(i) / float(nSpectralSamples),
-                             sampledLambdaStart, sampledLambdaEnd);
-            float wl1 = Lerp(float(i+1) / float(nSpectralSamples),
-                             sampledLambdaStart, sampledLambdaEnd);
-            rgbRefl2SpectWhite.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBRefl2SpectWhite,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbRefl2SpectCyan.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBRefl2SpectCyan,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbRefl2SpectMagenta.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBRefl2SpectMagenta,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbRefl2SpectYellow.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBRefl2SpectYellow,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbRefl2SpectRed.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBRefl2SpectRed,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbRefl2SpectGreen.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBRefl2SpectGreen,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbRefl2SpectBlue.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBRefl2SpectBlue,
-                nRGB2SpectSamples, wl0, wl1);
-        
-            rgbIllum2SpectWhite.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBIllum2SpectWhite,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbIllum2SpectCyan.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBIllum2SpectCyan,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbIllum2SpectMagenta.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBIllum2SpectMagenta,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbIllum2SpectYellow.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBIllum2SpectYellow,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbIllum2SpectRed.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBIllum2SpectRed,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbIllum2SpectGreen.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBIllum2SpectGreen,
-                nRGB2SpectSamples, wl0, wl1);
-            rgbIllum2SpectBlue.c[i] = AverageSpectrumSamples(RGB2SpectLambda, RGBIllum2SpectBlue,
-                nRGB2SpectSamples, wl0, wl1);
-        }
-    }
+    // Safe to call from any thread, only the first call computes the tables
+    static void Init();
     void ToXYZ(float xyz[3]) const {
-        xyz[0] = xyz[1] = xyz[2] = 0.f;
-        for (int i = 0; i < nSpectralSamples; ++i) {
-            xyz[0] += X.c[i] * c[i];
-            xyz[1] += Y.c[i] * c[i];
-            xyz[2] += Z.c[i] * c[i];
-        }
-        float scale = float(sampledLambdaEnd - sampledLambdaStart) /
-            float(CIE_Y_integral * nSpectralSamples);
-        xyz[0] *= scale;
-        xyz[1] *= scale;
-        xyz[2] *= scale;
+        Project(toXYZ, c, xyz);
     }
     float y() const {
         float yy = 0.f;
         for (int i = 0; i < nSpectralSamples; ++i)
-            yy += Y.c[i] * c[i];
-        return yy * float(sampledLambdaEnd - sampledLambdaStart) /
-            float(CIE_Y_integral * nSpectralSamples);
+            yy += toXYZ[1][i] * c[i];
+        return yy;
     }
     void ToRGB(float rgb[3]) const {
-        float xyz[3];
-        ToXYZ(xyz);
-        XYZToRGB(xyz, rgb);
+        Project(toRGB, c, rgb);
     }
+    // Converts n spectra, rgb holds 3 floats per spectrum
+    static void ToRGB(const SampledSpectrum* spectra, size_t n, float* rgb);
     RGBSpectrum ToRGBSpectrum() const;
     static SampledSpectrum FromRGB(const float rgb[3],
         SpectrumType type = SPECTRUM_REFLECTANCE);
@@ -419,15 +322,18 @@ public:
 	string ToString() const;
 private:
     // SampledSpectrum Private Data
-    static SampledSpectrum X, Y, Z;
-    static SampledSpectrum rgbRefl2SpectWhite, rgbRefl2SpectCyan;
-    static SampledSpectrum rgbRefl2SpectMagenta, rgbRefl2SpectYellow;
-    static SampledSpectrum rgbRefl2SpectRed, rgbRefl2SpectGreen;
-    static SampledSpectrum rgbRefl2SpectBlue;
-    static SampledSpectrum rgbIllum2SpectWhite, rgbIllum2SpectCyan;
-    static SampledSpectrum rgbIllum2SpectMagenta, rgbIllum2SpectYellow;
-    static SampledSpectrum rgbIllum2SpectRed, rgbIllum2SpectGreen;
-    static SampledSpectrum rgbIllum2SpectBlue;
+    // The XYZ matching functions averaged over each sample and scaled, so that ToXYZ is
+    // a matrix product; toRGB has XYZToRGB folded in
+    static float toXYZ[3][nSpectralSamples];
+    static float toRGB[3][nSpectralSamples];
+    // FromRGB mixes 3 of these by the channels, one triple for each order of the
+    // channels. The white, primary and secondary spectra are combined in advance.
+    static const int nRGBOrders = 6;
+    static SampledSpectrum rgbRefl2Spect[nRGBOrders][3];
+    static SampledSpectrum rgbIllum2Spect[nRGBOrders][3];
+
+    // Multiplies a 3 by nSpectralSamples matrix with the samples
+    static void Project(const float matrix[3][nSpectralSamples], const float* c, float out[3]);
 };
 
 
@@ -438,6 +344,8 @@ public:
     RGBSpectrum(float v = 0.f) : CoefficientSpectrum<3>(v) { }
     RGBSpectrum(const CoefficientSpectrum<3> &v)
         : CoefficientSpectrum<3>(v) { }
+    template <class E> RGBSpectrum(const SpectrumExpr<3, E> &e)
+        : CoefficientSpectrum<3>(e) { }
     RGBSpectrum(const RGBSpectrum &s, SpectrumType type = SPECTRUM_REFLECTANCE) {
         *this = s;
     }
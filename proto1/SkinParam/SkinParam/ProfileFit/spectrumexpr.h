@@ -0,0 +1,173 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Lazily evaluated arithmetic on CoefficientSpectrum
+ *
+ * The arithmetic operators of the spectra return expressions instead of spectra.
+ * An expression is evaluated once it is assigned to a spectrum, four samples at a
+ * time, so a compound expression like a * x + b * y runs as a single loop without
+ * temporary spectra. Every sample goes through the same float operations in the
+ * same order as with eager evaluation, so the results are identical.
+ */
+
+#pragma once
+
+#include <emmintrin.h>
+
+namespace ProfileFit {
+
+template <int nSamples> class CoefficientSpectrum;
+
+// Base of the spectrum expressions. E evaluates the samples with
+//   float Eval(int i) const       sample i
+//   __m128 Eval4(int i) const     samples i to i + 3
+template <int nSamples, class E> struct SpectrumExpr {
+	const E& Self() const {
+		return static_cast<const E&>(*this);
+	}
+};
+
+// Spectra are referenced by the expressions, the expressions themselves are small and
+// copied, so that they do not refer to temporaries
+template <class E> struct SpectrumExprOperand {
+	typedef const E Type;
+};
+template <int nSamples> struct SpectrumExprOperand<CoefficientSpectrum<nSamples> > {
+	typedef const CoefficientSpectrum<nSamples>& Type;
+};
+
+// Writes the samples of an expression to out. A sample only depends on the same sample
+// of the operands, so out may be one of them.
+template <int nSamples, class E>
+inline void EvalSpectrumExpr(const SpectrumExpr<nSamples, E>& expr, float* out) {
+	const E& e = expr.Self();
+	int i = 0;
+	for (; i + 4 <= nSamples; i += 4)
+		_mm_storeu_ps(out + i, e.Eval4(i));
+	for (; i < nSamples; i++)
+		out[i] = e.Eval(i);
+}
+
+// A float used as a spectrum
+template <int nSamples> class SpectrumScalar : public SpectrumExpr<nSamples, SpectrumScalar<nSamples> > {
+public:
+	explicit SpectrumScalar(float v) : v(v) { }
+	float Eval(int) const {
+		return v;
+	}
+	__m128 Eval4(int) const {
+		return _mm_set1_ps(v);
+	}
+private:
+	float v;
+};
+
+struct SpectrumAdd {
+	static float Apply(float a, float b) { return a + b; }
+	static __m128 Apply(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+};
+struct SpectrumSub {
+	static float Apply(float a, float b) { return a - b; }
+	static __m128 Apply(__m128 a, __m128 b) { return _mm_sub_ps(a, b); }
+};
+struct SpectrumMul {
+	static float Apply(float a, float b) { return a * b; }
+	static __m128 Apply(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+};
+struct SpectrumDiv {
+	static float Apply(float a, float b) { return a / b; }
+	static __m128 Apply(__m128 a, __m128 b) { return _mm_div_ps(a, b); }
+};
+
+template <int nSamples, class Op, class L, class R>
+class SpectrumBinary : public SpectrumExpr<nSamples, SpectrumBinary<nSamples, Op, L, R> > {
+public:
+	SpectrumBinary(const L& l, const R& r) : l(l), r(r) { }
+	float Eval(int i) const {
+		return Op::Apply(l.Eval(i), r.Eval(i));
+	}
+	__m128 Eval4(int i) const {
+		return Op::Apply(l.Eval4(i), r.Eval4(i));
+	}
+private:
+	typename SpectrumExprOperand<L>::Type l;
+	typename SpectrumExprOperand<R>::Type r;
+};
+
+template <int nSamples, class E>
+class SpectrumNegate : public SpectrumExpr<nSamples, SpectrumNegate<nSamples, E> > {
+public:
+	explicit SpectrumNegate(const E& e) : e(e) { }
+	float Eval(int i) const {
+		return -e.Eval(i);
+	}
+	__m128 Eval4(int i) const {
+		return _mm_xor_ps(e.Eval4(i), _mm_set1_ps(-0.f));
+	}
+private:
+	typename SpectrumExprOperand<E>::Type e;
+};
+
+// Operators of spectra and floats, each for spectrum op spectrum, spectrum op float and
+// float op spectrum
+#define SPECTRUM_EXPR_OPERATOR(op, Op) \
+	template <int nSamples, class L, class R> inline \
+	SpectrumBinary<nSamples, Op, L, R> operator op(const SpectrumExpr<nSamples, L>& l, \
+		const SpectrumExpr<nSamples, R>& r) { \
+		return SpectrumBinary<nSamples, Op, L, R>(l.Self(), r.Self()); \
+	} \
+	template <int nSamples, class L> inline \
+	SpectrumBinary<nSamples, Op, L, SpectrumScalar<nSamples> > operator op( \
+		const SpectrumExpr<nSamples, L>& l, float r) { \
+		return SpectrumBinary<nSamples, Op, L, SpectrumScalar<nSamples> >( \
+			l.Self(), SpectrumScalar<nSamples>(r)); \
+	} \
+	template <int nSamples, class R> inline \
+	SpectrumBinary<nSamples, Op, SpectrumScalar<nSamples>, R> operator op( \
+		float l, const SpectrumExpr<nSamples, R>& r) { \
+		return SpectrumBinary<nSamples, Op, SpectrumScalar<nSamples>, R>( \
+			SpectrumScalar<nSamples>(l), r.Self()); \
+	}
+
+SPECTRUM_EXPR_OPERATOR(+, SpectrumAdd)
+SPECTRUM_EXPR_OPERATOR(-, SpectrumSub)
+SPECTRUM_EXPR_OPERATOR(*, SpectrumMul)
+SPECTRUM_EXPR_OPERATOR(/, SpectrumDiv)
+
+#undef SPECTRUM_EXPR_OPERATOR
+
+template <int nSamples, class E>
+inline SpectrumNegate<nSamples, E> operator-(const SpectrumExpr<nSamples, E>& e) {
+	return SpectrumNegate<nSamples, E>(e.Self());
+}
+
+} // namespace ProfileFit
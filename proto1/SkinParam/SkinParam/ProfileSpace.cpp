@@ -0,0 +1,380 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Profile space storage and the binary profile table format
+ */
+
+#include "StdAfx.h"
+
+#include "ProfileSpace.h"
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <iterator>
+#include <cmath>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace Skin;
+using namespace Utils;
+
+namespace Skin {
+
+	static istream& getLine(istream& is, string& out) {
+		out.clear();
+
+		// The characters in the stream are read one-by-one using a std::streambuf.
+		// That is faster than reading them one-by-one using the std::istream.
+		// Code that uses streambuf this way must be guarded by a sentry object.
+		// The sentry object performs various tasks,
+		// such as thread synchronization and updating the stream state.
+
+		std::istream::sentry se(is, true);
+		std::streambuf* sb = is.rdbuf();
+
+		for(;;) {
+			int c = sb->sbumpc();
+			switch (c) {
+			case '\n':
+				return is;
+			case '\r':
+				if(sb->sgetc() == '\n')
+					sb->sbumpc();
+				return is;
+			case EOF:
+				// Also handle the case when the last line has no line ending
+				if(out.empty())
+					is.setstate(std::ios::eofbit);
+				return is;
+			default:
+				out.push_back((char)c);
+			}
+		}
+	}
+
+	static const uint32_t DATA_ALIGNMENT = 16;
+
+	// Spacing deviation tolerated on a uniform axis, relative to the mean spacing.
+	// Keeps the direct index guess within one point of the bracket.
+	static const float UNIFORM_TOLERANCE = 1e-3f;
+
+	static void detectUniformSpacing(SamplePoints& sp) {
+		const vector<float>& points = sp.points;
+		sp.uniform = false;
+		sp.invSpacing = 0.f;
+		if (points.size() < 2)
+			return;
+		float spacing = (points.back() - points[0]) / (float)(points.size() - 1);
+		if (!(spacing > 0.f))
+			return;
+		for (size_t i = 1; i < points.size(); i++) {
+			float expected = points[0] + spacing * (float)i;
+			if (abs(points[i] - expected) > spacing * UNIFORM_TOLERANCE)
+				return;
+		}
+		sp.uniform = true;
+		sp.invSpacing = 1.f / spacing;
+	}
+
+	static int countProfiles(const vector<SamplePoints>& sps) {
+		int count = 1;
+		for (const SamplePoints& sp : sps)
+			count *= (int)sp.points.size();
+		return count;
+	}
+
+} // namespace Skin
+
+void Skin::prepareSamplePoints(vector<SamplePoints>& sps) {
+	int multiplier = 1;
+	for (auto riter = sps.rbegin(); riter != sps.rend(); ++riter) {
+		riter->idMultiplier = multiplier;
+		multiplier *= (int)riter->points.size();
+		detectUniformSpacing(*riter);
+	}
+}
+
+const char ProfileFile::MAGIC[4] = { 'S', 'o', 'G', 'P' };
+const TCHAR* const ProfileFile::BINARY_EXTENSION = _T(".sogp");
+
+bool ProfileFile::parseText(const TString& filename, ProfileSpace& psp, TString& error) {
+	// Load from filename and store profiles into psp
+	ifstream in(filename, ios::in);
+	if (!in) {
+		error = _T("Failed to open: ") + filename;
+		return false;
+	}
+
+	vector<SamplePoints>& sps = psp.paramSamplePoints;
+	vector<float>& profiles = psp.ownedProfiles;
+	vector<float>& sigmas = psp.sigmas;
+	sps.clear();
+	profiles.clear();
+	psp.mappedFile.reset();
+	psp.mappedProfiles = nullptr;
+	// Marks which (profile, channel) rows have been read
+	vector<bool> filled;
+	string line;
+	// The parser state
+	struct {
+		bool wantSamplePoints;
+		int rgbColumnIndex;
+		int minColumns;
+		int totalProfiles;
+	} state = {
+		true, 0, 0, 0
+	};
+
+	while (getLine(in, line)) {
+		istringstream iss(line);
+		// most vexing parse?
+		vector<string> tokens((istream_iterator<string>(iss)),
+			istream_iterator<string>());
+		if (state.wantSamplePoints) {
+			if (!tokens.size() || tokens[0] == "Param")
+				continue;
+			if (tokens[0] == "ID") {
+				state.wantSamplePoints = false;
+				// parse sigmas
+				int nParams = (int)sps.size();
+				state.rgbColumnIndex = nParams + 1;
+				if (tokens.size() < (size_t)state.rgbColumnIndex + 2) {
+					error = _T("Ill-formed coeffs file: ") + filename;
+					return false;
+				}
+				sigmas.clear();
+				for (size_t sigmaId = state.rgbColumnIndex + 1;
+					sigmaId < tokens.size(); sigmaId++)
+				{
+					const string& token = tokens[sigmaId];
+					if (token == "Error") break;
+					sigmas.push_back((float)atof(token.c_str()));
+				}
+				state.minColumns = (int)(state.rgbColumnIndex + 1 + psp.sigmas.size());
+				// prepare the sample points array
+				prepareSamplePoints(sps);
+				// prepare profile storage
+				state.totalProfiles = countProfiles(sps);
+				profiles.assign((size_t)state.totalProfiles * psp.profileStride(), 0.f);
+				filled.assign((size_t)state.totalProfiles * ProfileSpace::NUM_CHANNELS, false);
+			} else {
+				if (tokens.size() < 2)
+					continue;
+				// parse sample points
+				int nPoints = atoi(tokens[1].c_str());
+				if (tokens.size() - 2 < (size_t)nPoints)
+					continue;
+				SamplePoints points;
+				for (int ptId = 0; ptId < nPoints; ptId++) {
+					points.points.push_back(
+						(float)atof(tokens[ptId + 2].c_str()));
+				}
+				sps.push_back(points);
+			}
+		} else {
+			// parse individual profiles
+			if (tokens.size() < (size_t)state.minColumns)
+				continue;
+			const string& rgb = tokens[state.rgbColumnIndex];
+			if (rgb != "R" && rgb != "G" && rgb != "B")
+				continue;
+			int id = atoi(tokens[0].c_str());
+			if (id < state.totalProfiles && id >= 0) {
+				int channel = rgb == "R" ? 0 : (rgb == "G" ? 1 : 2);
+				float* sp = &profiles[(size_t)id * psp.profileStride() + channel * sigmas.size()];
+				for (int i = state.rgbColumnIndex + 1;
+					i < state.minColumns; i++)
+				{
+					*sp++ = (float)atof(tokens[i].c_str());
+				}
+				filled[id * ProfileSpace::NUM_CHANNELS + channel] = true;
+			}
+		}
+	}
+
+	// Check if all profiles have been filled
+	if (state.wantSamplePoints || std::find(filled.begin(), filled.end(), false) != filled.end()) {
+		error = _T("Insufficient data: ") + filename;
+		return false;
+	}
+
+	psp.numProfiles = state.totalProfiles;
+	return true;
+}
+
+bool ProfileFile::mapBinary(const TString& filename, ProfileSpace& psp, TString& error) {
+	shared_ptr<MappedFile> file(new MappedFile);
+	if (!file->open(filename)) {
+		error = _T("Failed to open: ") + filename;
+		return false;
+	}
+
+	const char* pBegin = (const char*)file->data();
+	const char* pEnd = pBegin + file->size();
+	const char* p = pBegin;
+	error = _T("Ill-formed profile table: ") + filename;
+
+	// Whether count items of size bytes are left in the file, checked before anything is
+	// allocated for them so that a corrupt count fails here
+	auto fits = [&p, pEnd] (uint64_t count, uint64_t size) -> bool {
+		return count <= (uint64_t)(pEnd - p) / size;
+	};
+	// Copies count items of size bytes out of the file, checking for truncation
+	auto read = [&p, &fits] (void* out, size_t count, size_t size) -> bool {
+		if (!fits(count, size))
+			return false;
+		memcpy(out, p, count * size);
+		p += count * size;
+		return true;
+	};
+
+	ProfileFileHeader header;
+	if (!read(&header, 1, sizeof(header)) || memcmp(header.magic, MAGIC, sizeof(MAGIC)))
+		return false;
+	if (header.version != ProfileFileHeader::CURRENT_VERSION) {
+		error = _T("Unsupported profile table version: ") + filename;
+		return false;
+	}
+	if (!header.numSigmas || !header.numDims
+		|| !fits(header.numSigmas, sizeof(float)) || !fits(header.numDims, sizeof(uint32_t)))
+	{
+		return false;
+	}
+
+	vector<float> sigmas(header.numSigmas);
+	if (!read(&sigmas[0], sigmas.size(), sizeof(float)))
+		return false;
+	vector<SamplePoints> sps(header.numDims);
+	for (SamplePoints& sp : sps) {
+		uint32_t numPoints;
+		if (!read(&numPoints, 1, sizeof(numPoints)) || !numPoints || !fits(numPoints, sizeof(float)))
+			return false;
+		sp.points.resize(numPoints);
+		if (!read(&sp.points[0], numPoints, sizeof(float)))
+			return false;
+	}
+	prepareSamplePoints(sps);
+	if ((uint32_t)countProfiles(sps) != header.numProfiles)
+		return false;
+
+	// The profile data is used in place. A table left half written may end before its data
+	// offset, which has to be ruled out before the bytes after it are counted.
+	uint64_t dataSize = (uint64_t)header.numProfiles * ProfileSpace::NUM_CHANNELS
+		* header.numSigmas * sizeof(float);
+	if (header.dataOffset < (size_t)(p - pBegin) || header.dataOffset % DATA_ALIGNMENT
+		|| header.dataOffset > file->size() || file->size() - header.dataOffset < dataSize)
+	{
+		return false;
+	}
+
+	psp.sigmas.swap(sigmas);
+	psp.paramSamplePoints.swap(sps);
+	psp.ownedProfiles.clear();
+	psp.mappedProfiles = (const float*)(pBegin + header.dataOffset);
+	psp.numProfiles = (int)header.numProfiles;
+	psp.mappedFile = file;
+	error.clear();
+	return true;
+}
+
+bool ProfileFile::writeBinary(const TString& filename, const ProfileSpace& psp) {
+	ofstream out(filename, ios::out | ios::binary | ios::trunc);
+	if (!out)
+		return false;
+
+	ProfileFileHeader header;
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = ProfileFileHeader::CURRENT_VERSION;
+	header.numSigmas = (uint32_t)psp.sigmas.size();
+	header.numDims = (uint32_t)psp.paramSamplePoints.size();
+	header.numProfiles = (uint32_t)psp.numProfiles;
+	size_t offset = sizeof(header) + psp.sigmas.size() * sizeof(float);
+	for (const SamplePoints& sp : psp.paramSamplePoints)
+		offset += sizeof(uint32_t) + sp.points.size() * sizeof(float);
+	header.dataOffset = (uint32_t)((offset + DATA_ALIGNMENT - 1) & ~(size_t)(DATA_ALIGNMENT - 1));
+
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)&psp.sigmas[0], psp.sigmas.size() * sizeof(float));
+	for (const SamplePoints& sp : psp.paramSamplePoints) {
+		uint32_t numPoints = (uint32_t)sp.points.size();
+		out.write((const char*)&numPoints, sizeof(numPoints));
+		out.write((const char*)&sp.points[0], numPoints * sizeof(float));
+	}
+	const char padding[DATA_ALIGNMENT] = { 0 };
+	out.write(padding, header.dataOffset - offset);
+	out.write((const char*)psp.profileData(),
+		(streamsize)psp.numProfiles * psp.profileStride() * sizeof(float));
+
+	out.close();
+	return !out.fail();
+}
+
+bool ProfileFile::convert(const TString& textFilename, const TString& binaryFilename, TString& error) {
+	ProfileSpace psp;
+	if (!parseText(textFilename, psp, error))
+		return false;
+	if (!writeBinary(binaryFilename, psp)) {
+		error = _T("Failed to write: ") + binaryFilename;
+		return false;
+	}
+	return true;
+}
+
+bool ProfileFile::isBinary(const TString& filename) {
+	ifstream in(filename, ios::in | ios::binary);
+	char magic[sizeof(MAGIC)];
+	if (!in.read(magic, sizeof(magic)))
+		return false;
+	return !memcmp(magic, MAGIC, sizeof(MAGIC));
+}
+
+TString ProfileFile::binaryFileNameFor(const TString& textFilename) {
+	return replaceExtension(textFilename, BINARY_EXTENSION);
+}
+
+TString ProfileFile::replaceExtension(const TString& filename, const TCHAR* extension) {
+	size_t dot = filename.find_last_of(_T('.'));
+	size_t slash = filename.find_last_of(_T("/\\"));
+	if (dot == TString::npos || (slash != TString::npos && dot < slash))
+		return filename + extension;
+	return filename.substr(0, dot) + extension;
+}
+
+bool ProfileFile::isUpToDate(const TString& binaryFilename, const TString& textFilename) {
+	struct _stat binaryStat, textStat;
+	if (_tstat(binaryFilename.c_str(), &binaryStat))
+		return false;
+	if (_tstat(textFilename.c_str(), &textStat))
+		return true;
+	return binaryStat.st_mtime >= textStat.st_mtime;
+}
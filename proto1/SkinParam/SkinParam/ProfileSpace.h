@@ -0,0 +1,123 @@
+
+/*
+    Copyright(c) 2013-2014 Yifan Wu.
+
+    This file is part of SkinParam.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/**
+ * Profile space storage and the binary profile table format
+ */
+
+#pragma once
+
+#include "Utils/MappedFile.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+namespace Skin {
+	struct SamplePoints {
+		SamplePoints() : idMultiplier(0), uniform(false), invSpacing(0.f) { }
+
+		std::vector<float> points;
+		int idMultiplier;
+		// Set by prepareSamplePoints: uniformly spaced axes are bracketed by direct indexing
+		bool uniform;
+		float invSpacing;
+	};
+
+	// Assigns the grid id multipliers and detects uniformly spaced axes
+	void prepareSamplePoints(std::vector<SamplePoints>& sps);
+
+	// The N-dimensional space of profiles
+	// Profiles are stored as one dense float array indexed [gridId][channel][sigma],
+	// either held in ownedProfiles or used in place from a mapped binary table.
+	struct ProfileSpace {
+		static const int NUM_CHANNELS = 3;
+
+		ProfileSpace() : numProfiles(0), mappedProfiles(nullptr) { }
+
+		std::vector<float> sigmas;
+		std::vector<SamplePoints> paramSamplePoints;
+		int numProfiles;
+
+		std::vector<float> ownedProfiles;
+		std::shared_ptr<Utils::MappedFile> mappedFile;
+		const float* mappedProfiles;
+
+		int profileStride() const {
+			return NUM_CHANNELS * (int)sigmas.size();
+		}
+		const float* profileData() const {
+			return mappedFile ? mappedProfiles : &ownedProfiles[0];
+		}
+		const float* profile(int gridId) const {
+			return profileData() + (size_t)gridId * profileStride();
+		}
+	};
+
+	// Binary profile table, all values little endian:
+	//   ProfileFileHeader
+	//   float sigmas[numSigmas]
+	//   for each dimension: uint32_t numPoints, float points[numPoints]
+	//   zero padding up to dataOffset (16-byte aligned)
+	//   float profiles[numProfiles][NUM_CHANNELS][numSigmas]
+	struct ProfileFileHeader {
+		static const uint32_t CURRENT_VERSION = 1;
+
+		char magic[4];
+		uint32_t version;
+		uint32_t numSigmas;
+		uint32_t numDims;
+		uint32_t numProfiles;
+		uint32_t dataOffset;
+	};
+
+	namespace ProfileFile {
+		extern const char MAGIC[4];
+		extern const TCHAR* const BINARY_EXTENSION;
+
+		// Reads the text table format produced by the offline fitter
+		bool parseText(const Utils::TString& filename, ProfileSpace& psp, Utils::TString& error);
+		// Maps a binary table and uses its profile data in place
+		bool mapBinary(const Utils::TString& filename, ProfileSpace& psp, Utils::TString& error);
+		bool writeBinary(const Utils::TString& filename, const ProfileSpace& psp);
+		// Converts a text table into a binary one
+		bool convert(const Utils::TString& textFilename, const Utils::TString& binaryFilename,
+			Utils::TString& error);
+
+		bool isBinary(const Utils::TString& filename);
+		// The file name used to cache the binary form of a text table
+		Utils::TString binaryFileNameFor(const Utils::TString& textFilename);
+		// Swaps the extension of filename for extension, which includes the dot
+		Utils::TString replaceExtension(const Utils::TString& filename, const TCHAR* extension);
+		// Whether binaryFilename exists and is not older than textFilename
+		bool isUpToDate(const Utils::TString& binaryFilename, const Utils::TString& textFilename);
+	} // namespace ProfileFile
+
+} // namespace Skin
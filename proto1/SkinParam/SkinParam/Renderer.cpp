@@ -36,6 +36,7 @@
 #include "stdafx.h"
 
 #include "Renderer.h"
+#include "LiveFitReport.h"
 #include "Config.h"
 #include "ShaderGroup.h"
 #include "Light.h"
@@ -44,6 +45,7 @@
 #include "FVector.h"
 #include "DirectXTex.h"
 #include "DXUT.h"
+#include <fstream>
 
 using namespace Skin;
 using namespace Utils;
@@ -123,6 +125,7 @@ Renderer::Renderer(HWND hwnd, CRect rectView, Config* pConfig, Camera* pCamera,
 	  m_bBloom(true),
 	  m_bDump(false),
 	  m_bUseLiveFit(false),
+	  m_bRefineWithLiveFit(false),
 	  m_bLiveFitAvailable(false),
 	  m_rsCurrent(RS_NotRendering),
 	  m_bPRAttenuationTexture(false),
@@ -194,11 +197,12 @@ Renderer::~Renderer() {
 	if (m_pDeviceContext)
 		m_pDeviceContext->ClearState();
 
-	if (m_pfutSSSGaussian) {
-		m_pfutSSSGaussian->abortWait();
-		delete m_pfutSSSGaussian;
-		m_pfutSSSGaussian = nullptr;
+	abortLiveComputation();
+	for (auto pFuture : m_abortedSSSGaussianFutures) {
+		pFuture->wait();
+		delete pFuture;
 	}
+	m_abortedSSSGaussianFutures.clear();
 }
 
 HRESULT Renderer::initDX() {
@@ -1773,17 +1777,37 @@ void Renderer::setSkinParams(const VariableParams& vps) {
 
 	if (m_bUseLiveFit)
 		startLiveComputation();
-	else if (m_pfutSSSGaussian) {
-		m_pfutSSSGaussian->abort();
-		delete m_pfutSSSGaussian;
-		m_pfutSSSGaussian = nullptr;
-	}
+	else
+		abortLiveComputation();
 }
 
 void Renderer::checkFutureGaussianParams() {
-	if (m_pfutSSSGaussian && std::future_status::ready == m_pfutSSSGaussian->wait_for(std::chrono::milliseconds(0))) {
+	auto isReady = [] (GaussianParamsCalculator::GaussianFuture* pFuture) {
+		return std::future_status::ready == pFuture->wait_for(std::chrono::milliseconds(0));
+	};
+	for (auto iter = m_abortedSSSGaussianFutures.begin(); iter != m_abortedSSSGaussianFutures.end(); ) {
+		if (isReady(*iter)) {
+			delete *iter;
+			iter = m_abortedSSSGaussianFutures.erase(iter);
+		} else {
+			++iter;
+		}
+	}
+
+	if (!m_pfutSSSGaussian)
+		return;
+	if (!isReady(m_pfutSSSGaussian)) {
+		// The coarse fit stands in until the refined one is ready
+		GaussianParams coarseParams;
+		if (m_pfutSSSGaussian->takeIntermediate(coarseParams) && m_bUseLiveFit)
+			setGaussianParams(coarseParams);
+	} else {
 		m_sssLiveFitGaussianParams = m_pfutSSSGaussian->get();
+		m_sssLiveFitReport = m_pfutSSSGaussian->report();
 		m_bLiveFitAvailable = true;
+		// The finished fit has refined the table around the current params
+		if (m_bRefineWithLiveFit)
+			m_sssGaussianParams = m_sssGaussianParamsCalculator.getParams(m_sssSkinParams);
 		if (m_bUseLiveFit)
 			setGaussianParams(m_sssLiveFitGaussianParams);
 
@@ -1801,18 +1825,38 @@ double Renderer::getLiveFitProgress() const {
 }
 
 
+bool Renderer::dumpLiveFitReport(const TString& strFileName) const {
+	if (!m_sssLiveFitReport)
+		return false;
+
+	std::ofstream out(strFileName, std::ios::trunc);
+	if (!out)
+		return false;
+	m_sssLiveFitReport->writeJSON(out);
+	return true;
+}
+
+
 void Renderer::startLiveComputation() {
 	// start live computation of SoG
-	if (m_pfutSSSGaussian) {
-		m_pfutSSSGaussian->abort();
-		delete m_pfutSSSGaussian;
-	}
+	abortLiveComputation();
 
 	m_pfutSSSGaussian = new GaussianParamsCalculator::GaussianFuture(
 		m_sssGaussianParamsCalculator.getLiveFitParams(m_sssSkinParams));
 }
 
 
+void Renderer::abortLiveComputation() {
+	if (!m_pfutSSSGaussian)
+		return;
+
+	// Waiting for the running tasks would stall the UI, the fit is deleted once it returns
+	m_pfutSSSGaussian->abort();
+	m_abortedSSSGaussianFutures.push_back(m_pfutSSSGaussian);
+	m_pfutSSSGaussian = nullptr;
+}
+
+
 void Renderer::setUseLiveFit(bool bUseLiveFit) {
 	m_bUseLiveFit = bUseLiveFit;
 
@@ -1828,6 +1872,15 @@ void Renderer::setUseLiveFit(bool bUseLiveFit) {
 	}
 }
 
+void Renderer::setRefineWithLiveFit(bool bRefineWithLiveFit) {
+	m_bRefineWithLiveFit = bRefineWithLiveFit;
+	m_sssGaussianParamsCalculator.setAdaptiveRefinement(bRefineWithLiveFit);
+
+	m_sssGaussianParams = m_sssGaussianParamsCalculator.getParams(m_sssSkinParams);
+	if (!m_bUseLiveFit || !m_bLiveFitAvailable)
+		setGaussianParams(m_sssGaussianParams);
+}
+
 void Renderer::dumpMelaninTexture(UINT width, UINT height, float maxmel, const TString& filename) {
 	typedef XMFLOAT4 MTT;
 	static const DXGI_FORMAT TexFormat = DXGI_FORMAT_R32G32B32A32_FLOAT;
@@ -1908,5 +1961,9 @@ void Renderer::renderHemoglobinTexture(UINT width, UINT height) {
 }
 
 double Renderer::perfMilliseconds() const {
-	return m_sssGaussianParamsCalculator.perf().count() / 1000.;
+	return m_sssGaussianParamsCalculator.perf().count() / 1000000.;
+}
+
+std::vector<GaussianParamsCalculator::PerfSample> Renderer::perfByResolution() const {
+	return m_sssGaussianParamsCalculator.perfByResolution();
 }
@@ -112,8 +112,11 @@ namespace Skin {
 		VariableParams m_sssSkinParams;
 		GaussianParamsCalculator m_sssGaussianParamsCalculator;
 		GaussianParamsCalculator::GaussianFuture* m_pfutSSSGaussian;
+		// Aborted live fits finishing their running tasks, deleted once ready
+		std::vector<GaussianParamsCalculator::GaussianFuture*> m_abortedSSSGaussianFutures;
 		bool m_bLiveFitAvailable;
 		GaussianParams m_sssLiveFitGaussianParams;
+		std::shared_ptr<const LiveFitReport> m_sssLiveFitReport;
 
 		struct GaussianConstantBuffer {
 			float g_blurWidth; // blur width
@@ -310,6 +313,7 @@ namespace Skin {
 		bool m_bDump;
 		UINT m_nDumpCount;
 		bool m_bUseLiveFit;
+		bool m_bRefineWithLiveFit;
 
 		static const TCHAR* DEFAULT_DUMP_FOLDER;
 
@@ -387,6 +391,7 @@ namespace Skin {
 
 		void checkFutureGaussianParams();
 		void startLiveComputation();
+		void abortLiveComputation();
 		void setGaussianParams(const GaussianParams& params);
 		void updateSSSConstantBufferForParams(const GaussianParams& params);
 
@@ -431,12 +436,16 @@ namespace Skin {
 		GST_BOOL(Bloom)
 		GETTER(UseLiveFit, bool, b) TOGGLE(UseLiveFit)
 		void setUseLiveFit(bool bUseLiveFit);
+		GETTER(RefineWithLiveFit, bool, b) TOGGLE(RefineWithLiveFit)
+		void setRefineWithLiveFit(bool bRefineWithLiveFit);
 
 		float getSSSStrength() const { return m_cbSSS.g_sss_strength; }
 		void setSSSStrength(float strength) { m_cbSSS.g_sss_strength = strength; }
 		VariableParams getSkinParams() const { return m_sssSkinParams; }
 		void setSkinParams(const VariableParams& vps);
 		double getLiveFitProgress() const;
+		// Writes the report of the last finished live fit as JSON, false if there is none
+		bool dumpLiveFitReport(const Utils::TString& strFileName) const;
 		void dump();
 
 		D3D_DRIVER_TYPE getDriverType() const { return m_driverType; }
@@ -481,6 +490,7 @@ namespace Skin {
 		void renderMelaninTexture(UINT width, UINT height);
 		void renderHemoglobinTexture(UINT width, UINT height);
 		double perfMilliseconds() const;
+		std::vector<GaussianParamsCalculator::PerfSample> perfByResolution() const;
 	};
 
 } // namespace Skin